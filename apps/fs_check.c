@@ -0,0 +1,124 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+/* Exit status */
+enum {
+	CHECK_CLEAN,
+	CHECK_ERRORS,
+	CHECK_FAILED,
+};
+
+static struct {
+	const char *name;
+	enum block_backend backend;
+} backends[] = {
+	{ "file",	BLOCK_BACKEND_FILE },
+	{ "mmap",	BLOCK_BACKEND_MMAP },
+	{ "uring",	BLOCK_BACKEND_URING },
+	{ "direct",	BLOCK_BACKEND_DIRECT },
+};
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-r] [-v] [-j threads] [-b backend] <diskname>...\n"
+		"\t-r\trepair the problems found\n"
+		"\t-v\tprint each problem found\n"
+		"\t-j\tthreads per file system, one per CPU by default\n"
+		"\t-b\tbackend: file (default), mmap, uring, direct\n"
+		"Exit status: 0 if every file system is consistent, 1 if problems are\n"
+		"left, 2 if a file system cannot be checked\n", program);
+	exit(CHECK_FAILED);
+}
+
+void print_phases(const unsigned long long *phase_ns)
+{
+	int p;
+
+	for (p = 0; p < FS_CHECK_PHASES; p++)
+		printf(" %s %.3f ms", fs_check_phase_name(p), phase_ns[p] / 1e6);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long phase_ns[FS_CHECK_PHASES] = { 0 };
+	struct fs_check_opts opts = { .backend = BLOCK_BACKEND_FILE };
+	size_t clean = 0, left = 0, failed = 0, i;
+	struct fs_check_report report;
+	int c, p;
+
+	while ((c = getopt(argc, argv, "rvj:b:")) != -1) {
+		switch (c) {
+		case 'r':
+			opts.repair = 1;
+			break;
+		case 'v':
+			opts.verbose = 1;
+			break;
+		case 'j':
+			opts.threads = atoi(optarg);
+			break;
+		case 'b':
+			for (i = 0; i < ARRAY_SIZE(backends); i++)
+				if (!strcmp(optarg, backends[i].name))
+					break;
+			if (i == ARRAY_SIZE(backends))
+				usage(argv[0]);
+			opts.backend = backends[i].backend;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+
+	for (; optind < argc; optind++) {
+		const char *diskname = argv[optind];
+
+		if (opts.verbose)
+			printf("%s:\n", diskname);
+		if (fs_check(diskname, &opts, &report)) {
+			printf("%s: cannot check\n", diskname);
+			failed++;
+			continue;
+		}
+		for (p = 0; p < FS_CHECK_PHASES; p++)
+			phase_ns[p] += report.phase_ns[p];
+
+		printf("%s: %zu files, %zu used and %zu free blocks, ", diskname,
+		       report.files, report.used_blocks, report.free_blocks);
+		if (!report.errors) {
+			printf("clean\n");
+			clean++;
+		} else {
+			printf("%zu problems (%zu bad entries, %zu bad links, %zu cycles, %zu cross-links, %zu bad sizes, %zu bad groups, %zu orphans, %zu bad counts), %zu repaired\n",
+			       report.errors, report.bad_entries, report.bad_links,
+			       report.cycles, report.cross_links, report.bad_sizes,
+			       report.bad_groups, report.orphans, report.bad_counts,
+			       report.repaired);
+			if (report.repaired < report.errors)
+				left++;
+			else
+				clean++;
+		}
+		printf("%s: %u threads,", diskname, report.threads);
+		print_phases(report.phase_ns);
+	}
+
+	if (clean + left + failed > 1) {
+		printf("%zu file systems: %zu consistent, %zu with problems, %zu not checked\ntotal:",
+		       clean + left + failed, clean, left, failed);
+		print_phases(phase_ns);
+	}
+
+	if (failed)
+		return CHECK_FAILED;
+	return left ? CHECK_ERRORS : CHECK_CLEAN;
+}
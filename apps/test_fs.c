@@ -1,14 +1,19 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <crc32c.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -34,6 +39,154 @@ struct thread_arg {
 	char **argv;
 };
 
+static struct {
+	const char *name;
+	enum block_backend backend;
+} backends[] = {
+	{ "file",	BLOCK_BACKEND_FILE },
+	{ "mmap",	BLOCK_BACKEND_MMAP },
+	{ "uring",	BLOCK_BACKEND_URING },
+	{ "direct",	BLOCK_BACKEND_DIRECT },
+	{ "sim",	BLOCK_BACKEND_SIM },
+	{ "ram",	BLOCK_BACKEND_RAM },
+	{ "ram_huge",	BLOCK_BACKEND_RAM_HUGE },
+};
+
+static struct {
+	const char *name;
+	enum block_sim_profile profile;
+} sim_profiles[] = {
+	{ "hdd",	BLOCK_SIM_HDD },
+	{ "ssd",	BLOCK_SIM_SATA_SSD },
+	{ "nvme",	BLOCK_SIM_NVME },
+};
+
+static struct {
+	const char *name;
+	enum fs_fat_load mode;
+} fat_loads[] = {
+	{ "lazy",	FS_FAT_LAZY },
+	{ "prefetch",	FS_FAT_PREFETCH },
+	{ "eager",	FS_FAT_EAGER },
+};
+
+static struct {
+	const char *name;
+	enum cache_policy policy;
+} policies[] = {
+	{ "clock",	CACHE_POLICY_CLOCK },
+	{ "arc",	CACHE_POLICY_ARC },
+};
+
+size_t get_argv(char *argv);
+
+/* Fill in @opts with the mount options found in the environment */
+void get_mount_opts(struct fs_mount_opts *opts)
+{
+	struct fs_mount_opts defaults = { .backend = BLOCK_BACKEND_FILE };
+	static struct block_sim sim;
+	char *env;
+	size_t i;
+
+	*opts = defaults;
+
+	env = getenv("FS_BACKEND");
+	if (env) {
+		for (i = 0; i < ARRAY_SIZE(backends); i++)
+			if (!strcmp(env, backends[i].name))
+				break;
+		if (i == ARRAY_SIZE(backends))
+			die("invalid backend '%s'", env);
+		opts->backend = backends[i].backend;
+	}
+
+	env = getenv("FS_CACHE_BLOCKS");
+	if (env)
+		opts->cache_blocks = get_argv(env);
+
+	env = getenv("FS_CACHE_POLICY");
+	if (env) {
+		for (i = 0; i < ARRAY_SIZE(policies); i++)
+			if (!strcmp(env, policies[i].name))
+				break;
+		if (i == ARRAY_SIZE(policies))
+			die("invalid cache policy '%s'", env);
+		opts->cache_policy = policies[i].policy;
+	}
+
+	env = getenv("FS_FAT_LOAD");
+	if (env) {
+		for (i = 0; i < ARRAY_SIZE(fat_loads); i++)
+			if (!strcmp(env, fat_loads[i].name))
+				break;
+		if (i == ARRAY_SIZE(fat_loads))
+			die("invalid FAT loading '%s'", env);
+		opts->fat_load = fat_loads[i].mode;
+	}
+
+	if (getenv("FS_SPARSE"))
+		opts->sparse = 1;
+
+	if (getenv("FS_CHECKSUMS"))
+		opts->checksums = 1;
+
+	if (getenv("FS_COMPRESS"))
+		opts->compress = 1;
+
+	if (getenv("FS_DEDUP"))
+		opts->dedup = 1;
+
+	if (getenv("FS_WRITEBACK"))
+		opts->writeback.enabled = 1;
+	env = getenv("FS_DIRTY_EXPIRE_MS");
+	if (env)
+		opts->writeback.expire_ms = get_argv(env);
+	env = getenv("FS_DIRTY_BACKGROUND_RATIO");
+	if (env)
+		opts->writeback.background_ratio = get_argv(env);
+	env = getenv("FS_DIRTY_RATIO");
+	if (env)
+		opts->writeback.dirty_ratio = get_argv(env);
+
+	env = getenv("FS_JOURNAL");
+	if (env)
+		opts->journal_blocks = get_argv(env);
+
+	/* Simulated disk model, an NVMe drive unless told otherwise */
+	if (opts->backend == BLOCK_BACKEND_SIM) {
+		block_sim_profile(BLOCK_SIM_NVME, &sim);
+		env = getenv("FS_SIM");
+		if (env) {
+			for (i = 0; i < ARRAY_SIZE(sim_profiles); i++)
+				if (!strcmp(env, sim_profiles[i].name))
+					break;
+			if (i == ARRAY_SIZE(sim_profiles))
+				die("invalid simulated disk '%s'", env);
+			block_sim_profile(sim_profiles[i].profile, &sim);
+		}
+		env = getenv("FS_SIM_ERRORS");
+		if (env)
+			sim.read_error_rate = sim.write_error_rate =
+				strtod(env, NULL);
+		env = getenv("FS_SIM_FAIL_AFTER");
+		if (env)
+			sim.fail_after = get_argv(env);
+		env = getenv("FS_SIM_SEED");
+		if (env)
+			sim.seed = get_argv(env);
+		opts->sim = &sim;
+	}
+}
+
+/* Mount @diskname with the options found in the environment */
+int mount_fs(const char *diskname)
+{
+	struct fs_mount_opts opts;
+
+	get_mount_opts(&opts);
+	return fs_mount_with(diskname, &opts);
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -87,7 +240,7 @@ void thread_fs_script(void *arg)
 			break;
 
 		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+			if (mount_fs(diskname))
 				die("Cannot mount disk");
 			else {
 				printf("MOUNT successful.\n");
@@ -282,7 +435,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_fs(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -329,7 +482,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_fs(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -384,7 +537,7 @@ void thread_fs_rm(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_fs(diskname))
 		die("Cannot mount diskname");
 
 	if (fs_delete(filename)) {
@@ -430,7 +583,7 @@ void thread_fs_add(void *arg)
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
 	 */
-	if (fs_mount(diskname))
+	if (mount_fs(diskname))
 		die("Cannot mount diskname");
 
 	if (fs_create(filename)) {
@@ -471,7 +624,7 @@ void thread_fs_ls(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (mount_fs(diskname))
 		die("Cannot mount diskname");
 
 	fs_ls();
@@ -490,7 +643,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (mount_fs(diskname))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -499,6 +652,1476 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_statfs(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_statfs st;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (mount_fs(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	if (fs_statfs(&st))
+		die("Cannot get space usage");
+	printf("blk_size=%zu total_blk_count=%zu data_blk_count=%zu free_blk_count=%zu files=%zu free_files=%zu\n",
+	       st.block_size, st.total_blocks, st.data_blocks, st.free_blocks,
+	       st.files, st.free_files);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Current time in seconds */
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Standard check value of CRC32C, the checksum of "123456789" */
+#define CRC32C_CHECK 0xE3069283
+
+/* Buffers checksummed by crc_check(), in their pool */
+#define CRC_CASES 512
+
+struct crc_case {
+	size_t off;
+	size_t len;
+	size_t split;
+};
+
+/*
+ * Check that the implementation in use gives the standard check value, and
+ * the checksums @ref of @cases over @buf, also when computed in two calls.
+ * Returns -1 on a mismatch
+ */
+int crc_check(const char *buf, const struct crc_case *cases,
+	      const uint32_t *ref)
+{
+	const struct crc_case *c;
+	uint32_t crc, split;
+	size_t i;
+
+	crc = crc32c(0, "123456789", 9);
+	if (crc != CRC32C_CHECK) {
+		printf("crc32c: check value %08x instead of %08x\n", crc,
+		       CRC32C_CHECK);
+		return -1;
+	}
+	for (i = 0; i < CRC_CASES; i++) {
+		c = &cases[i];
+		crc = crc32c(0, buf + c->off, c->len);
+		split = crc32c(crc32c(0, buf + c->off, c->split),
+			       buf + c->off + c->split, c->len - c->split);
+		if (crc != ref[i] || split != ref[i]) {
+			printf("crc32c: %08x then %08x in two calls instead of %08x over %zu bytes at offset %zu\n",
+			       crc, split, ref[i], c->len, c->off);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Speed of each CRC32C implementation supported, once checked against the
+ * portable one on buffers of any alignment and length, see crc_check()
+ */
+void thread_bench_crc(void *arg)
+{
+	struct crc_case cases[CRC_CASES];
+	struct thread_arg *t_arg = arg;
+	size_t mib = 1024, bytes, off, i;
+	uint32_t ref[CRC_CASES], crc = 0;
+	enum crc32c_impl impl;
+	double t;
+	char *buf;
+
+	if (t_arg->argc >= 1)
+		mib = get_argv(t_arg->argv[0]);
+	bytes = mib << 20;
+
+	/* Checksum blocks one by one, as the block layer does */
+	buf = malloc(BLOCK_POOL_BLOCKS * BLOCK_SIZE);
+	if (!buf)
+		die_perror("malloc");
+	for (i = 0; i < BLOCK_POOL_BLOCKS * BLOCK_SIZE; i++)
+		buf[i] = rand();
+
+	/* Short, around the streams of a block, then up to the whole pool */
+	for (i = 0; i < CRC_CASES; i++) {
+		cases[i].off = rand() % 64;
+		if (i < CRC_CASES / 4)
+			cases[i].len = i;
+		else if (i < CRC_CASES * 3 / 4)
+			cases[i].len = rand() % (3 * BLOCK_SIZE);
+		else
+			cases[i].len = rand() % (BLOCK_POOL_BLOCKS * BLOCK_SIZE - 64);
+		cases[i].split = cases[i].len ? rand() % cases[i].len : 0;
+	}
+	if (crc32c_use(CRC32C_IMPL_PORTABLE))
+		die("Cannot use the portable crc32c");
+	for (i = 0; i < CRC_CASES; i++)
+		ref[i] = crc32c(0, buf + cases[i].off, cases[i].len);
+
+	for (impl = CRC32C_IMPL_PORTABLE; impl <= CRC32C_IMPL_SSE42_PCLMUL;
+	     impl++) {
+		if (crc32c_use(impl)) {
+			printf("crc32c %-14s unsupported\n",
+			       crc32c_impl_name(impl));
+			continue;
+		}
+		if (crc_check(buf, cases, ref))
+			die("crc32c %s gives wrong checksums",
+			    crc32c_impl_name(impl));
+		t = now();
+		for (off = 0; off < bytes; off += BLOCK_SIZE)
+			crc ^= crc32c(0, buf + off % (BLOCK_POOL_BLOCKS *
+						       BLOCK_SIZE), BLOCK_SIZE);
+		t = now() - t;
+		printf("crc32c %-14s %8.1f ms/GiB %6.2f GiB/s\n",
+		       crc32c_impl_name(impl), t * 1e3 * 1024 / mib,
+		       mib / 1024.0 / t);
+	}
+
+	/* Keep the checksums alive */
+	if (crc == 1)
+		printf("\n");
+	free(buf);
+}
+
+/*
+ * Cost of deduplication on fs_write(): write copies of a host file without
+ * then with deduplication, and time the writes and the closes (where blocks
+ * get shared) separately
+ */
+void thread_bench_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	char name[32];
+	struct fs_mount_opts opts;
+	double t, t_write, t_close;
+	size_t copies = 8, i;
+	int fd, fs_fd, dedup;
+	struct stat st;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [copies]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	if (t_arg->argc >= 3)
+		copies = get_argv(t_arg->argv[2]);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die_perror("mmap");
+
+	for (dedup = 0; dedup <= 1; dedup++) {
+		get_mount_opts(&opts);
+		opts.dedup = dedup;
+		if (fs_mount_with(diskname, &opts))
+			die("Cannot mount diskname");
+
+		t_write = t_close = 0;
+		for (i = 0; i < copies; i++) {
+			snprintf(name, sizeof(name), "bench%zu", i);
+			if (fs_create(name))
+				die("Cannot create file '%s'", name);
+			fs_fd = fs_open(name);
+			if (fs_fd < 0)
+				die("Cannot open file '%s'", name);
+
+			t = now();
+			if (fs_write(fs_fd, buf, st.st_size) != st.st_size)
+				die("Cannot write file '%s'", name);
+			t_write += now() - t;
+
+			t = now();
+			fs_close(fs_fd);
+			t_close += now() - t;
+		}
+
+		printf("dedup=%d write %8.1f MiB/s close %8.3f ms/file\n",
+		       dedup, copies * st.st_size / 1048576.0 / t_write,
+		       t_close * 1e3 / copies);
+		if (dedup)
+			fs_info();
+
+		for (i = 0; i < copies; i++) {
+			snprintf(name, sizeof(name), "bench%zu", i);
+			fs_delete(name);
+		}
+		if (fs_umount())
+			die("Cannot unmount %s", t_arg->argv[0]);
+	}
+
+	munmap(buf, st.st_size);
+	close(fd);
+}
+
+/*
+ * End-to-end cost of writing @size bytes of @buf to a new file of @diskname
+ * mounted with @opts, writing it back to the disk, and reading it back after
+ * remounting, with requests of @io_size bytes. Returns -1 if the disk cannot be
+ * mounted with @opts.
+ */
+int bench_rw(const char *diskname, const struct fs_mount_opts *opts,
+	     char *buf, size_t size, size_t io_size)
+{
+	double t, t_write, t_flush, t_read;
+	size_t off, len;
+	int fs_fd;
+	char *out;
+
+	out = malloc(io_size);
+	if (!out)
+		die_perror("malloc");
+
+	if (fs_mount_with(diskname, opts)) {
+		free(out);
+		return -1;
+	}
+	if (fs_create("bench_rw"))
+		die("Cannot create file");
+	fs_fd = fs_open("bench_rw");
+	if (fs_fd < 0)
+		die("Cannot open file");
+
+	t = now();
+	for (off = 0; off < size; off += len) {
+		len = size - off < io_size ? size - off : io_size;
+		if (fs_write(fs_fd, buf + off, len) != (int)len)
+			die("Cannot write file");
+	}
+	t_write = now() - t;
+
+	fs_close(fs_fd);
+	t = now();
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	t_flush = now() - t;
+
+	if (fs_mount_with(diskname, opts))
+		die("Cannot mount diskname");
+	fs_fd = fs_open("bench_rw");
+	if (fs_fd < 0)
+		die("Cannot open file");
+
+	t = now();
+	for (off = 0; off < size; off += len) {
+		len = size - off < io_size ? size - off : io_size;
+		if (fs_read(fs_fd, out, len) != (int)len ||
+		    memcmp(out, buf + off, len))
+			die("Cannot read file back");
+	}
+	t_read = now() - t;
+
+	fs_close(fs_fd);
+	fs_delete("bench_rw");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("write %8.1f MiB/s flush %8.3f ms read %8.1f MiB/s\n",
+	       size / 1048576.0 / t_write, t_flush * 1e3,
+	       size / 1048576.0 / t_read);
+
+	free(out);
+	return 0;
+}
+
+/* Map host file @filename in memory, setting @size to its size */
+char *map_host_file(const char *filename, size_t *size)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die_perror("mmap");
+	close(fd);
+
+	*size = st.st_size;
+	return buf;
+}
+
+/*
+ * Run bench_rw() once with the mount options found in the environment. Meant to
+ * be run with the various backends, simulated disks and cache settings
+ */
+void thread_bench_rw(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mount_opts opts;
+	size_t io_size = BLOCK_SIZE, size;
+	char *buf;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [request size]");
+
+	if (t_arg->argc >= 3)
+		io_size = get_argv(t_arg->argv[2]);
+	if (!io_size)
+		die("invalid request size");
+
+	buf = map_host_file(t_arg->argv[1], &size);
+	get_mount_opts(&opts);
+	if (bench_rw(t_arg->argv[0], &opts, buf, size, io_size))
+		die("Cannot mount diskname");
+
+	munmap(buf, size);
+}
+
+/*
+ * Run bench_rw() with every built-in backend in turn, through its operations
+ * table, and otherwise the same mount options. Backends that cannot open the
+ * disk on this host (e.g. O_DIRECT on tmpfs) are skipped.
+ */
+void thread_bench_backends(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mount_opts opts, env_opts;
+	size_t io_size = BLOCK_SIZE, size, i;
+	char *buf;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [request size]");
+
+	if (t_arg->argc >= 3)
+		io_size = get_argv(t_arg->argv[2]);
+	if (!io_size)
+		die("invalid request size");
+
+	buf = map_host_file(t_arg->argv[1], &size);
+	get_mount_opts(&env_opts);
+
+	for (i = 0; i < ARRAY_SIZE(backends); i++) {
+		opts = env_opts;
+		opts.backend = backends[i].backend;
+		opts.ops = block_backend_ops(backends[i].backend);
+		if (opts.backend != BLOCK_BACKEND_SIM)
+			opts.sim = NULL;
+
+		printf("%-9s ", opts.ops->name);
+		fflush(stdout);
+		if (bench_rw(t_arg->argv[0], &opts, buf, size, io_size))
+			printf("skipped, cannot mount\n");
+	}
+
+	munmap(buf, size);
+}
+
+struct sync_worker {
+	fs_volume_t *vol;
+	size_t id;
+	size_t syncs;
+	int failed;
+};
+
+/* Append a block to a file of its own and make it durable, @syncs times */
+void *sync_worker(void *arg)
+{
+	struct sync_worker *w = arg;
+	char name[32], buf[BLOCK_SIZE];
+	size_t i;
+	int fd;
+
+	snprintf(name, sizeof(name), "sync%zu", w->id);
+	memset(buf, 'a' + w->id % 26, sizeof(buf));
+	if (fs_create_ex(w->vol, name) ||
+	    (fd = fs_open_ex(w->vol, name)) < 0) {
+		w->failed = 1;
+		return NULL;
+	}
+
+	for (i = 0; i < w->syncs && !w->failed; i++)
+		if (fs_write_ex(w->vol, fd, buf, sizeof(buf)) != sizeof(buf) ||
+		    fs_fsync_ex(w->vol, fd))
+			w->failed = 1;
+
+	fs_close_ex(w->vol, fd);
+	fs_delete_ex(w->vol, name);
+	return NULL;
+}
+
+/*
+ * Writers that each make every write durable, all at once on the same volume:
+ * with group commit, disk flushes are shared between them
+ */
+void thread_bench_sync(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	size_t nthreads = 8, syncs = 100, i;
+	struct fs_mount_opts opts;
+	struct fs_sync_stats stats;
+	struct sync_worker *workers;
+	pthread_t *threads;
+	fs_volume_t *vol;
+	double t;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [threads] [syncs per thread]");
+
+	if (t_arg->argc >= 2)
+		nthreads = get_argv(t_arg->argv[1]);
+	if (t_arg->argc >= 3)
+		syncs = get_argv(t_arg->argv[2]);
+	if (!nthreads || nthreads > FS_OPEN_MAX_COUNT)
+		die("invalid thread count");
+
+	workers = calloc(nthreads, sizeof(*workers));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!workers || !threads)
+		die_perror("calloc");
+
+	get_mount_opts(&opts);
+	vol = fs_mount_ex(t_arg->argv[0], &opts);
+	if (!vol)
+		die("Cannot mount diskname");
+
+	t = now();
+	for (i = 0; i < nthreads; i++) {
+		workers[i].vol = vol;
+		workers[i].id = i;
+		workers[i].syncs = syncs;
+		if (pthread_create(&threads[i], NULL, sync_worker, &workers[i]))
+			die("Cannot create thread");
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		if (workers[i].failed)
+			die("Cannot write file");
+	}
+	t = now() - t;
+
+	fs_sync_stats_ex(vol, &stats);
+	if (fs_umount_ex(vol))
+		die("Cannot unmount diskname");
+
+	printf("threads %zu syncs %zu commits %zu (%.1f syncs/commit) %.0f syncs/s\n",
+	       nthreads, stats.requests, stats.commits,
+	       (double)stats.requests / stats.commits, stats.requests / t);
+
+	free(threads);
+	free(workers);
+}
+
+/*
+ * A long-lived writer going through a cache, with and without background
+ * writeback: how long its writes take, and how long unmounting stalls to
+ * write back what is left
+ */
+void thread_bench_writeback(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	size_t mib = 64, chunk = 65536, pause_us = 200, i, n, m;
+	struct fs_writeback_stats stats;
+	struct fs_mount_opts opts;
+	struct timespec pause;
+	double t, t_write, t_max, t_umount;
+	fs_volume_t *vol;
+	char *buf;
+	int fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [MiB] [pause between writes in us]");
+
+	if (t_arg->argc >= 2)
+		mib = get_argv(t_arg->argv[1]);
+	if (t_arg->argc >= 3)
+		pause_us = get_argv(t_arg->argv[2]);
+	pause.tv_sec = pause_us / 1000000;
+	pause.tv_nsec = pause_us % 1000000 * 1000;
+	n = mib * 1024 * 1024 / chunk;
+
+	buf = malloc(chunk);
+	if (!buf)
+		die_perror("malloc");
+	for (i = 0; i < chunk; i++)
+		buf[i] = rand();
+
+	get_mount_opts(&opts);
+	if (!opts.cache_blocks)
+		opts.cache_blocks = 4096;
+	if (!opts.writeback.expire_ms)
+		opts.writeback.expire_ms = 200;
+	opts.writeback.interval_ms = opts.writeback.expire_ms / 4;
+
+	for (m = 0; m < 2; m++) {
+		opts.writeback.enabled = m;
+		vol = fs_mount_ex(t_arg->argv[0], &opts);
+		if (!vol)
+			die("Cannot mount diskname");
+		fs_delete_ex(vol, "writeback");
+		if (fs_create_ex(vol, "writeback") ||
+		    (fd = fs_open_ex(vol, "writeback")) < 0)
+			die("Cannot create file");
+
+		t_write = t_max = 0;
+		for (i = 0; i < n; i++) {
+			t = now();
+			if (fs_write_ex(vol, fd, buf, chunk) != (int)chunk)
+				die("Cannot write file");
+			t = now() - t;
+			t_write += t;
+			if (t > t_max)
+				t_max = t;
+			nanosleep(&pause, NULL);
+		}
+		fs_close_ex(vol, fd);
+		fs_writeback_stats_ex(vol, &stats);
+
+		t = now();
+		if (fs_umount_ex(vol))
+			die("Cannot unmount %s", t_arg->argv[0]);
+		t_umount = now() - t;
+
+		printf("writeback %-3s write %8.1f MiB/s max %8.1f us umount %8.1f ms\n",
+		       m ? "on" : "off", mib / t_write, t_max * 1e6,
+		       t_umount * 1e3);
+		printf("  wakeups %zu expired %zu background %zu blocks %zu throttled %zu (%.1f ms)\n",
+		       stats.wakeups, stats.expired, stats.background,
+		       stats.blocks, stats.throttled, stats.throttle_ns / 1e6);
+	}
+	free(buf);
+}
+
+/*
+ * Run bench_rw() on file systems of every block size in turn, each created on
+ * @diskname with room for twice the host file
+ */
+void thread_bench_block_size(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mount_opts opts;
+	size_t io_size = BLOCK_SIZE, size, bs, nblocks;
+	char *buf;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [request size]");
+
+	if (t_arg->argc >= 3)
+		io_size = get_argv(t_arg->argv[2]);
+	if (!io_size)
+		die("invalid request size");
+
+	buf = map_host_file(t_arg->argv[1], &size);
+	get_mount_opts(&opts);
+
+	for (bs = FS_BLOCK_SIZE_MIN; bs <= FS_BLOCK_SIZE_MAX; bs *= 2) {
+		nblocks = 2 * size / bs + 1;
+		printf("%6zu KiB ", bs / 1024);
+		fflush(stdout);
+		if (fs_format(t_arg->argv[0], nblocks, bs)) {
+			printf("skipped, too large\n");
+			continue;
+		}
+		if (bench_rw(t_arg->argv[0], &opts, buf, size, io_size))
+			die("Cannot mount diskname");
+	}
+
+	munmap(buf, size);
+}
+
+/*
+ * Cost of mounting images of increasing sizes, each holding a single small
+ * file, to read that file, with each way of loading the FAT
+ */
+void thread_bench_mount(void *arg)
+{
+	static const size_t sizes[] = { 1024, 8192, 32768, 65500 };
+	struct thread_arg *t_arg = arg;
+	size_t block_size = FS_BLOCK_SIZE_MIN, iters = 20, i, m, k;
+	double t, t_mount, t_total;
+	struct fs_mount_opts opts;
+	struct block_stats bs;
+	char buf[64];
+	int fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [block size] [iterations]");
+
+	if (t_arg->argc >= 2)
+		block_size = get_argv(t_arg->argv[1]);
+	if (t_arg->argc >= 3)
+		iters = get_argv(t_arg->argv[2]);
+	if (!iters)
+		die("invalid iteration count");
+
+	get_mount_opts(&opts);
+	block_stats_enable(1);
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		if (fs_format(t_arg->argv[0], sizes[i], block_size))
+			die("Cannot create disk");
+		if (fs_mount_with(t_arg->argv[0], &opts) ||
+		    fs_create("small") || (fd = fs_open("small")) < 0 ||
+		    fs_write(fd, "hello\n", 6) != 6 || fs_close(fd) ||
+		    fs_umount())
+			die("Cannot create file");
+
+		for (m = 0; m < ARRAY_SIZE(fat_loads); m++) {
+			opts.fat_load = fat_loads[m].mode;
+			t_mount = t_total = 0;
+			block_stats_reset();
+			for (k = 0; k < iters; k++) {
+				t = now();
+				if (fs_mount_with(t_arg->argv[0], &opts))
+					die("Cannot mount diskname");
+				t_mount += now() - t;
+				fd = fs_open("small");
+				if (fd < 0 || fs_read(fd, buf, sizeof(buf)) != 6)
+					die("Cannot read file");
+				fs_close(fd);
+				if (fs_umount())
+					die("Cannot unmount %s", t_arg->argv[0]);
+				t_total += now() - t;
+			}
+			block_stats_get(&bs);
+			printf("%6zu blocks %-8s mount %8.1f us total %8.1f us read %8.1f KiB\n",
+			       sizes[i], fat_loads[m].name,
+			       t_mount * 1e6 / iters, t_total * 1e6 / iters,
+			       bs.read_bytes / 1024.0 / iters);
+		}
+	}
+}
+
+void thread_bench_alloc(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	size_t nblocks = 65500, chunk = 256, iters = 1000, left = 64, k;
+	double t;
+	struct fs_mount_opts opts;
+	int fd, out;
+	char *buf;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [data block count] [iterations]");
+
+	if (t_arg->argc >= 2)
+		nblocks = get_argv(t_arg->argv[1]);
+	if (t_arg->argc >= 3)
+		iters = get_argv(t_arg->argv[2]);
+	if (nblocks <= left || !iters)
+		die("invalid block or iteration count");
+
+	buf = calloc(chunk, FS_BLOCK_SIZE_MIN);
+	if (!buf)
+		die_perror("calloc");
+
+	/* Use all the disk but a few blocks at its end */
+	get_mount_opts(&opts);
+	if (fs_format(t_arg->argv[0], nblocks, FS_BLOCK_SIZE_MIN) ||
+	    fs_mount_with(t_arg->argv[0], &opts) ||
+	    fs_create("full") || (fd = fs_open("full")) < 0)
+		die("Cannot create disk");
+	for (k = 1; k + left < nblocks; k += chunk) {
+		size_t n = k + chunk + left < nblocks ? chunk : nblocks - left - k;
+		if (fs_write(fd, buf, n * FS_BLOCK_SIZE_MIN) != (int)(n * FS_BLOCK_SIZE_MIN))
+			die("Cannot write file");
+	}
+	fs_close(fd);
+
+	/* Each new file gets one of the blocks left */
+	t = now();
+	for (k = 0; k < iters; k++)
+		if (fs_create("small") || (fd = fs_open("small")) < 0 ||
+		    fs_write(fd, buf, FS_BLOCK_SIZE_MIN) != FS_BLOCK_SIZE_MIN ||
+		    fs_close(fd) || fs_delete("small"))
+			die("Cannot write file");
+	t = now() - t;
+	printf("%6zu blocks alloc %8.2f us/file\n", nblocks, t * 1e6 / iters);
+
+	/* Count the free blocks, without the output of fs_info() */
+	fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	if (out < 0 || !freopen("/dev/null", "w", stdout))
+		die_perror("freopen");
+	t = now();
+	for (k = 0; k < iters; k++)
+		fs_info();
+	t = now() - t;
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+	close(out);
+	printf("%6zu blocks info  %8.2f us/call\n", nblocks, t * 1e6 / iters);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+}
+
+void thread_bench_statfs(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	size_t iters = 100, m, k;
+	struct fs_mount_opts opts;
+	struct fs_statfs st;
+	struct block_stats bs;
+	double t;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [iterations]");
+
+	if (t_arg->argc >= 2)
+		iters = get_argv(t_arg->argv[1]);
+	if (!iters)
+		die("invalid iteration count");
+
+	get_mount_opts(&opts);
+	block_stats_enable(1);
+
+	/* A free space query from scratch, as done by monitoring */
+	for (m = 0; m < ARRAY_SIZE(fat_loads); m++) {
+		opts.fat_load = fat_loads[m].mode;
+		block_stats_reset();
+		t = now();
+		for (k = 0; k < iters; k++)
+			if (fs_mount_with(t_arg->argv[0], &opts) ||
+			    fs_statfs(&st) || fs_umount())
+				die("Cannot get space usage");
+		t = now() - t;
+		block_stats_get(&bs);
+		printf("%-8s statfs %8.1f us read %8.1f KiB free %zu/%zu\n",
+		       fat_loads[m].name, t * 1e6 / iters,
+		       bs.read_bytes / 1024.0 / iters, st.free_blocks,
+		       st.data_blocks);
+	}
+}
+
+/* Superblock as laid out on the disk */
+struct __attribute__((__packed__)) image_sb {
+	char signature[8];
+	uint16_t total_blocks;
+	uint16_t rd_block;
+	uint16_t data_start;
+	uint16_t data_blocks;
+	uint8_t fat_blocks;
+	uint8_t features;
+	uint16_t csum_start;
+	uint16_t csum_blocks;
+	uint8_t block_shift;
+	uint16_t free_blocks;
+	uint8_t free_entries;
+	uint16_t journal_start;
+	uint16_t journal_blocks;
+};
+
+/* Root directory entry as laid out on the disk */
+struct __attribute__((__packed__)) image_entry {
+	char filename[16];
+	uint32_t size;
+	uint16_t first;
+	uint8_t flags;
+	char padding[9];
+};
+
+#define IMAGE_EOC 0xFFFF
+#define IMAGE_COUNTS 0x04
+#define IMAGE_COMPRESSED 0x01
+
+/* Content of byte @off of file @name, as written by the crash tests */
+char crash_byte(const char *name, size_t off)
+{
+	return name[0] * 7 + name[1] * 13 + off / 97;
+}
+
+/* Write @len bytes of the content of file @name from offset @off on */
+int crash_write(const char *name, size_t off, size_t len)
+{
+	int fd, ret = -1;
+	size_t i;
+	char *buf;
+
+	buf = malloc(len);
+	if (!buf)
+		die_perror("malloc");
+	for (i = 0; i < len; i++)
+		buf[i] = crash_byte(name, off + i);
+
+	fd = fs_open(name);
+	if (fd >= 0) {
+		if (!fs_lseek(fd, off) && fs_write(fd, buf, len) == (int)len)
+			ret = 0;
+		fs_close(fd);
+	}
+	free(buf);
+	return ret;
+}
+
+/* Mark the chain of @count blocks from @first on as used in @seen */
+int check_region(const uint16_t *fat, uint8_t *seen, size_t first,
+		 size_t count)
+{
+	size_t i;
+
+	for (i = first; i < first + count; i++) {
+		if (fat[i] != (i + 1 < first + count ? i + 1 : IMAGE_EOC))
+			return -1;
+		seen[i] = 1;
+	}
+	return 0;
+}
+
+/*
+ * Check that the file system of @diskname is consistent: each file has a chain
+ * of blocks for its size, no block is used twice or lost, and the free counts
+ * of the superblock are right, independently of fs_check(), which must find
+ * the same. With @verify, the content of each file must also be the one
+ * crash_write() writes. Returns the number of problems found, and describes
+ * the first one in @why.
+ */
+size_t check_image(const char *diskname, int verify, char *why, size_t len)
+{
+	size_t bs, i, k, n, off, problems = 0, free_blocks = 0, free_entries = 0;
+	struct fs_check_report report;
+	struct image_entry *rd;
+	struct image_sb sb;
+	uint16_t *fat;
+	uint8_t *seen;
+	char *buf;
+	int fd;
+
+#define problem(...)						\
+	do {							\
+		if (!problems++)				\
+			snprintf(why, len, __VA_ARGS__);	\
+	} while (0)
+
+	fd = open(diskname, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb))
+		die_perror("pread");
+	bs = sb.block_shift ? (size_t)1 << sb.block_shift : 4096;
+
+	fat = malloc(sb.fat_blocks * bs);
+	rd = malloc(bs);
+	buf = malloc(bs);
+	seen = calloc(sb.data_blocks, 1);
+	if (!fat || !rd || !buf || !seen)
+		die_perror("malloc");
+	if (pread(fd, fat, sb.fat_blocks * bs, bs) != (ssize_t)(sb.fat_blocks * bs) ||
+	    pread(fd, rd, bs, sb.rd_block * bs) != (ssize_t)bs)
+		die_perror("pread");
+
+	for (i = 0; i < bs / sizeof(*rd) && i < FS_FILE_MAX_COUNT; i++) {
+		if (!rd[i].filename[0]) {
+			free_entries++;
+			continue;
+		}
+		for (n = 0, k = rd[i].first; k != IMAGE_EOC; k = fat[k], n++) {
+			if (!k || k >= sb.data_blocks || seen[k]) {
+				problem("%.16s: block %zu out of range or used twice",
+					rd[i].filename, k);
+				break;
+			}
+			seen[k] = 1;
+			if (!verify || (rd[i].flags & IMAGE_COMPRESSED))
+				continue;
+			if (pread(fd, buf, bs, (sb.data_start + k) * bs) != (ssize_t)bs)
+				die_perror("pread");
+			for (off = n * bs; off < rd[i].size && off < (n + 1) * bs; off++)
+				if (buf[off - n * bs] != crash_byte(rd[i].filename, off)) {
+					problem("%.16s: wrong content at offset %zu",
+						rd[i].filename, off);
+					break;
+				}
+		}
+		if (!(rd[i].flags & IMAGE_COMPRESSED) && k == IMAGE_EOC &&
+		    n != (rd[i].size + bs - 1) / bs)
+			problem("%.16s: %zu blocks for %u bytes", rd[i].filename, n,
+				rd[i].size);
+	}
+
+	/* Checksum and journal regions belong to no file */
+	if ((sb.csum_blocks && check_region(fat, seen, sb.csum_start - sb.data_start,
+					    sb.csum_blocks)) ||
+	    (sb.journal_blocks && check_region(fat, seen, sb.journal_start - sb.data_start,
+					       sb.journal_blocks)))
+		problem("broken checksum or journal region");
+
+	for (k = 1; k < sb.data_blocks; k++) {
+		if (!fat[k])
+			free_blocks++;
+		else if (!seen[k])
+			problem("block %zu is lost", k);
+	}
+	if ((sb.features & IMAGE_COUNTS) && (sb.free_blocks != free_blocks ||
+					     sb.free_entries != free_entries))
+		problem("free counts %u/%u instead of %zu/%zu", sb.free_blocks,
+			sb.free_entries, free_blocks, free_entries);
+
+	/* fs_check() must agree, on its own */
+	if (fs_check(diskname, NULL, &report))
+		die("Cannot check %s", diskname);
+	if (!report.errors != !problems)
+		problem("fs_check() found %zu problems", report.errors);
+#undef problem
+
+	close(fd);
+	free(seen);
+	free(buf);
+	free(rd);
+	free(fat);
+	return problems;
+}
+
+/* Write host file @filename with the @size bytes of @buf */
+void write_host_file(const char *filename, const char *buf, size_t size)
+{
+	int fd;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die_perror("open");
+	if (write(fd, buf, size) != (ssize_t)size)
+		die_perror("write");
+	close(fd);
+}
+
+/*
+ * Changes made by the crash test, each written back on its own: files grow
+ * into a new FAT block, some are deleted, and new ones created
+ */
+int crash_workload(size_t file_size)
+{
+	char name[8];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "a%d", i);
+		if (crash_write(name, file_size, 3 * 4096) || fs_flush())
+			return -1;
+	}
+	for (i = 4; i < 6; i++) {
+		snprintf(name, sizeof(name), "a%d", i);
+		if (fs_delete(name) || fs_flush())
+			return -1;
+	}
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "b%d", i);
+		if (fs_create(name) || crash_write(name, 0, 5 * 4096 + 100) ||
+		    fs_flush())
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Fill the journal of @opts up to its very last block with transactions of
+ * various sizes, made of @creates (at least 1) file creations then appends,
+ * and check that the file system mounts again once unmounted. Returns whether
+ * the last transaction ended exactly at the end of the journal.
+ */
+int crash_journal_full(const char *diskname, const struct fs_mount_opts *opts,
+		       size_t creates)
+{
+	struct journal_stats js;
+	char name[24], buf[100];
+	size_t i, pos = 1;
+	fs_volume_t *vol;
+	int fd;
+
+	memset(buf, 'j', sizeof(buf));
+	if (fs_format(diskname, 2000, FS_BLOCK_SIZE_MIN))
+		die("Cannot create disk");
+	vol = fs_mount_ex(diskname, opts);
+	if (!vol)
+		die("Cannot mount %s", diskname);
+
+	/* Until the next transaction would wrap */
+	for (i = 0; pos < opts->journal_blocks; i++) {
+		snprintf(name, sizeof(name), "j%zu", i < creates ? i : 0);
+		if (i < creates && fs_create_ex(vol, name))
+			die("Cannot create file");
+		if (i >= creates) {
+			fd = fs_open_ex(vol, name);
+			if (fd < 0 || fs_lseek_ex(vol, fd, fs_stat_ex(vol, fd)) ||
+			    fs_write_ex(vol, fd, buf, sizeof(buf)) != sizeof(buf) ||
+			    fs_close_ex(vol, fd))
+				die("Cannot write file");
+		}
+		if (fs_flush_ex(vol) || fs_journal_stats_ex(vol, &js))
+			die("Cannot flush %s", diskname);
+		if (js.wraps)
+			break;
+		pos = 1 + js.blocks + 2 * js.commits;
+	}
+	if (fs_umount_ex(vol))
+		die("Cannot unmount %s", diskname);
+
+	vol = fs_mount_ex(diskname, opts);
+	if (!vol || fs_umount_ex(vol))
+		die("Cannot mount %s again with a full journal", diskname);
+	return pos == opts->journal_blocks;
+}
+
+/*
+ * Crash injection: run crash_workload() on a simulated disk that fails every
+ * request after the first N, for every N until the workload completes, and
+ * check after each crash that the file system mounts again and is consistent.
+ * With a journal (FS_JOURNAL), it always must be, and it first must mount
+ * again after being filled up exactly, see crash_journal_full().
+ */
+void thread_test_crash(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	size_t nblocks = 4096, file_size = 4 * 4096 + 1000, size, n, i;
+	size_t points = 0, replays = 0, bad = 0;
+	struct fs_mount_opts opts, crash_opts;
+	struct journal_stats js;
+	struct block_sim sim;
+	char name[8], why[128], *image, *mapped;
+	fs_volume_t *vol;
+	int done = 0;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [data block count]");
+	if (t_arg->argc >= 2)
+		nblocks = get_argv(t_arg->argv[1]);
+
+	/* Data blocks are written back along with the metadata */
+	get_mount_opts(&opts);
+	opts.backend = BLOCK_BACKEND_FILE;
+	opts.sim = NULL;
+	if (!opts.cache_blocks)
+		opts.cache_blocks = 64;
+
+	/* Transactions that end exactly at the end of the journal */
+	for (i = 0, n = 0; opts.journal_blocks && i < 16; i++)
+		n += crash_journal_full(t_arg->argv[0], &opts, i + 1);
+	if (opts.journal_blocks && !n)
+		die("journal never filled up exactly");
+
+	/* Small files, then a large one up into the next FAT block */
+	if (fs_format(t_arg->argv[0], nblocks, FS_BLOCK_SIZE_MIN) ||
+	    fs_mount_with(t_arg->argv[0], &opts))
+		die("Cannot create disk");
+	for (i = 0; i < 8; i++) {
+		snprintf(name, sizeof(name), "a%zu", i);
+		if (fs_create(name) || crash_write(name, 0, file_size))
+			die("Cannot write file");
+	}
+	if (fs_create("big") ||
+	    crash_write("big", 0, (nblocks / 2 + 64) * FS_BLOCK_SIZE_MIN) ||
+	    fs_umount())
+		die("Cannot write file");
+
+	mapped = map_host_file(t_arg->argv[0], &size);
+	image = malloc(size);
+	if (!image)
+		die_perror("malloc");
+	memcpy(image, mapped, size);
+	munmap(mapped, size);
+
+	for (n = 1; !done; n++) {
+		write_host_file(t_arg->argv[0], image, size);
+
+		/* Fast, and dead after n requests */
+		memset(&sim, 0, sizeof(sim));
+		sim.fail_after = n;
+		crash_opts = opts;
+		crash_opts.backend = BLOCK_BACKEND_SIM;
+		crash_opts.sim = &sim;
+		if (!fs_mount_with(t_arg->argv[0], &crash_opts)) {
+			done = !crash_workload(file_size);
+			if (fs_umount())
+				done = 0;
+		}
+
+		points++;
+		vol = fs_mount_ex(t_arg->argv[0], &opts);
+		if (!vol) {
+			printf("crash after %zu requests: cannot mount\n", n);
+			bad++;
+			continue;
+		}
+		fs_journal_stats_ex(vol, &js);
+		replays += js.replayed > 0;
+		if (fs_umount_ex(vol))
+			die("Cannot unmount %s", t_arg->argv[0]);
+
+		if (check_image(t_arg->argv[0], 1, why, sizeof(why))) {
+			printf("crash after %zu requests: %s\n", n, why);
+			bad++;
+		}
+	}
+
+	printf("journal %s: %zu crash points, %zu recovered by replay, %zu inconsistent\n",
+	       opts.journal_blocks ? "on" : "off", points, replays, bad);
+	free(image);
+	if (opts.journal_blocks && bad)
+		die("inconsistent file system after a crash");
+}
+
+/* File system image corrupted by thread_test_check() */
+struct test_image {
+	char *data;
+	size_t size, bs;
+	struct image_sb *sb;
+	uint16_t *fat;
+	struct image_entry *rd;
+};
+
+/* Files of the image of thread_test_check(), the last one compressed */
+static const char *check_files[] = { "a0", "a1", "a2", "a3", "z" };
+
+/* Block @n of the chain of root directory entry @i of @img */
+uint16_t image_block(const struct test_image *img, size_t i, size_t n)
+{
+	uint16_t k = img->rd[i].first;
+
+	while (n--)
+		k = img->fat[k];
+	return k;
+}
+
+/* Last block of the chain of root directory entry @i of @img */
+uint16_t image_last(const struct test_image *img, size_t i)
+{
+	uint16_t k = img->rd[i].first;
+
+	while (img->fat[k] != IMAGE_EOC)
+		k = img->fat[k];
+	return k;
+}
+
+/* Last free data block of @img */
+uint16_t image_free(const struct test_image *img)
+{
+	uint16_t k = img->sb->data_blocks - 1;
+
+	while (img->fat[k])
+		k--;
+	return k;
+}
+
+void corrupt_cycle(struct test_image *img)
+{
+	img->fat[image_last(img, 0)] = img->rd[0].first;
+}
+
+void corrupt_cross_link(struct test_image *img)
+{
+	img->fat[image_last(img, 1)] = image_block(img, 2, 1);
+}
+
+void corrupt_bad_link(struct test_image *img)
+{
+	img->fat[image_block(img, 3, 1)] = img->sb->data_blocks + 5;
+}
+
+void corrupt_orphan(struct test_image *img)
+{
+	img->fat[image_free(img)] = IMAGE_EOC;
+}
+
+void corrupt_size(struct test_image *img)
+{
+	img->rd[0].size = 100 * img->bs;
+}
+
+void corrupt_counts(struct test_image *img)
+{
+	img->sb->free_blocks--;
+}
+
+void corrupt_group(struct test_image *img)
+{
+	uint32_t stored = 200000;
+
+	memcpy(img->data + (img->sb->data_start + img->rd[4].first) * img->bs,
+	       &stored, sizeof(stored));
+}
+
+/* One random corruption of the FAT, the root directory or the free counts */
+void corrupt_random(struct test_image *img)
+{
+	size_t i = rand() % ARRAY_SIZE(check_files);
+	uint16_t block = 1 + rand() % (img->sb->data_blocks - 1);
+	uint16_t values[] = { 0, IMAGE_EOC, img->sb->data_blocks + rand() % 64,
+			      1 + rand() % (img->sb->data_blocks - 1) };
+
+	switch (rand() % 4) {
+	case 0:
+		img->fat[block] = values[rand() % ARRAY_SIZE(values)];
+		break;
+	case 1:
+		img->rd[i].first = values[1 + rand() % (ARRAY_SIZE(values) - 1)];
+		break;
+	case 2:
+		img->rd[i].size = rand() % (8 * img->bs);
+		break;
+	default:
+		img->sb->free_blocks = rand();
+		img->sb->free_entries = rand();
+	}
+}
+
+/*
+ * Check that @diskname, repaired by fs_check(), is consistent for both
+ * fs_check() and check_image(), and that each file of the image of
+ * thread_test_check() left reads back up to its size
+ */
+void check_repaired(const char *diskname, const char *label)
+{
+	char why[128], *buf;
+	size_t i;
+	int fd, size;
+
+	if (check_image(diskname, 0, why, sizeof(why)))
+		die("%s: inconsistent once repaired: %s", label, why);
+	if (fs_mount(diskname))
+		die("%s: cannot mount once repaired", label);
+	for (i = 0; i < ARRAY_SIZE(check_files); i++) {
+		fd = fs_open(check_files[i]);
+		if (fd < 0)
+			continue;
+		size = fs_stat(fd);
+		buf = malloc(size + 1);
+		if (!buf)
+			die_perror("malloc");
+		if (size < 0 || fs_read(fd, buf, size) != size)
+			die("%s: cannot read %s once repaired", label,
+			    check_files[i]);
+		free(buf);
+		fs_close(fd);
+	}
+	if (fs_umount())
+		die("%s: cannot unmount once repaired", label);
+}
+
+/*
+ * fs_check() tests: each corruption injected into the image of
+ * thread_test_check() must be found and counted as such, also by
+ * check_image() for the ones it checks, and repaired
+ */
+static const struct {
+	const char *name;
+	void (*corrupt)(struct test_image *img);
+	size_t counter;
+	int oracle;
+} check_cases[] = {
+	{ "cycle",	corrupt_cycle,	offsetof(struct fs_check_report, cycles), 1 },
+	{ "cross-link",	corrupt_cross_link, offsetof(struct fs_check_report, cross_links), 1 },
+	{ "bad link",	corrupt_bad_link, offsetof(struct fs_check_report, bad_links), 1 },
+	{ "orphan",	corrupt_orphan,	offsetof(struct fs_check_report, orphans), 1 },
+	{ "bad size",	corrupt_size,	offsetof(struct fs_check_report, bad_sizes), 1 },
+	{ "bad counts",	corrupt_counts,	offsetof(struct fs_check_report, bad_counts), 1 },
+	{ "bad group",	corrupt_group,	offsetof(struct fs_check_report, bad_groups), 0 },
+};
+
+/*
+ * fs_check() tests on a small file system: the corruptions of check_cases[],
+ * then [rounds] rounds of random ones from [seed], which must be repaired
+ */
+void thread_test_check(void *arg)
+{
+	struct fs_check_opts check_opts = { .backend = BLOCK_BACKEND_FILE };
+	struct thread_arg *t_arg = arg;
+	const char *diskname;
+	size_t seed = 1, rounds = 500, r, i, n;
+	struct fs_check_report report;
+	struct fs_mount_opts opts;
+	struct test_image img;
+	char label[32], why[128], *image;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [seed] [rounds]");
+	diskname = t_arg->argv[0];
+	if (t_arg->argc >= 2)
+		seed = get_argv(t_arg->argv[1]);
+	if (t_arg->argc >= 3)
+		rounds = get_argv(t_arg->argv[2]);
+
+	/* Plain files of a few blocks, then a compressed one of three groups */
+	get_mount_opts(&opts);
+	opts.backend = BLOCK_BACKEND_FILE;
+	opts.sim = NULL;
+	opts.compress = 0;
+	if (fs_format(diskname, 2000, FS_BLOCK_SIZE_MIN) ||
+	    fs_mount_with(diskname, &opts))
+		die("Cannot create disk");
+	for (i = 0; i < ARRAY_SIZE(check_files) - 1; i++)
+		if (fs_create(check_files[i]) ||
+		    crash_write(check_files[i], 0, 3 * FS_BLOCK_SIZE_MIN + 100))
+			die("Cannot write file");
+	opts.compress = 1;
+	if (fs_umount() || fs_mount_with(diskname, &opts) ||
+	    fs_create(check_files[i]) ||
+	    crash_write(check_files[i], 0, 3 * 65536) || fs_umount())
+		die("Cannot write file");
+	if (check_image(diskname, 0, why, sizeof(why)))
+		die("%s is not consistent to start with: %s", diskname, why);
+
+	image = map_host_file(diskname, &img.size);
+	img.data = malloc(img.size);
+	if (!img.data)
+		die_perror("malloc");
+	memcpy(img.data, image, img.size);
+	img.sb = (struct image_sb *)img.data;
+	img.bs = img.sb->block_shift ? (size_t)1 << img.sb->block_shift : 4096;
+	img.fat = (uint16_t *)(img.data + img.bs);
+	img.rd = (struct image_entry *)(img.data + img.sb->rd_block * img.bs);
+
+	for (i = 0; i < ARRAY_SIZE(check_cases); i++) {
+		memcpy(img.data, image, img.size);
+		check_cases[i].corrupt(&img);
+		write_host_file(diskname, img.data, img.size);
+
+		check_opts.repair = 0;
+		if (fs_check(diskname, &check_opts, &report))
+			die("%s: cannot check", check_cases[i].name);
+		n = *(size_t *)((char *)&report + check_cases[i].counter);
+		if (!n || report.repaired)
+			die("%s: not found", check_cases[i].name);
+		if (check_cases[i].oracle &&
+		    !check_image(diskname, 0, why, sizeof(why)))
+			die("%s: not found by check_image()", check_cases[i].name);
+
+		check_opts.repair = 1;
+		if (fs_check(diskname, &check_opts, &report) ||
+		    report.repaired != report.errors)
+			die("%s: not repaired", check_cases[i].name);
+		check_repaired(diskname, check_cases[i].name);
+		printf("%s: %zu found, %zu problems repaired\n",
+		       check_cases[i].name, n, report.repaired);
+	}
+
+	srand(seed);
+	for (r = 0; r < rounds; r++) {
+		memcpy(img.data, image, img.size);
+		for (i = 1 + rand() % 4; i; i--)
+			corrupt_random(&img);
+		write_host_file(diskname, img.data, img.size);
+
+		snprintf(label, sizeof(label), "round %zu", r);
+		if (fs_check(diskname, &check_opts, &report) ||
+		    report.repaired != report.errors)
+			die("%s: not repaired", label);
+		check_repaired(diskname, label);
+	}
+	printf("%zu random rounds from seed %zu repaired\n", rounds, seed);
+
+	munmap(image, img.size);
+	free(img.data);
+}
+
+/*
+ * Recovery time after a crash, by size of the disk: mounting replays the
+ * journal (FS_JOURNAL, 64 blocks by default), which takes time with the size
+ * of the journal, while checking the whole file system as fs_check() does,
+ * which is needed without a journal, takes time with the size of the disk
+ */
+void thread_bench_recovery(void *arg)
+{
+	static const size_t sizes[] = { 4096, 16384, 65500 };
+	struct thread_arg *t_arg = arg;
+	size_t ops = 100, i, k;
+	struct fs_mount_opts opts;
+	struct journal_stats js;
+	double t_mount, t_check;
+	fs_volume_t *vol;
+	char name[16], why[128];
+	int status;
+	pid_t pid;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [operations before the crash]");
+	if (t_arg->argc >= 2)
+		ops = get_argv(t_arg->argv[1]);
+
+	get_mount_opts(&opts);
+	if (!opts.journal_blocks)
+		opts.journal_blocks = 64;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		/* Half full with files of 64 blocks */
+		if (fs_format(t_arg->argv[0], sizes[i], FS_BLOCK_SIZE_MIN) ||
+		    fs_mount_with(t_arg->argv[0], &opts))
+			die("Cannot create disk");
+		for (k = 0; k < sizes[i] / 128 && k < FS_FILE_MAX_COUNT / 2; k++) {
+			snprintf(name, sizeof(name), "f%zu", k);
+			if (fs_create(name) ||
+			    crash_write(name, 0, 64 * FS_BLOCK_SIZE_MIN))
+				die("Cannot write file");
+		}
+		if (fs_umount())
+			die("Cannot unmount %s", t_arg->argv[0]);
+
+		/* Files that grow a block at a time, then a crash */
+		pid = fork();
+		if (pid < 0)
+			die_perror("fork");
+		if (!pid) {
+			if (fs_mount_with(t_arg->argv[0], &opts))
+				_exit(1);
+			for (k = 0; k < ops; k++) {
+				snprintf(name, sizeof(name), "g%zu", k % 8);
+				if ((k < 8 && fs_create(name)) ||
+				    crash_write(name, k / 8 * FS_BLOCK_SIZE_MIN,
+						FS_BLOCK_SIZE_MIN) || fs_flush())
+					_exit(1);
+			}
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))
+			die("Cannot crash");
+
+		t_mount = now();
+		vol = fs_mount_ex(t_arg->argv[0], &opts);
+		t_mount = now() - t_mount;
+		if (!vol || fs_journal_stats_ex(vol, &js) || fs_umount_ex(vol))
+			die("Cannot recover diskname");
+
+		t_check = now();
+		if (check_image(t_arg->argv[0], 0, why, sizeof(why)))
+			die("inconsistent file system: %s", why);
+		t_check = now() - t_check;
+
+		printf("%6zu blocks journal %4zu blocks: replayed %3zu transactions %4zu blocks in %7.3f ms, mount %7.3f ms, full check %7.3f ms\n",
+		       sizes[i], opts.journal_blocks, js.replayed,
+		       js.replayed_blocks, js.replay_ns / 1e6, t_mount * 1e3,
+		       t_check * 1e3);
+	}
+}
+
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	size_t nblocks, block_size = FS_BLOCK_SIZE_MIN;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> [block size]");
+
+	nblocks = get_argv(t_arg->argv[1]);
+	if (t_arg->argc >= 3)
+		block_size = get_argv(t_arg->argv[2]);
+
+	if (fs_format(t_arg->argv[0], nblocks, block_size))
+		die("Cannot create disk");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks of %zu bytes\n",
+	       t_arg->argv[0], nblocks, block_size);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -511,15 +2134,60 @@ static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
+	{ "format",	thread_fs_format },
 	{ "info",	thread_fs_info },
+	{ "statfs",	thread_fs_statfs },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "bench_crc",	thread_bench_crc },
+	{ "bench_dedup",	thread_bench_dedup },
+	{ "bench_rw",	thread_bench_rw },
+	{ "bench_backends",	thread_bench_backends },
+	{ "bench_block_size",	thread_bench_block_size },
+	{ "bench_sync",	thread_bench_sync },
+	{ "bench_writeback",	thread_bench_writeback },
+	{ "bench_mount",	thread_bench_mount },
+	{ "bench_alloc",	thread_bench_alloc },
+	{ "bench_statfs",	thread_bench_statfs },
+	{ "bench_recovery",	thread_bench_recovery },
+	{ "test_check",	thread_test_check },
+	{ "test_crash",	thread_test_crash }
 };
 
+/* Print the latency histogram summary of @lat */
+void print_latency(const char *name, const struct block_latency *lat)
+{
+	fprintf(stderr, "block: %s_latency count=%zu p50=%lluns p99=%lluns p999=%lluns\n",
+		name, lat->count,
+		block_latency_percentile(lat, 0.50),
+		block_latency_percentile(lat, 0.99),
+		block_latency_percentile(lat, 0.999));
+}
+
+/* Print the counters of the last mounted file system */
+void print_stats(void)
+{
+	struct cache_stats cs;
+	struct block_stats bs;
+
+	fs_cache_stats(&cs);
+	fprintf(stderr, "cache: hits=%zu misses=%zu evictions=%zu writebacks=%zu\n",
+		cs.hits, cs.misses, cs.evictions, cs.writebacks);
+	fprintf(stderr, "cache: ghost_recent_hits=%zu ghost_frequent_hits=%zu recent_target=%zu\n",
+		cs.ghost_recent_hits, cs.ghost_frequent_hits, cs.recent_target);
+
+	block_stats_get(&bs);
+	fprintf(stderr, "block: reads=%zu writes=%zu read_bytes=%zu write_bytes=%zu syscalls=%zu errors=%zu\n",
+		bs.reads, bs.writes, bs.read_bytes, bs.write_bytes,
+		bs.syscalls, bs.errors);
+	print_latency("read", &bs.read_latency);
+	print_latency("write", &bs.write_latency);
+}
+
 void usage(char *program)
 {
 	size_t i;
@@ -527,6 +2195,37 @@ void usage(char *program)
 	fprintf(stderr, "Possible commands are:\n");
 	for (i = 0; i < ARRAY_SIZE(commands); i++)
 		fprintf(stderr, "\t%s\n", commands[i].name);
+	fprintf(stderr, "Environment:\n");
+	fprintf(stderr, "\tFS_BACKEND=");
+	for (i = 0; i < ARRAY_SIZE(backends); i++)
+		fprintf(stderr, "%s%s", i ? "|" : "", backends[i].name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\tFS_CACHE_BLOCKS=<number of cached blocks>\n");
+	fprintf(stderr, "\tFS_CACHE_POLICY=");
+	for (i = 0; i < ARRAY_SIZE(policies); i++)
+		fprintf(stderr, "%s%s", i ? "|" : "", policies[i].name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\tFS_COMPRESS=1 (compress the files created)\n");
+	fprintf(stderr, "\tFS_FAT_LOAD=");
+	for (i = 0; i < ARRAY_SIZE(fat_loads); i++)
+		fprintf(stderr, "%s%s", i ? "|" : "", fat_loads[i].name);
+	fprintf(stderr, " (when the FAT is read)\n");
+	fprintf(stderr, "\tFS_DEDUP=1 (share identical blocks between files)\n");
+	fprintf(stderr, "\tFS_WRITEBACK=1 (write back dirty blocks in the background)\n");
+	fprintf(stderr, "\tFS_DIRTY_EXPIRE_MS=<age of the dirty blocks written back>\n");
+	fprintf(stderr, "\tFS_DIRTY_BACKGROUND_RATIO=<%% of dirty cache written back>\n");
+	fprintf(stderr, "\tFS_DIRTY_RATIO=<%% of dirty cache throttling writers>\n");
+	fprintf(stderr, "\tFS_CHECKSUMS=1 (checksum blocks, verify on reads)\n");
+	fprintf(stderr, "\tFS_JOURNAL=<blocks of the metadata journal>\n");
+	fprintf(stderr, "\tFS_SIM=");
+	for (i = 0; i < ARRAY_SIZE(sim_profiles); i++)
+		fprintf(stderr, "%s%s", i ? "|" : "", sim_profiles[i].name);
+	fprintf(stderr, " (model of the sim backend)\n");
+	fprintf(stderr, "\tFS_SIM_ERRORS=<probability of a failed request>\n");
+	fprintf(stderr, "\tFS_SIM_FAIL_AFTER=<requests before all fail>\n");
+	fprintf(stderr, "\tFS_SIM_SEED=<seed of the failures>\n");
+	fprintf(stderr, "\tFS_SPARSE=1 (release freed blocks, skip holes on reads)\n");
+	fprintf(stderr, "\tFS_STATS=1 (count and time block I/O, print counters on exit)\n");
 	exit(1);
 }
 
@@ -550,9 +2249,14 @@ int main(int argc, char **argv)
 	arg.argc = --argc;
 	arg.argv = &argv[1];
 
+	if (getenv("FS_STATS"))
+		block_stats_enable(1);
+
 	for (i = 0; i < ARRAY_SIZE(commands); i++) {
 		if (!strcmp(cmd, commands[i].name)) {
 			commands[i].func(&arg);
+			if (getenv("FS_STATS"))
+				print_stats();
 			break;
 		}
 	}
@@ -0,0 +1,854 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Largest batch of misses loaded together, as a fraction of the cache */
+#define MISS_BATCH_RATIO 8
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* Link of an element in a doubly linked list */
+struct link {
+	struct link *prev;
+	struct link *next;
+};
+
+/* Doubly linked list, from most (head.next) to least (head.prev) recent */
+struct list {
+	struct link head;
+	size_t len;
+};
+
+/* ARC lists: recent/frequent resident blocks, and their ghosts */
+enum arc_list {
+	ARC_T1,
+	ARC_T2,
+	ARC_B1,
+	ARC_B2,
+	ARC_LISTS,
+};
+
+/* Cache slot holding one block */
+struct frame {
+	/* Index of the cached block */
+	size_t block;
+	/* Slot holds a block */
+	int used;
+	/* Content of the block is loaded */
+	int valid;
+	/* Content of the block differs from the disk, since @dirtied (ns) */
+	int dirty;
+	uint64_t dirtied;
+	/* Position in the list of dirty blocks */
+	struct link dirty_link;
+	/* Recently accessed (CLOCK reference bit) */
+	int ref;
+	/* Number of pinned references */
+	int pins;
+	/* Next frame in the same hash bucket */
+	struct frame *next;
+	/* ARC list holding the frame (%ARC_T1 or %ARC_T2), or free list */
+	enum arc_list list;
+	struct link link;
+	/* Content of the block */
+	char *data;
+};
+
+/* Block recently evicted by ARC, remembered without its content */
+struct ghost {
+	/* Index of the evicted block */
+	size_t block;
+	/* ARC list holding the ghost (%ARC_B1 or %ARC_B2) */
+	enum arc_list list;
+	struct link link;
+	/* Next ghost in the same hash bucket, or in the free pool */
+	struct ghost *next;
+};
+
+/* Block cache instance */
+struct cache {
+	/* Cached disk */
+	struct disk *disk;
+	/* Cache slots */
+	struct frame *frames;
+	size_t nframes;
+	/* Hash table of the used slots, indexed by block */
+	struct frame **buckets;
+	size_t nbuckets;
+	/* CLOCK hand, next slot considered for eviction */
+	size_t hand;
+	/* Content of all the slots */
+	char *data;
+	/* Replacement policy */
+	enum cache_policy policy;
+	/* ARC lists, unused slots, and target size of the T1 list */
+	struct list lists[ARC_LISTS];
+	struct list free;
+	size_t target;
+	/* Dirty blocks, from most to least recently dirtied */
+	struct list dirty;
+	/* ARC ghosts, hash table of the ghosts, and unused ghosts */
+	struct ghost *ghosts;
+	struct ghost **gbuckets;
+	struct ghost *gfree;
+	/* Counters */
+	struct cache_stats stats;
+};
+
+static void list_init(struct list *l)
+{
+	l->head.prev = &l->head;
+	l->head.next = &l->head;
+	l->len = 0;
+}
+
+/* Insert @e as the most recent element of @l */
+static void list_add(struct list *l, struct link *e)
+{
+	e->prev = &l->head;
+	e->next = l->head.next;
+	l->head.next->prev = e;
+	l->head.next = e;
+	l->len++;
+}
+
+static void list_del(struct list *l, struct link *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	l->len--;
+}
+
+void cache_destroy(struct cache *c)
+{
+	if (!c)
+		return;
+
+	free(c->frames);
+	free(c->buckets);
+	block_buf_free(c->data);
+	free(c->ghosts);
+	free(c->gbuckets);
+	free(c);
+}
+
+struct cache *cache_create(struct disk *d, size_t nblocks,
+			   enum cache_policy policy)
+{
+	struct cache *c;
+	size_t i;
+
+	if (policy != CACHE_POLICY_CLOCK && policy != CACHE_POLICY_ARC) {
+		cache_error("invalid policy '%d'", policy);
+		return NULL;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		perror("calloc");
+		return NULL;
+	}
+
+	c->disk = d;
+	c->policy = policy;
+	list_init(&c->dirty);
+
+	if (!nblocks)
+		return c;
+
+	c->frames = calloc(nblocks, sizeof(struct frame));
+	c->nbuckets = nblocks;
+	c->buckets = calloc(c->nbuckets, sizeof(struct frame *));
+	c->data = block_buf_alloc(nblocks);
+	if (policy == CACHE_POLICY_ARC) {
+		c->ghosts = calloc(nblocks, sizeof(struct ghost));
+		c->gbuckets = calloc(c->nbuckets, sizeof(struct ghost *));
+	}
+	if (!c->frames || !c->buckets || !c->data ||
+	    (policy == CACHE_POLICY_ARC && (!c->ghosts || !c->gbuckets))) {
+		perror("malloc");
+		cache_destroy(c);
+		return NULL;
+	}
+
+	for (i = 0; i < ARC_LISTS; i++)
+		list_init(&c->lists[i]);
+	list_init(&c->free);
+	c->gfree = NULL;
+
+	for (i = 0; i < nblocks; i++) {
+		c->frames[i].data = c->data + i * BLOCK_SIZE;
+		list_add(&c->free, &c->frames[i].link);
+		if (c->ghosts) {
+			c->ghosts[i].next = c->gfree;
+			c->gfree = &c->ghosts[i];
+		}
+	}
+	c->nframes = nblocks;
+
+	return c;
+}
+
+int cache_enabled(struct cache *c)
+{
+	return c->nframes != 0;
+}
+
+static struct frame **bucket(struct cache *c, size_t block)
+{
+	return &c->buckets[block % c->nbuckets];
+}
+
+static struct frame *lookup(struct cache *c, size_t block)
+{
+	struct frame *f;
+
+	for (f = *bucket(c, block); f; f = f->next)
+		if (f->block == block)
+			return f;
+
+	return NULL;
+}
+
+static void unhash(struct cache *c, struct frame *f)
+{
+	struct frame **p;
+
+	for (p = bucket(c, f->block); *p != f; p = &(*p)->next)
+		;
+	*p = f->next;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Mark @f dirty, keeping the time it first became dirty */
+static void mark_dirty(struct cache *c, struct frame *f)
+{
+	if (f->dirty)
+		return;
+
+	f->dirty = 1;
+	f->dirtied = now_ns();
+	list_add(&c->dirty, &f->dirty_link);
+}
+
+static void mark_clean(struct cache *c, struct frame *f)
+{
+	if (!f->dirty)
+		return;
+
+	f->dirty = 0;
+	list_del(&c->dirty, &f->dirty_link);
+}
+
+static int writeback(struct cache *c, struct frame *f)
+{
+	if (disk_write(c->disk, f->block, f->data))
+		return -1;
+
+	mark_clean(c, f);
+	c->stats.writebacks++;
+
+	return 0;
+}
+
+/* Find a free slot, evicting an unpinned block with the CLOCK algorithm */
+static struct frame *clock_evict(struct cache *c)
+{
+	struct frame *f;
+	size_t steps;
+
+	/* Two sweeps are enough to clear every reference bit */
+	for (steps = 0; steps < 2 * c->nframes; steps++) {
+		f = &c->frames[c->hand];
+		c->hand = (c->hand + 1) % c->nframes;
+
+		if (!f->used)
+			return f;
+		if (f->pins)
+			continue;
+		if (f->ref) {
+			f->ref = 0;
+			continue;
+		}
+		/* A block that cannot be written back stays cached */
+		if (f->dirty && writeback(c, f))
+			continue;
+
+		unhash(c, f);
+		f->used = 0;
+		c->stats.evictions++;
+		return f;
+	}
+
+	cache_error("no block can be evicted");
+	return NULL;
+}
+
+static struct ghost **gbucket(struct cache *c, size_t block)
+{
+	return &c->gbuckets[block % c->nbuckets];
+}
+
+static struct ghost *ghost_lookup(struct cache *c, size_t block)
+{
+	struct ghost *g;
+
+	for (g = *gbucket(c, block); g; g = g->next)
+		if (g->block == block)
+			return g;
+
+	return NULL;
+}
+
+static void ghost_remove(struct cache *c, struct ghost *g)
+{
+	struct ghost **p;
+
+	for (p = gbucket(c, g->block); *p != g; p = &(*p)->next)
+		;
+	*p = g->next;
+	list_del(&c->lists[g->list], &g->link);
+	g->next = c->gfree;
+	c->gfree = g;
+}
+
+static struct ghost *ghost_lru(struct cache *c, enum arc_list list)
+{
+	return container_of(c->lists[list].head.prev, struct ghost, link);
+}
+
+/* Remember evicted @block as the most recent ghost of @list */
+static void ghost_add(struct cache *c, size_t block, enum arc_list list)
+{
+	struct ghost *g;
+
+	/* Forget the oldest ghost of the longest list when out of ghosts */
+	if (!c->gfree)
+		ghost_remove(c, ghost_lru(c, c->lists[ARC_B1].len >
+				       c->lists[ARC_B2].len ?
+				       ARC_B1 : ARC_B2));
+
+	g = c->gfree;
+	c->gfree = g->next;
+	g->block = block;
+	g->list = list;
+	g->next = *gbucket(c, block);
+	*gbucket(c, block) = g;
+	list_add(&c->lists[list], &g->link);
+}
+
+/* Least recent block of @list that can be evicted */
+static struct frame *arc_pick(struct cache *c, enum arc_list list)
+{
+	struct link *e;
+	struct frame *f;
+
+	for (e = c->lists[list].head.prev; e != &c->lists[list].head;
+	     e = e->prev) {
+		f = container_of(e, struct frame, link);
+		if (f->pins)
+			continue;
+		/* A block that cannot be written back stays cached */
+		if (f->dirty && writeback(c, f))
+			continue;
+		return f;
+	}
+
+	return NULL;
+}
+
+/* Drop evictable frame @f, optionally remembering it as a ghost */
+static void arc_drop(struct cache *c, struct frame *f, int keep_ghost)
+{
+	if (keep_ghost)
+		ghost_add(c, f->block, f->list == ARC_T1 ? ARC_B1 : ARC_B2);
+	list_del(&c->lists[f->list], &f->link);
+	unhash(c, f);
+	f->used = 0;
+	c->stats.evictions++;
+}
+
+/*
+ * ARC's REPLACE: evict from T1 if it is larger than its target, from T2
+ * otherwise. @in_b2 tells whether the block being loaded is a ghost of B2.
+ */
+static struct frame *arc_replace(struct cache *c, int in_b2)
+{
+	struct list *t1 = &c->lists[ARC_T1];
+	enum arc_list first, second;
+	struct frame *f;
+
+	if (t1->len && (t1->len > c->target ||
+			(in_b2 && t1->len == c->target))) {
+		first = ARC_T1;
+		second = ARC_T2;
+	} else {
+		first = ARC_T2;
+		second = ARC_T1;
+	}
+
+	f = arc_pick(c, first);
+	if (!f)
+		f = arc_pick(c, second);
+	if (!f)
+		return NULL;
+
+	arc_drop(c, f, 1);
+
+	return f;
+}
+
+/* Find a slot for @block with the ARC algorithm */
+static struct frame *arc_evict(struct cache *c, size_t block,
+			       enum arc_list *list)
+{
+	struct list *t1 = &c->lists[ARC_T1], *t2 = &c->lists[ARC_T2];
+	struct list *b1 = &c->lists[ARC_B1], *b2 = &c->lists[ARC_B2];
+	size_t size = c->nframes, delta, total;
+	struct frame *f = NULL;
+	struct ghost *g;
+	int in_b2 = 0;
+
+	g = ghost_lookup(c, block);
+	if (g && g->list == ARC_B1) {
+		/* Recently evicted block is back: favor recency */
+		c->stats.ghost_recent_hits++;
+		delta = b2->len > b1->len ? b2->len / b1->len : 1;
+		c->target = c->target + delta < size ?
+			c->target + delta : size;
+		ghost_remove(c, g);
+		*list = ARC_T2;
+	} else if (g) {
+		/* Frequently used block is back: favor frequency */
+		c->stats.ghost_frequent_hits++;
+		delta = b1->len > b2->len ? b1->len / b2->len : 1;
+		c->target = c->target > delta ? c->target - delta : 0;
+		ghost_remove(c, g);
+		in_b2 = 1;
+		*list = ARC_T2;
+	} else {
+		*list = ARC_T1;
+		total = t1->len + t2->len + b1->len + b2->len;
+		if (t1->len + b1->len >= size) {
+			if (b1->len) {
+				ghost_remove(c, ghost_lru(c, ARC_B1));
+			} else if (!c->free.len) {
+				/* T1 fills the cache, drop its oldest block */
+				f = arc_pick(c, ARC_T1);
+				if (f)
+					arc_drop(c, f, 0);
+			}
+		} else if (total >= 2 * size && b2->len) {
+			ghost_remove(c, ghost_lru(c, ARC_B2));
+		}
+	}
+
+	if (!f && c->free.len) {
+		f = container_of(c->free.head.next, struct frame, link);
+		list_del(&c->free, &f->link);
+	}
+	if (!f)
+		f = arc_replace(c, in_b2);
+	if (!f)
+		cache_error("no block can be evicted");
+
+	return f;
+}
+
+/* Record an access to cached block @f */
+static void touch(struct cache *c, struct frame *f)
+{
+	if (c->policy == CACHE_POLICY_ARC) {
+		list_del(&c->lists[f->list], &f->link);
+		list_add(&c->lists[ARC_T2], &f->link);
+		f->list = ARC_T2;
+	}
+	f->ref = 1;
+}
+
+/* Get a slot for @block, whose content is not loaded yet */
+static struct frame *alloc(struct cache *c, size_t block)
+{
+	enum arc_list list = ARC_T1;
+	struct frame *f;
+
+	if (c->policy == CACHE_POLICY_ARC)
+		f = arc_evict(c, block, &list);
+	else
+		f = clock_evict(c);
+	if (!f)
+		return NULL;
+
+	if (c->policy == CACHE_POLICY_ARC) {
+		f->list = list;
+		list_add(&c->lists[list], &f->link);
+	}
+
+	f->block = block;
+	f->used = 1;
+	f->valid = 0;
+	f->dirty = 0;
+	f->ref = 1;
+	f->pins = 0;
+	f->next = *bucket(c, block);
+	*bucket(c, block) = f;
+
+	return f;
+}
+
+/* Drop a slot whose content could not be loaded */
+static void discard(struct cache *c, struct frame *f)
+{
+	unhash(c, f);
+	f->used = 0;
+	if (c->policy == CACHE_POLICY_ARC) {
+		list_del(&c->lists[f->list], &f->link);
+		list_add(&c->free, &f->link);
+	}
+}
+
+int cache_readv(struct cache *c, const struct block_iovec *bvec,
+		size_t count)
+{
+	struct block_iovec *miss;
+	struct frame **mframes;
+	size_t *mindex;
+	size_t i, n, max;
+	struct frame *f;
+	int ret = 0;
+
+	if (!c->nframes)
+		return disk_readv(c->disk, bvec, count);
+
+	/*
+	 * Misses being loaded are pinned: keep batches small enough that the
+	 * policy still has a choice of blocks to evict
+	 */
+	max = c->nframes / MISS_BATCH_RATIO;
+	if (max == 0)
+		max = 1;
+	if (max > count)
+		max = count;
+	miss = malloc(max * sizeof(*miss));
+	mframes = malloc(max * sizeof(*mframes));
+	mindex = malloc(max * sizeof(*mindex));
+	if (!miss || !mframes || !mindex) {
+		perror("malloc");
+		ret = -1;
+		goto out;
+	}
+
+	i = 0;
+	while (i < count) {
+		/*
+		 * Serve the hits and gather the misses, which stay pinned
+		 * until they are loaded all at once
+		 */
+		for (n = 0; i < count && n < max; i++) {
+			f = lookup(c, bvec[i].block);
+			if (f && !f->valid)
+				break;
+			if (f) {
+				memcpy(bvec[i].buf, f->data, BLOCK_SIZE);
+				touch(c, f);
+				c->stats.hits++;
+				continue;
+			}
+
+			f = alloc(c, bvec[i].block);
+			if (!f)
+				break;
+			f->pins++;
+			miss[n].block = bvec[i].block;
+			miss[n].buf = f->data;
+			mframes[n] = f;
+			mindex[n] = i;
+			n++;
+			c->stats.misses++;
+		}
+
+		if (n == 0 && i < count) {
+			ret = -1;
+			break;
+		}
+
+		if (n && disk_readv(c->disk, miss, n)) {
+			while (n--)
+				discard(c, mframes[n]);
+			ret = -1;
+			break;
+		}
+
+		while (n--) {
+			f = mframes[n];
+			f->valid = 1;
+			f->pins--;
+			memcpy(bvec[mindex[n]].buf, f->data, BLOCK_SIZE);
+		}
+	}
+
+out:
+	free(miss);
+	free(mframes);
+	free(mindex);
+	return ret;
+}
+
+int cache_writev(struct cache *c, const struct block_iovec *bvec,
+		 size_t count)
+{
+	struct frame *f;
+	size_t i;
+
+	if (!c->nframes)
+		return disk_writev(c->disk, bvec, count);
+
+	for (i = 0; i < count; i++) {
+		f = lookup(c, bvec[i].block);
+		if (f)
+			touch(c, f);
+		else
+			f = alloc(c, bvec[i].block);
+		if (!f)
+			return -1;
+
+		memcpy(f->data, bvec[i].buf, BLOCK_SIZE);
+		f->valid = 1;
+		mark_dirty(c, f);
+	}
+
+	return 0;
+}
+
+int cache_read(struct cache *c, size_t block, void *buf)
+{
+	struct block_iovec bvec = { .block = block, .buf = buf };
+
+	return cache_readv(c, &bvec, 1);
+}
+
+int cache_write(struct cache *c, size_t block, const void *buf)
+{
+	struct block_iovec bvec = { .block = block, .buf = (void *)buf };
+
+	return cache_writev(c, &bvec, 1);
+}
+
+/* Describe a contiguous range as a list of blocks */
+static struct block_iovec *range_to_vec(size_t block, size_t count, void *buf)
+{
+	struct block_iovec *bvec;
+	size_t i;
+
+	bvec = malloc(count * sizeof(*bvec));
+	if (!bvec) {
+		perror("malloc");
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		bvec[i].block = block + i;
+		bvec[i].buf = (char *)buf + i * BLOCK_SIZE;
+	}
+
+	return bvec;
+}
+
+int cache_read_range(struct cache *c, size_t block, size_t count, void *buf)
+{
+	struct block_iovec *bvec;
+	int ret;
+
+	if (!c->nframes)
+		return disk_read_range(c->disk, block, count, buf);
+
+	bvec = range_to_vec(block, count, buf);
+	if (!bvec)
+		return -1;
+	ret = cache_readv(c, bvec, count);
+	free(bvec);
+
+	return ret;
+}
+
+int cache_write_range(struct cache *c, size_t block, size_t count,
+		      const void *buf)
+{
+	struct block_iovec *bvec;
+	int ret;
+
+	if (!c->nframes)
+		return disk_write_range(c->disk, block, count, buf);
+
+	bvec = range_to_vec(block, count, (void *)buf);
+	if (!bvec)
+		return -1;
+	ret = cache_writev(c, bvec, count);
+	free(bvec);
+
+	return ret;
+}
+
+void *cache_pin(struct cache *c, size_t block)
+{
+	struct frame *f;
+
+	if (!c->nframes)
+		return NULL;
+
+	f = lookup(c, block);
+	if (f && !f->valid)
+		return NULL;
+
+	if (f) {
+		c->stats.hits++;
+		touch(c, f);
+	} else {
+		f = alloc(c, block);
+		if (!f)
+			return NULL;
+		c->stats.misses++;
+		if (disk_read(c->disk, block, f->data)) {
+			discard(c, f);
+			return NULL;
+		}
+		f->valid = 1;
+	}
+
+	f->pins++;
+
+	return f->data;
+}
+
+void cache_unpin(struct cache *c, size_t block, int dirty)
+{
+	struct frame *f;
+
+	f = lookup(c, block);
+	if (!f || !f->pins) {
+		cache_error("block %zu is not pinned", block);
+		return;
+	}
+
+	f->pins--;
+	if (dirty)
+		mark_dirty(c, f);
+}
+
+int cache_discard(struct cache *c, size_t block, size_t count)
+{
+	struct frame *f;
+	size_t i;
+
+	for (i = 0; i < count && c->nframes; i++) {
+		f = lookup(c, block + i);
+		if (!f)
+			continue;
+		if (f->pins) {
+			memset(f->data, 0, BLOCK_SIZE);
+			mark_clean(c, f);
+			continue;
+		}
+		mark_clean(c, f);
+		discard(c, f);
+	}
+
+	return disk_discard(c->disk, block, count);
+}
+
+/*
+ * Write back up to @max of the blocks dirtied before @before, the oldest
+ * first, in block order and each run of contiguous blocks with a single
+ * vectored write. A run that fails stays dirty without preventing the others
+ * from being written.
+ */
+int cache_writeback(struct cache *c, uint64_t before, size_t max)
+{
+	struct block_iovec *bvec;
+	size_t i, j, n = 0, run;
+	struct frame *f;
+	struct link *e;
+	int ret = 0;
+
+	if (!c->dirty.len)
+		return 0;
+
+	if (max > c->dirty.len)
+		max = c->dirty.len;
+	bvec = malloc(max * sizeof(*bvec));
+	if (!bvec) {
+		perror("malloc");
+		return -1;
+	}
+
+	/* From the oldest dirty block on */
+	for (e = c->dirty.head.prev; e != &c->dirty.head && n < max;
+	     e = e->prev) {
+		f = container_of(e, struct frame, dirty_link);
+		if (f->dirtied >= before)
+			break;
+		bvec[n].block = f->block;
+		bvec[n].buf = f->data;
+		n++;
+	}
+	block_iovec_sort(bvec, n);
+
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n; run++)
+			if (bvec[i + run].block != bvec[i].block + run)
+				break;
+
+		if (disk_writev(c->disk, &bvec[i], run)) {
+			ret = -1;
+			continue;
+		}
+		for (j = i; j < i + run; j++)
+			mark_clean(c, lookup(c, bvec[j].block));
+		c->stats.writebacks += run;
+	}
+
+	free(bvec);
+	return ret ? ret : (int)n;
+}
+
+int cache_flush(struct cache *c)
+{
+	return cache_writeback(c, UINT64_MAX, SIZE_MAX) < 0 ? -1 : 0;
+}
+
+size_t cache_dirty(struct cache *c, uint64_t *oldest)
+{
+	if (oldest && c->dirty.len)
+		*oldest = container_of(c->dirty.head.prev, struct frame,
+				       dirty_link)->dirtied;
+
+	return c->dirty.len;
+}
+
+size_t cache_size(struct cache *c)
+{
+	return c->nframes;
+}
+
+void cache_stats_get(struct cache *c, struct cache_stats *stats)
+{
+	*stats = c->stats;
+	stats->recent_target = c->target;
+}
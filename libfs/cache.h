@@ -0,0 +1,239 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+#include "disk.h"
+
+/**
+ * enum cache_policy - Block cache replacement policy
+ * @CACHE_POLICY_CLOCK: CLOCK (second chance), approximating LRU. A large
+ * one-shot scan flushes the whole cache.
+ * @CACHE_POLICY_ARC: Adaptive Replacement Cache. Blocks seen once and blocks
+ * seen repeatedly are kept in separate lists whose share of the cache adapts
+ * to the workload, using ghost lists of recently evicted blocks. One-shot
+ * scans only displace blocks seen once.
+ */
+enum cache_policy {
+	CACHE_POLICY_CLOCK,
+	CACHE_POLICY_ARC,
+};
+
+/**
+ * struct cache_stats - Block cache counters
+ * @hits: Block reads served from the cache
+ * @misses: Block reads that had to go to the disk
+ * @evictions: Blocks dropped from the cache to make room for others
+ * @writebacks: Dirty blocks written to the disk
+ * @ghost_recent_hits: (ARC) Misses on blocks recently evicted after being
+ * accessed once, which grow @recent_target
+ * @ghost_frequent_hits: (ARC) Misses on blocks recently evicted after being
+ * accessed repeatedly, which shrink @recent_target
+ * @recent_target: (ARC) Current target number of cached blocks accessed once
+ */
+struct cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t writebacks;
+	size_t ghost_recent_hits;
+	size_t ghost_frequent_hits;
+	size_t recent_target;
+};
+
+/** Opaque handle of a block cache */
+struct cache;
+
+/**
+ * cache_create - Set up a block cache
+ * @d: Disk whose blocks are cached
+ * @nblocks: Number of blocks the cache can hold
+ * @policy: Replacement policy
+ *
+ * Allocate a write-back cache of @nblocks blocks for disk @d, with all
+ * counters at zero. With @nblocks set to 0, the cache is disabled and every
+ * cache_*() access goes straight to the disk.
+ *
+ * Return: NULL if @policy is invalid or if the cache cannot be allocated. The
+ * cache otherwise.
+ */
+struct cache *cache_create(struct disk *d, size_t nblocks,
+			   enum cache_policy policy);
+
+/**
+ * cache_destroy - Tear down a block cache
+ * @c: Cache, or NULL
+ *
+ * Release the cache. Dirty blocks are not written back, see cache_flush().
+ */
+void cache_destroy(struct cache *c);
+
+/**
+ * cache_enabled - Check whether blocks are cached
+ * @c: Cache
+ *
+ * Return: 1 if the cache holds at least one block, 0 otherwise.
+ */
+int cache_enabled(struct cache *c);
+
+/**
+ * cache_read - Read a block through the cache
+ * @c: Cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block cannot be read from the disk. 0 otherwise.
+ */
+int cache_read(struct cache *c, size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @c: Cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * The block is only marked dirty in the cache, and reaches the disk when it
+ * is evicted or flushed.
+ *
+ * Return: -1 if no room can be made in the cache. 0 otherwise.
+ */
+int cache_write(struct cache *c, size_t block, const void *buf);
+
+/**
+ * cache_read_range - Read contiguous blocks through the cache
+ * @c: Cache
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Return: -1 if any of the blocks cannot be read. 0 otherwise.
+ */
+int cache_read_range(struct cache *c, size_t block, size_t count, void *buf);
+
+/**
+ * cache_write_range - Write contiguous blocks through the cache
+ * @c: Cache
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Return: -1 if any of the blocks cannot be written. 0 otherwise.
+ */
+int cache_write_range(struct cache *c, size_t block, size_t count,
+		      const void *buf);
+
+/**
+ * cache_readv - Read a list of blocks through the cache
+ * @c: Cache
+ * @bvec: Array of blocks to read
+ * @count: Number of elements in @bvec
+ *
+ * Blocks found in the cache are copied right away, the missing ones are read
+ * from the disk together with block_readv() so that contiguous misses cost a
+ * single call.
+ *
+ * Return: -1 if any of the blocks cannot be read. 0 otherwise.
+ */
+int cache_readv(struct cache *c, const struct block_iovec *bvec,
+		size_t count);
+
+/**
+ * cache_writev - Write a list of blocks through the cache
+ * @c: Cache
+ * @bvec: Array of blocks to write
+ * @count: Number of elements in @bvec
+ *
+ * Return: -1 if any of the blocks cannot be written. 0 otherwise.
+ */
+int cache_writev(struct cache *c, const struct block_iovec *bvec,
+		 size_t count);
+
+/**
+ * cache_pin - Get a pinned reference to a cached block
+ * @c: Cache
+ * @block: Index of the block
+ *
+ * Load block @block in the cache if needed and prevent it from being evicted
+ * until the matching cache_unpin(). The content of the block can be accessed
+ * and modified in place through the returned pointer.
+ *
+ * Return: NULL if the cache is disabled, if the block cannot be read, or if
+ * every cached block is pinned. A pointer to the block's content otherwise.
+ */
+void *cache_pin(struct cache *c, size_t block);
+
+/**
+ * cache_unpin - Release a pinned block
+ * @c: Cache
+ * @block: Index of the block
+ * @dirty: Whether the content of the block was modified
+ */
+void cache_unpin(struct cache *c, size_t block, int dirty);
+
+/**
+ * cache_discard - Release the storage of blocks
+ * @c: Cache
+ * @block: Index of the first block to release
+ * @count: Number of blocks to release
+ *
+ * Drop the blocks from the cache without writing them back, then release them
+ * on the disk with disk_discard(). Pinned blocks stay cached, zeroed.
+ *
+ * Return: -1 if the blocks cannot be released on the disk. 0 otherwise.
+ */
+int cache_discard(struct cache *c, size_t block, size_t count);
+
+/**
+ * cache_flush - Write back all dirty blocks
+ * @c: Cache
+ *
+ * Dirty blocks are written in increasing block order, and each run of
+ * contiguous dirty blocks is written with a single vectored call.
+ *
+ * Return: -1 if any of the dirty blocks cannot be written. 0 otherwise.
+ */
+int cache_flush(struct cache *c);
+
+/**
+ * cache_writeback - Write back some of the dirty blocks
+ * @c: Cache
+ * @before: Time in nanoseconds (%CLOCK_MONOTONIC) before which the blocks
+ * became dirty, %UINT64_MAX for all of them
+ * @max: Largest number of blocks to write back
+ *
+ * Same as cache_flush(), for the @max blocks that have been dirty the longest
+ * only, and only if they became dirty before @before. A block stays dirty
+ * since the first time it is written after being clean.
+ *
+ * Return: -1 if any of the blocks cannot be written. The number of blocks
+ * considered otherwise, 0 once there are none left.
+ */
+int cache_writeback(struct cache *c, uint64_t before, size_t max);
+
+/**
+ * cache_dirty - Count the dirty blocks
+ * @c: Cache
+ * @oldest: Set to the time in nanoseconds (%CLOCK_MONOTONIC) at which the
+ * oldest dirty block became dirty, if there is one. May be NULL
+ *
+ * Return: Number of cached blocks that differ from the disk.
+ */
+size_t cache_dirty(struct cache *c, uint64_t *oldest);
+
+/**
+ * cache_size - Get the size of a cache
+ * @c: Cache
+ *
+ * Return: Number of blocks the cache can hold, 0 if it is disabled.
+ */
+size_t cache_size(struct cache *c);
+
+/**
+ * cache_stats_get - Get the cache counters
+ * @c: Cache
+ * @stats: Counters to fill in
+ */
+void cache_stats_get(struct cache *c, struct cache_stats *stats);
+
+#endif /* _CACHE_H */
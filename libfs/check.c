@@ -0,0 +1,724 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "journal.h"
+#include "layout.h"
+
+// current time in nanoseconds
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// chains checked by fs_check(): the checksum and journal regions, then one
+// per root directory entry. chains are numbered from 1 in this order, so
+// that lower numbers win the blocks they share
+#define CHECK_REGIONS 2
+#define CHECK_CHAINS (CHECK_REGIONS + FS_FILE_MAX_COUNT)
+// data blocks each thread of fs_check() has to check, at least
+#define CHECK_THREAD_BLOCKS 16384
+#define CHECK_THREADS_MAX 64
+
+// how the walk of a chain ended
+enum check_end {
+    CHECK_END_OK,
+    CHECK_END_BAD_LINK,
+    CHECK_END_CYCLE,
+    CHECK_END_CROSS,
+};
+
+struct check_chain {
+    // first data block, FAT_EOC if none. regions span @count blocks
+    uint16_t first;
+    size_t count;
+    int region;
+    int file;
+    // blocks walked before the end of the chain or a problem
+    size_t length;
+    enum check_end end;
+};
+
+// state shared by the threads of fs_check()
+struct check_state {
+    const super_block *sb;
+    const uint16_t *fat;
+    int dedup;
+    struct check_chain chains[CHECK_CHAINS];
+    // data blocks reached by a chain, by several, and the lowest chain
+    // reaching each
+    uint64_t *visited;
+    uint64_t *shared_blocks;
+    uint8_t *owner;
+    // next chain to walk, whether a block was reached twice, and whether a
+    // thread ran out of memory
+    size_t next;
+    int shared;
+    int error;
+};
+
+// range of data blocks scanned by a thread of fs_check(), and what it found
+struct check_range {
+    struct check_state *st;
+    size_t start;
+    size_t end;
+    size_t free_blocks;
+    size_t used_blocks;
+    size_t orphans;
+};
+
+const char *fs_check_phase_name(enum fs_check_phase phase)
+{
+    static const char *const names[FS_CHECK_PHASES] = {
+        [FS_CHECK_SUPERBLOCK] = "superblock",
+        [FS_CHECK_LOAD] = "load",
+        [FS_CHECK_CHAINS] = "chains",
+        [FS_CHECK_FREE] = "free",
+        [FS_CHECK_REPAIR] = "repair",
+    };
+    if ((unsigned int)phase >= FS_CHECK_PHASES){
+        return "unknown";
+    }
+    return names[phase];
+}
+
+// count a problem in @counter and in the errors of @report, printing it if
+// asked to
+static void check_problem(const struct fs_check_opts *opts, struct fs_check_report *report,
+                   size_t *counter, const char *fmt, ...)
+{
+    (*counter)++;
+    report->errors++;
+    if (opts->verbose){
+        va_list ap;
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        printf("\n");
+    }
+}
+
+// returns -1 if @sb does not describe a file system of @disk_blocks disk
+// blocks, printing why if asked to
+static int check_geometry(const super_block *sb, size_t disk_blocks, const struct fs_check_opts *opts)
+{
+    const char *why = NULL;
+    size_t block_size = sb->block_shift ? (size_t)1 << (sb->block_shift & 31) : 4096;
+    size_t fat_blocks = (sb->data_blocks_count * sizeof(uint16_t) + block_size - 1) / block_size;
+    size_t total = sb->virtual_disk_blocks_count;
+    size_t dbsi = sb->data_block_start_index;
+    size_t csum_end = (size_t)sb->csum_block_start + sb->csum_blocks_count;
+    size_t journal_end = (size_t)sb->journal_block_start + sb->journal_blocks_count;
+
+    if (memcmp("ECS150FS", sb->signature, 8) != 0){
+        why = "bad signature";
+    } else if (block_size < FS_BLOCK_SIZE_MIN || block_size > FS_BLOCK_SIZE_MAX){
+        why = "unsupported block size";
+    } else if (total * (block_size / BLOCK_SIZE) != disk_blocks){
+        why = "block count does not match the size of the disk";
+    } else if (sb->data_blocks_count == 0 || sb->data_blocks_count >= FAT_EOC){
+        why = "bad data block count";
+    } else if (sb->fat_blocks_count != fat_blocks){
+        why = "FAT block count does not match the data block count";
+    } else if (sb->root_directory_block_index != 1 + fat_blocks ||
+               dbsi != (size_t)sb->root_directory_block_index + 1 ||
+               total != dbsi + sb->data_blocks_count){
+        why = "regions do not follow each other";
+    } else if ((sb->features & FS_FEATURE_CSUM) &&
+               (sb->csum_blocks_count == 0 || sb->csum_block_start <= dbsi || csum_end > total)){
+        // entry 0 is reserved
+        why = "checksum region outside of the data blocks";
+    } else if ((sb->features & FS_FEATURE_JOURNAL) &&
+               (sb->journal_blocks_count == 0 || sb->journal_block_start <= dbsi ||
+                journal_end > total)){
+        why = "journal region outside of the data blocks";
+    } else if ((sb->features & FS_FEATURE_CSUM) && (sb->features & FS_FEATURE_JOURNAL) &&
+               sb->csum_block_start < journal_end && sb->journal_block_start < csum_end){
+        why = "checksum and journal regions overlap";
+    }
+
+    if (why != NULL){
+        if (opts->verbose){
+            printf("invalid superblock: %s\n", why);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// mark data block @b as reached by chain @id, which owns it unless a lower
+// chain reaches it too
+static void check_claim(struct check_state *st, size_t b, uint8_t id)
+{
+    uint64_t bit = (uint64_t)1 << (b % 64);
+    if (__atomic_fetch_or(&st->visited[b / 64], bit, __ATOMIC_RELAXED) & bit){
+        __atomic_fetch_or(&st->shared_blocks[b / 64], bit, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->shared, 1, __ATOMIC_RELAXED);
+    }
+    uint8_t owner = __atomic_load_n(&st->owner[b], __ATOMIC_RELAXED);
+    while ((owner == 0 || owner > id) &&
+           !__atomic_compare_exchange_n(&st->owner[b], &owner, id, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    }
+}
+
+// walk chain @id of @st, the blocks of its own walk marked in @mine, which is
+// left clear
+static void check_walk(struct check_state *st, size_t id, uint64_t *mine)
+{
+    struct check_chain *chain = &st->chains[id - 1];
+    size_t data_blocks = st->sb->data_blocks_count;
+
+    // regions own their blocks, whatever their chain
+    if (chain->region){
+        for (size_t i=0; i<chain->count; i++){
+            size_t b = chain->first + i;
+            size_t next = i + 1 < chain->count ? b + 1 : FAT_EOC;
+            if (st->fat[b] != next){
+                chain->end = CHECK_END_BAD_LINK;
+            }
+            check_claim(st, b, id);
+        }
+        chain->length = chain->count;
+        return;
+    }
+
+    size_t n = 0;
+    for (size_t b=chain->first; b!=FAT_EOC; b=st->fat[b]){
+        if (b == 0 || b >= data_blocks || st->fat[b] == 0){
+            chain->end = CHECK_END_BAD_LINK;
+            break;
+        }
+        if (mine[b / 64] & ((uint64_t)1 << (b % 64))){
+            chain->end = CHECK_END_CYCLE;
+            break;
+        }
+        mine[b / 64] |= (uint64_t)1 << (b % 64);
+        check_claim(st, b, id);
+        n++;
+    }
+    chain->length = n;
+
+    size_t b = chain->first;
+    for (size_t i=0; i<n; i++){
+        mine[b / 64] = 0;
+        b = st->fat[b];
+    }
+}
+
+// thread of fs_check() walking chains until there are none left
+static void *check_chains_thread(void *arg)
+{
+    struct check_state *st = arg;
+    uint64_t *mine = calloc(st->sb->data_blocks_count / 64 + 1, sizeof(uint64_t));
+    if (mine == NULL){
+        __atomic_store_n(&st->error, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    size_t i;
+    while ((i = __atomic_fetch_add(&st->next, 1, __ATOMIC_RELAXED)) < CHECK_CHAINS){
+        if (st->chains[i].first != FAT_EOC){
+            check_walk(st, i + 1, mine);
+        }
+    }
+    free(mine);
+    return NULL;
+}
+
+// thread of fs_check() scanning the FAT entries of a range of data blocks
+static void *check_free_thread(void *arg)
+{
+    struct check_range *r = arg;
+    for (size_t b=r->start; b<r->end; b++){
+        int visited = (r->st->visited[b / 64] >> (b % 64)) & 1;
+        if (visited){
+            r->used_blocks++;
+        } else if (r->st->fat[b] == 0){
+            r->free_blocks++;
+        } else {
+            r->orphans++;
+        }
+    }
+    return NULL;
+}
+
+// run @fn on each of the @n arguments from @args on, @size bytes apart, in
+// parallel. arguments whose thread cannot be created are handled by the caller
+static void run_parallel(void *(*fn)(void *), void *args, size_t size, size_t n)
+{
+    pthread_t threads[CHECK_THREADS_MAX];
+    int started[CHECK_THREADS_MAX] = {0};
+    for (size_t t=1; t<n; t++){
+        started[t] = pthread_create(&threads[t], NULL, fn, (char*)args + t * size) == 0;
+    }
+    fn(args);
+    for (size_t t=1; t<n; t++){
+        if (started[t]){
+            pthread_join(threads[t], NULL);
+        } else {
+            fn((char*)args + t * size);
+        }
+    }
+}
+
+// returns the block at position @n of the chain starting at @first, or
+// FAT_EOC if the chain is shorter
+static uint16_t check_block_at(const uint16_t *fat, uint16_t first, size_t n)
+{
+    for (size_t i=0; i<n && first!=FAT_EOC; i++){
+        first = fat[first];
+    }
+    return first;
+}
+
+// name of chain @c of fs_check(), for reporting
+static void check_chain_name(const struct root_dir *rd, size_t c, char *name, size_t len)
+{
+    if (c == 0){
+        snprintf(name, len, "checksum region");
+    } else if (c == 1){
+        snprintf(name, len, "journal region");
+    } else {
+        snprintf(name, len, "file '%.16s'", rd[c - CHECK_REGIONS].filename);
+    }
+}
+
+// replay the journal of the file system of @diskname, as mounting does, and
+// read its superblock @sb again from @raw. returns -1 if it cannot be replayed
+static int check_replay(const char *diskname, struct disk *raw, super_block *sb,
+                 const struct fs_check_opts *opts)
+{
+    struct disk *disk = disk_open(diskname, opts->backend);
+    if (disk == NULL){
+        return -1;
+    }
+    struct journal *journal = NULL;
+    uint8_t features = sb->features;
+    size_t spb = (sb->block_shift ? (size_t)1 << sb->block_shift : 4096) / BLOCK_SIZE;
+    int ret = -1;
+    if ((features & FS_FEATURE_CSUM) &&
+        disk_csum_enable(disk, sb->csum_block_start * spb, sb->csum_blocks_count * spb, 0) == -1){
+        goto out;
+    }
+    // the replayed superblock is read as it is on the disk too, from @raw
+    journal = journal_open(disk, sb->journal_block_start * spb, sb->journal_blocks_count * spb);
+    if (journal == NULL || disk_read(raw, 0, sb) == -1 ||
+        check_geometry(sb, disk_count(disk), opts) == -1){
+        goto out;
+    }
+    // the replayed superblock may have a checksum region, whose checksums
+    // predate the replay
+    spb = (sb->block_shift ? (size_t)1 << sb->block_shift : 4096) / BLOCK_SIZE;
+    if ((sb->features & FS_FEATURE_CSUM) && !(features & FS_FEATURE_CSUM) &&
+        disk_csum_enable(disk, sb->csum_block_start * spb, sb->csum_blocks_count * spb, 1) == -1){
+        goto out;
+    }
+    ret = 0;
+
+out:
+    journal_close(journal);
+    if (disk_close(disk) == -1){
+        ret = -1;
+    }
+    return ret;
+}
+
+int fs_check(const char *diskname, const struct fs_check_opts *opts,
+             struct fs_check_report *report)
+{
+    struct fs_check_opts defaults = {
+        .backend = BLOCK_BACKEND_FILE,
+    };
+    if (diskname == NULL || report == NULL){
+        return -1;
+    }
+    if (opts == NULL){
+        opts = &defaults;
+    }
+    memset(report, 0, sizeof(*report));
+
+    struct check_state st = {0};
+    struct root_dir *rd = NULL;
+    uint16_t *fat = NULL;
+    uint32_t *index = NULL;
+    int ret = -1;
+    uint64_t start = now_ns();
+
+    // the superblock, after replaying the journal when repairing. metadata is
+    // read as it is on the disk, whatever its checksums
+    super_block *sb = block_buf_alloc(1);
+    struct disk *disk = disk_open(diskname, opts->backend);
+    if (sb == NULL || disk == NULL || disk_read(disk, 0, sb) == -1 ||
+        check_geometry(sb, disk_count(disk), opts) == -1 ||
+        (opts->repair && (sb->features & FS_FEATURE_JOURNAL) &&
+         check_replay(diskname, disk, sb, opts) == -1)){
+        goto out;
+    }
+    size_t spb = (sb->block_shift ? (size_t)1 << sb->block_shift : 4096) / BLOCK_SIZE;
+    size_t data_blocks = sb->data_blocks_count;
+    size_t block_size = spb * BLOCK_SIZE;
+    report->phase_ns[FS_CHECK_SUPERBLOCK] = now_ns() - start;
+
+    start = now_ns();
+    fat = block_buf_alloc(sb->fat_blocks_count * spb);
+    rd = block_buf_alloc(spb);
+    index = block_buf_alloc(spb);
+    st.visited = calloc(data_blocks / 64 + 1, sizeof(uint64_t));
+    st.shared_blocks = calloc(data_blocks / 64 + 1, sizeof(uint64_t));
+    st.owner = calloc(data_blocks, 1);
+    if (fat == NULL || rd == NULL || index == NULL || st.visited == NULL || st.shared_blocks == NULL ||
+        st.owner == NULL ||
+        disk_read_range(disk, spb, sb->fat_blocks_count * spb, fat) == -1 ||
+        disk_read_range(disk, sb->root_directory_block_index * spb, spb, rd) == -1){
+        goto out;
+    }
+    report->phase_ns[FS_CHECK_LOAD] = now_ns() - start;
+
+    // walk the chains in parallel, each thread taking the next one left. a
+    // block reached by several chains goes to the lowest of them
+    start = now_ns();
+    unsigned int threads = opts->threads;
+    if (threads == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = data_blocks / CHECK_THREAD_BLOCKS;
+        if (cpus > 0 && threads > (unsigned long)cpus){
+            threads = cpus;
+        }
+    }
+    if (threads < 1){
+        threads = 1;
+    }
+    if (threads > CHECK_THREADS_MAX){
+        threads = CHECK_THREADS_MAX;
+    }
+    report->threads = threads;
+
+    st.sb = sb;
+    st.fat = fat;
+    st.dedup = (sb->features & FS_FEATURE_DEDUP) != 0;
+    for (size_t c=0; c<CHECK_CHAINS; c++){
+        st.chains[c].first = FAT_EOC;
+    }
+    if (sb->features & FS_FEATURE_CSUM){
+        st.chains[0] = (struct check_chain){
+            .first = sb->csum_block_start - sb->data_block_start_index,
+            .count = sb->csum_blocks_count,
+            .region = 1,
+        };
+    }
+    if (sb->features & FS_FEATURE_JOURNAL){
+        st.chains[1] = (struct check_chain){
+            .first = sb->journal_block_start - sb->data_block_start_index,
+            .count = sb->journal_blocks_count,
+            .region = 1,
+        };
+    }
+    for (size_t i=0; i<FS_FILE_MAX_COUNT; i++){
+        if (rd[i].filename[0] != '\0'){
+            st.chains[CHECK_REGIONS + i].first = rd[i].first_data_block_index;
+            st.chains[CHECK_REGIONS + i].file = 1;
+            report->files++;
+        }
+    }
+    run_parallel(check_chains_thread, &st, 0, threads);
+    if (st.error){
+        goto out;
+    }
+
+    // files lose their blocks from the first one owned by a lower chain, or
+    // by a region when blocks can be shared between files
+    for (size_t c=CHECK_REGIONS; st.shared && c<CHECK_CHAINS; c++){
+        struct check_chain *chain = &st.chains[c];
+        uint16_t b = chain->first;
+        for (size_t i=0; i<chain->length; i++){
+            if (st.owner[b] < c + 1 && (!st.dedup || st.owner[b] <= CHECK_REGIONS)){
+                chain->length = i;
+                chain->end = CHECK_END_CROSS;
+                break;
+            }
+            b = fat[b];
+        }
+    }
+
+    // report the problems, in order, and what is needed to fix them
+    char name[64];
+    size_t keep[CHECK_CHAINS];
+    uint32_t sizes[CHECK_CHAINS];
+    int resize[CHECK_CHAINS] = {0};
+    for (size_t c=0; c<CHECK_CHAINS; c++){
+        struct check_chain *chain = &st.chains[c];
+        keep[c] = chain->length;
+        if (!chain->region && !chain->file){
+            continue;
+        }
+        check_chain_name(rd, c, name, sizeof(name));
+        switch (chain->end){
+        case CHECK_END_BAD_LINK:
+            check_problem(opts, report, &report->bad_links, "%s: %s after %zu blocks",
+                          name, chain->region ? "not chained in order" : "bad link",
+                          chain->length);
+            break;
+        case CHECK_END_CYCLE:
+            check_problem(opts, report, &report->cycles, "%s: cycle after %zu blocks",
+                          name, chain->length);
+            break;
+        case CHECK_END_CROSS:
+            check_problem(opts, report, &report->cross_links,
+                          "%s: cross-linked with %s after %zu blocks", name,
+                          st.owner[check_block_at(fat, chain->first, chain->length)] <= CHECK_REGIONS ?
+                          "a region" : "another file", chain->length);
+            break;
+        case CHECK_END_OK:
+            break;
+        }
+        if (chain->region){
+            continue;
+        }
+
+        struct root_dir *entry = &rd[c - CHECK_REGIONS];
+        sizes[c] = entry->file_size;
+        if (entry->flags & RD_COMPRESSED){
+            if ((entry->file_size > 0) != (chain->length > 0)){
+                check_problem(opts, report, &report->bad_sizes,
+                              "%s: size %u with %zu blocks", name, entry->file_size,
+                              chain->length);
+                keep[c] = entry->file_size > 0 ? chain->length : 0;
+                sizes[c] = keep[c] ? entry->file_size : 0;
+                resize[c] = 1;
+                continue;
+            }
+            if (entry->file_size == 0){
+                continue;
+            }
+
+            // the index block holds the stored size of each group, whose
+            // blocks follow in order. files keep their groups up to the first
+            // one that is corrupted or missing
+            size_t groups = (entry->file_size + GROUP_SIZE - 1) / GROUP_SIZE;
+            size_t blocks = 1, g;
+            if (disk_read_range(disk, (sb->data_block_start_index + chain->first) * spb, spb,
+                                index) == -1){
+                goto out;
+            }
+            for (g=0; g<groups && g<block_size / sizeof(uint32_t); g++){
+                size_t stored = index[g] & ~GROUP_RAW;
+                size_t n = (stored + block_size - 1) / block_size;
+                if (stored > GROUP_SIZE || n == 0 || n > GROUP_BLOCKS_MAX ||
+                    blocks + n > chain->length){
+                    break;
+                }
+                blocks += n;
+            }
+            if (g < groups || blocks != chain->length){
+                check_problem(opts, report, &report->bad_groups,
+                              "%s: %zu of %zu groups in %zu of %zu blocks", name, g, groups,
+                              blocks, chain->length);
+                keep[c] = g ? blocks : 0;
+                sizes[c] = g < groups ? g * GROUP_SIZE : entry->file_size;
+                resize[c] = 1;
+            }
+        } else {
+            size_t blocks = (entry->file_size + block_size - 1) / block_size;
+            if (blocks != chain->length){
+                check_problem(opts, report, &report->bad_sizes,
+                              "%s: size %u with %zu blocks", name, entry->file_size,
+                              chain->length);
+                keep[c] = blocks < chain->length ? blocks : chain->length;
+                if (entry->file_size > keep[c] * block_size){
+                    sizes[c] = keep[c] * block_size;
+                }
+                resize[c] = 1;
+            }
+        }
+    }
+
+    // names must be terminated and unique
+    for (size_t i=0; i<FS_FILE_MAX_COUNT; i++){
+        if (rd[i].filename[0] == '\0'){
+            continue;
+        }
+        if (memchr(rd[i].filename, '\0', FS_FILENAME_LEN) == NULL){
+            check_problem(opts, report, &report->bad_entries, "entry %zu: unterminated name", i);
+        }
+        for (size_t k=0; k<i; k++){
+            if (rd[k].filename[0] != '\0' &&
+                strncmp(rd[i].filename, rd[k].filename, FS_FILENAME_LEN) == 0){
+                check_problem(opts, report, &report->bad_entries,
+                              "entry %zu: same name as entry %zu, '%.16s'", i, k, rd[i].filename);
+                break;
+            }
+        }
+    }
+    report->phase_ns[FS_CHECK_CHAINS] = now_ns() - start;
+
+    // blocks reached by no chain should be free, in parallel over ranges of
+    // whole words of the bitmap. entry 0 is reserved
+    start = now_ns();
+    struct check_range ranges[CHECK_THREADS_MAX];
+    size_t words = (data_blocks + 63) / 64;
+    for (size_t t=0; t<threads; t++){
+        ranges[t] = (struct check_range){
+            .st = &st,
+            .start = words * t / threads * 64,
+            .end = words * (t + 1) / threads * 64,
+        };
+        if (ranges[t].start == 0){
+            ranges[t].start = 1;
+        }
+        if (ranges[t].end > data_blocks){
+            ranges[t].end = data_blocks;
+        }
+        if (ranges[t].start > ranges[t].end){
+            ranges[t].start = ranges[t].end;
+        }
+    }
+    run_parallel(check_free_thread, ranges, sizeof(ranges[0]), threads);
+    size_t orphans = 0;
+    for (size_t t=0; t<threads; t++){
+        report->free_blocks += ranges[t].free_blocks;
+        report->used_blocks += ranges[t].used_blocks;
+        orphans += ranges[t].orphans;
+    }
+    if (orphans > 0){
+        check_problem(opts, report, &report->orphans, "%zu orphaned blocks", orphans);
+        report->orphans = orphans;
+        report->errors += orphans - 1;
+    }
+    if (fat[0] != FAT_EOC){
+        check_problem(opts, report, &report->bad_links, "reserved FAT entry is %u", fat[0]);
+    }
+
+    size_t free_entries = FS_FILE_MAX_COUNT - report->files;
+    if (sb->features & FS_FEATURE_COUNTS){
+        if (sb->free_blocks_count != report->free_blocks){
+            check_problem(opts, report, &report->bad_counts, "superblock: %u free blocks, %zu found",
+                          sb->free_blocks_count, report->free_blocks);
+        }
+        if (sb->free_entries_count != free_entries){
+            check_problem(opts, report, &report->bad_counts,
+                          "superblock: %u free entries, %zu found",
+                          sb->free_entries_count, free_entries);
+        }
+    }
+    report->phase_ns[FS_CHECK_FREE] = now_ns() - start;
+
+    if (!opts->repair || report->errors == 0){
+        ret = 0;
+        goto out;
+    }
+
+    // cut the chains, then free every block that is no longer reached
+    start = now_ns();
+    for (size_t c=0; c<CHECK_CHAINS; c++){
+        struct check_chain *chain = &st.chains[c];
+        if (chain->region){
+            if (chain->end != CHECK_END_OK){
+                for (size_t i=0; i<chain->count; i++){
+                    fat[chain->first + i] = i + 1 < chain->count ? chain->first + i + 1 : FAT_EOC;
+                }
+                report->repaired++;
+            }
+            continue;
+        }
+        if (!chain->file){
+            continue;
+        }
+
+        // chains cut by another file with the same blocks end earlier
+        struct root_dir *entry = &rd[c - CHECK_REGIONS];
+        uint16_t last = keep[c] ? check_block_at(fat, entry->first_data_block_index, keep[c] - 1) :
+            FAT_EOC;
+        if (chain->end == CHECK_END_OK && keep[c] < chain->length && st.dedup){
+            // blocks past the end of the file may belong to other files too
+            uint16_t b = keep[c] ? fat[last] : entry->first_data_block_index;
+            if (b != FAT_EOC && (st.shared_blocks[b / 64] & ((uint64_t)1 << (b % 64)))){
+                continue;
+            }
+        }
+        if (chain->end != CHECK_END_OK || keep[c] < chain->length){
+            if (keep[c] == 0){
+                entry->first_data_block_index = FAT_EOC;
+            } else if (last != FAT_EOC){
+                fat[last] = FAT_EOC;
+            }
+        }
+        if (chain->end != CHECK_END_OK){
+            report->repaired++;
+        }
+        if (resize[c]){
+            entry->file_size = sizes[c];
+            report->repaired++;
+        }
+    }
+    for (size_t i=0; i<FS_FILE_MAX_COUNT; i++){
+        if (rd[i].filename[0] != '\0' && memchr(rd[i].filename, '\0', FS_FILENAME_LEN) == NULL){
+            rd[i].filename[FS_FILENAME_LEN - 1] = '\0';
+            report->repaired++;
+        }
+    }
+
+    memset(st.visited, 0, (data_blocks / 64 + 1) * sizeof(uint64_t));
+    for (size_t c=0; c<CHECK_CHAINS; c++){
+        struct check_chain *chain = &st.chains[c];
+        uint16_t b = chain->region ? chain->first :
+            chain->file ? rd[c - CHECK_REGIONS].first_data_block_index : FAT_EOC;
+        for (; b<data_blocks && !(st.visited[b / 64] & ((uint64_t)1 << (b % 64))); b=fat[b]){
+            st.visited[b / 64] |= (uint64_t)1 << (b % 64);
+        }
+    }
+    report->free_blocks = 0;
+    report->used_blocks = 0;
+    for (size_t b=1; b<data_blocks; b++){
+        if (st.visited[b / 64] & ((uint64_t)1 << (b % 64))){
+            report->used_blocks++;
+        } else {
+            fat[b] = 0;
+            report->free_blocks++;
+        }
+    }
+    report->repaired += orphans;
+    if (fat[0] != FAT_EOC){
+        fat[0] = FAT_EOC;
+        report->repaired++;
+    }
+    if (sb->features & FS_FEATURE_COUNTS){
+        report->repaired += report->bad_counts;
+        sb->free_blocks_count = report->free_blocks;
+        sb->free_entries_count = free_entries;
+    }
+
+    // the checksums of the blocks written are updated
+    if ((sb->features & FS_FEATURE_CSUM) &&
+        disk_csum_enable(disk, sb->csum_block_start * spb, sb->csum_blocks_count * spb, 0) == -1){
+        goto out;
+    }
+    if (disk_write_range(disk, spb, sb->fat_blocks_count * spb, fat) == 0 &&
+        disk_write_range(disk, sb->root_directory_block_index * spb, spb, rd) == 0 &&
+        disk_write(disk, 0, sb) == 0 && disk_csum_sync(disk) == 0 &&
+        disk_sync_range(disk, 0, disk_count(disk)) == 0){
+        ret = 0;
+    }
+    report->phase_ns[FS_CHECK_REPAIR] = now_ns() - start;
+
+out:
+    free(st.owner);
+    free(st.shared_blocks);
+    free(st.visited);
+    block_buf_free(index);
+    block_buf_free(rd);
+    block_buf_free(fat);
+    if (disk != NULL && disk_close(disk) == -1){
+        ret = -1;
+    }
+    block_buf_free(sb);
+    return ret;
+}
@@ -0,0 +1,246 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "crc32c.h"
+
+/* CRC32C polynomial, bit-reflected */
+#define CRC32C_POLY 0x82F63B78
+
+/* Length of each of the 3 interleaved streams, in bytes */
+#define STREAM_LEN 1360
+
+/* Portable tables, slicing by 8 */
+static uint32_t table[8][256];
+
+/* Multiplier shifting a checksum over %STREAM_LEN zero bytes (PCLMULQDQ) */
+static uint32_t stream_shift;
+
+static int initialized;
+
+static uint32_t crc32c_portable(uint32_t crc, const void *buf, size_t len);
+static uint32_t (*crc32c_fn)(uint32_t crc, const void *buf, size_t len);
+
+/* Multiply reflected polynomial @a by x modulo the CRC32C polynomial */
+static uint32_t mul_x(uint32_t a)
+{
+	return (a >> 1) ^ (a & 1 ? CRC32C_POLY : 0);
+}
+
+static uint32_t crc32c_portable(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t v;
+
+	crc = ~crc;
+	while (len && ((uintptr_t)p & 7)) {
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = table[7][v & 0xff] ^
+		      table[6][(v >> 8) & 0xff] ^
+		      table[5][(v >> 16) & 0xff] ^
+		      table[4][(v >> 24) & 0xff] ^
+		      table[3][(v >> 32) & 0xff] ^
+		      table[2][(v >> 40) & 0xff] ^
+		      table[1][(v >> 48) & 0xff] ^
+		      table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+
+/* Raw crc32 instruction loop, without the initial and final inversions */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_raw(uint32_t crc, const unsigned char *p,
+				 size_t len)
+{
+	uint64_t c = crc, v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+
+	return c;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+	return ~crc32c_sse42_raw(~crc, buf, len);
+}
+
+/*
+ * Shift raw checksum @crc over %STREAM_LEN zero bytes: multiply it by
+ * x^(8 * STREAM_LEN - 33) with a carry-less multiplication, then let the
+ * crc32 instruction reduce the 64-bit product (which adds the missing x^33).
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t shift_stream(uint32_t crc)
+{
+	__m128i a = _mm_cvtsi32_si128(crc);
+	__m128i k = _mm_cvtsi32_si128(stream_shift);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(_mm_clmulepi64_si128(a, k,
+									 0)));
+}
+
+/*
+ * The crc32 instruction has a latency of 3 cycles but a throughput of 1, so 3
+ * independent streams keep it busy. Each stream is checksummed on its own and
+ * the checksums are then combined.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_sse42_pclmul(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t a, b, c, va, vb, vc;
+	size_t i;
+
+	crc = ~crc;
+	while (len >= 3 * STREAM_LEN) {
+		a = crc;
+		b = 0;
+		c = 0;
+		for (i = 0; i < STREAM_LEN; i += 8) {
+			memcpy(&va, p + i, 8);
+			memcpy(&vb, p + STREAM_LEN + i, 8);
+			memcpy(&vc, p + 2 * STREAM_LEN + i, 8);
+			a = _mm_crc32_u64(a, va);
+			b = _mm_crc32_u64(b, vb);
+			c = _mm_crc32_u64(c, vc);
+		}
+		crc = shift_stream(shift_stream(a) ^ b) ^ c;
+		p += 3 * STREAM_LEN;
+		len -= 3 * STREAM_LEN;
+	}
+
+	return ~crc32c_sse42_raw(crc, p, len);
+}
+
+static int impl_supported(enum crc32c_impl impl)
+{
+	__builtin_cpu_init();
+	switch (impl) {
+	case CRC32C_IMPL_PORTABLE:
+		return 1;
+	case CRC32C_IMPL_SSE42:
+		return __builtin_cpu_supports("sse4.2");
+	case CRC32C_IMPL_SSE42_PCLMUL:
+		return __builtin_cpu_supports("sse4.2") &&
+			__builtin_cpu_supports("pclmul");
+	}
+	return 0;
+}
+
+#else
+
+static int impl_supported(enum crc32c_impl impl)
+{
+	return impl == CRC32C_IMPL_PORTABLE;
+}
+
+#endif
+
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	size_t i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (k = 0; k < 8; k++)
+			crc = mul_x(crc);
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (k = 1; k < 8; k++)
+			table[k][i] = table[0][table[k - 1][i] & 0xff] ^
+				(table[k - 1][i] >> 8);
+
+	/* x^0 is the top bit of a reflected polynomial */
+	stream_shift = 0x80000000;
+	for (i = 0; i < 8 * STREAM_LEN - 33; i++)
+		stream_shift = mul_x(stream_shift);
+
+	initialized = 1;
+	if (crc32c_fn)
+		return;
+	crc32c_fn = crc32c_portable;
+#if defined(__x86_64__)
+	if (impl_supported(CRC32C_IMPL_SSE42_PCLMUL))
+		crc32c_fn = crc32c_sse42_pclmul;
+	else if (impl_supported(CRC32C_IMPL_SSE42))
+		crc32c_fn = crc32c_sse42;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	if (!initialized)
+		crc32c_init();
+
+	return crc32c_fn(crc, buf, len);
+}
+
+int crc32c_use(enum crc32c_impl impl)
+{
+	if (!impl_supported(impl))
+		return -1;
+
+	if (!initialized)
+		crc32c_init();
+
+	switch (impl) {
+	case CRC32C_IMPL_PORTABLE:
+		crc32c_fn = crc32c_portable;
+		break;
+#if defined(__x86_64__)
+	case CRC32C_IMPL_SSE42:
+		crc32c_fn = crc32c_sse42;
+		break;
+	case CRC32C_IMPL_SSE42_PCLMUL:
+		crc32c_fn = crc32c_sse42_pclmul;
+		break;
+#endif
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+const char *crc32c_impl_name(enum crc32c_impl impl)
+{
+	switch (impl) {
+	case CRC32C_IMPL_PORTABLE:
+		return "portable";
+	case CRC32C_IMPL_SSE42:
+		return "sse4.2";
+	case CRC32C_IMPL_SSE42_PCLMUL:
+		return "sse4.2+pclmul";
+	}
+	return "unknown";
+}
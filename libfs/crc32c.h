@@ -0,0 +1,49 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * enum crc32c_impl - CRC32C implementation
+ * @CRC32C_IMPL_PORTABLE: Table-driven, slicing by 8 bytes
+ * @CRC32C_IMPL_SSE42: SSE4.2 crc32 instruction, 8 bytes at a time
+ * @CRC32C_IMPL_SSE42_PCLMUL: SSE4.2 crc32 instruction on 3 interleaved
+ * streams, combined with carry-less multiplications (PCLMULQDQ)
+ */
+enum crc32c_impl {
+	CRC32C_IMPL_PORTABLE,
+	CRC32C_IMPL_SSE42,
+	CRC32C_IMPL_SSE42_PCLMUL,
+};
+
+/**
+ * crc32c - Compute a CRC32C (Castagnoli) checksum
+ * @crc: Checksum of the preceding data, 0 to start a new checksum
+ * @buf: Data buffer
+ * @len: Number of bytes of @buf
+ *
+ * Checksums are computed with the fastest implementation supported by the CPU,
+ * unless another one was selected with crc32c_use().
+ *
+ * Return: Checksum of the preceding data followed by @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_use - Select the CRC32C implementation
+ * @impl: Implementation to use from now on
+ *
+ * Return: -1 if @impl is not supported by the CPU. 0 otherwise.
+ */
+int crc32c_use(enum crc32c_impl impl);
+
+/**
+ * crc32c_impl_name - Get the name of a CRC32C implementation
+ * @impl: Implementation
+ *
+ * Return: Name of @impl, for reporting.
+ */
+const char *crc32c_impl_name(enum crc32c_impl impl);
+
+#endif /* _CRC32C_H */
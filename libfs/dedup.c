@@ -0,0 +1,145 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "crc32c.h"
+#include "dedup.h"
+
+/* No block, as a bucket head or link */
+#define NONE SIZE_MAX
+
+/* What is known about a block */
+struct dblock {
+	/* Content hash, valid if @hashed */
+	uint32_t hash;
+	int hashed;
+	/* Indexed under (@hash, @next), and next block in the same bucket */
+	int indexed;
+	size_t next;
+	size_t link;
+};
+
+/* Deduplication index instance */
+struct dedup {
+	struct dblock *blocks;
+	size_t nblocks;
+	size_t block_size;
+	/* Hash table of the indexed blocks, by content hash and successor */
+	size_t *buckets;
+	size_t nbuckets;
+};
+
+struct dedup *dedup_create(size_t nblocks, size_t block_size)
+{
+	struct dedup *dd;
+	size_t i;
+
+	dd = calloc(1, sizeof(*dd));
+	if (!dd) {
+		perror("calloc");
+		return NULL;
+	}
+
+	dd->nblocks = nblocks;
+	dd->block_size = block_size;
+	for (dd->nbuckets = 1; dd->nbuckets < nblocks; dd->nbuckets <<= 1)
+		;
+	dd->blocks = calloc(nblocks, sizeof(*dd->blocks));
+	dd->buckets = malloc(dd->nbuckets * sizeof(*dd->buckets));
+	if (!dd->blocks || !dd->buckets) {
+		perror("malloc");
+		dedup_destroy(dd);
+		return NULL;
+	}
+	for (i = 0; i < dd->nbuckets; i++)
+		dd->buckets[i] = NONE;
+
+	return dd;
+}
+
+void dedup_destroy(struct dedup *dd)
+{
+	if (!dd)
+		return;
+
+	free(dd->buckets);
+	free(dd->blocks);
+	free(dd);
+}
+
+static size_t *bucket(struct dedup *dd, uint32_t hash, size_t next)
+{
+	return &dd->buckets[(hash ^ next * 0x9E3779B1u) & (dd->nbuckets - 1)];
+}
+
+/* Remove @block from its bucket, if indexed */
+static void unindex(struct dedup *dd, size_t block)
+{
+	struct dblock *b = &dd->blocks[block];
+	size_t *p;
+
+	if (!b->indexed)
+		return;
+
+	for (p = bucket(dd, b->hash, b->next); *p != block;
+	     p = &dd->blocks[*p].link)
+		;
+	*p = b->link;
+	b->indexed = 0;
+}
+
+uint32_t dedup_hash(struct dedup *dd, size_t block, const void *data)
+{
+	struct dblock *b = &dd->blocks[block];
+
+	unindex(dd, block);
+	b->hash = crc32c(0, data, dd->block_size);
+	b->hashed = 1;
+
+	return b->hash;
+}
+
+int dedup_hashed(struct dedup *dd, size_t block, uint32_t *hash)
+{
+	if (!dd->blocks[block].hashed)
+		return 0;
+
+	*hash = dd->blocks[block].hash;
+	return 1;
+}
+
+void dedup_forget(struct dedup *dd, size_t block)
+{
+	unindex(dd, block);
+	dd->blocks[block].hashed = 0;
+}
+
+void dedup_insert(struct dedup *dd, size_t block, size_t next)
+{
+	struct dblock *b = &dd->blocks[block];
+	size_t *p;
+
+	if (!b->hashed)
+		return;
+
+	unindex(dd, block);
+	p = bucket(dd, b->hash, next);
+	b->next = next;
+	b->link = *p;
+	b->indexed = 1;
+	*p = block;
+}
+
+size_t dedup_lookup(struct dedup *dd, uint32_t hash, size_t next,
+		    size_t *cands, size_t max)
+{
+	size_t i, n = 0;
+
+	for (i = *bucket(dd, hash, next); i != NONE && n < max;
+	     i = dd->blocks[i].link)
+		if (dd->blocks[i].hash == hash && dd->blocks[i].next == next)
+			cands[n++] = i;
+
+	return n;
+}
@@ -0,0 +1,85 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * DOC: Deduplication index
+ *
+ * The index remembers the content hash of data blocks, and finds blocks by
+ * content hash and successor. Blocks of a FAT file system can only be shared
+ * by chains that share everything after them, so a block is only a candidate
+ * to replace another one if both have the same content and the same next
+ * block. Candidates may be stale and must be verified by the caller.
+ */
+
+/** Opaque handle of a deduplication index */
+struct dedup;
+
+/**
+ * dedup_create - Create an empty deduplication index
+ * @nblocks: Number of blocks that can be indexed, numbered from 0
+ * @block_size: Size of the blocks in bytes
+ *
+ * Return: NULL if the index cannot be allocated. The index otherwise.
+ */
+struct dedup *dedup_create(size_t nblocks, size_t block_size);
+
+/**
+ * dedup_destroy - Release a deduplication index
+ * @dd: Index, or NULL
+ */
+void dedup_destroy(struct dedup *dd);
+
+/**
+ * dedup_hash - Remember the content of a block
+ * @dd: Index
+ * @block: Index of the block
+ * @data: Content of the block
+ *
+ * The block is removed from the index until dedup_insert() is called again.
+ *
+ * Return: Content hash of the block.
+ */
+uint32_t dedup_hash(struct dedup *dd, size_t block, const void *data);
+
+/**
+ * dedup_hashed - Get the remembered content hash of a block
+ * @dd: Index
+ * @block: Index of the block
+ * @hash: Set to the content hash of the block
+ *
+ * Return: 1 if the content of @block is known, 0 otherwise.
+ */
+int dedup_hashed(struct dedup *dd, size_t block, uint32_t *hash);
+
+/**
+ * dedup_forget - Forget about a block whose content changed or was freed
+ * @dd: Index
+ * @block: Index of the block
+ */
+void dedup_forget(struct dedup *dd, size_t block);
+
+/**
+ * dedup_insert - Index a block by content hash and successor
+ * @dd: Index
+ * @block: Index of the block, whose content must be known (see dedup_hash())
+ * @next: Index of the block following @block
+ */
+void dedup_insert(struct dedup *dd, size_t block, size_t next);
+
+/**
+ * dedup_lookup - Find blocks by content hash and successor
+ * @dd: Index
+ * @hash: Content hash
+ * @next: Index of the following block
+ * @cands: Array receiving candidate blocks
+ * @max: Size of @cands
+ *
+ * Return: Number of candidates stored in @cands.
+ */
+size_t dedup_lookup(struct dedup *dd, uint32_t hash, size_t next,
+		    size_t *cands, size_t max);
+
+#endif /* _DEDUP_H */
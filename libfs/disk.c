@@ -1,144 +1,1890 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+/* <linux/io_uring.h> pulls in the kernel's own BLOCK_SIZE */
+#undef BLOCK_SIZE
+#include "crc32c.h"
 #include "disk.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Raw io_uring instance */
+struct uring {
+	/* Ring file descriptor */
+	int fd;
+	/* Submission queue ring */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Completion queue ring */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mappings of the rings */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	/* Queued entries not submitted to the kernel yet */
+	unsigned pending;
+};
 
-/* Disk instance description */
-struct disk {
+/* Asynchronous request, identified by its ticket (index in the table) */
+struct block_req {
+	/* Ticket handed out and not yet waited for */
+	int busy;
+	/* Request completed */
+	int done;
+	/* Request outcome: 0 on success, -1 on failure */
+	int ret;
+	/* Expected transfer size in bytes */
+	size_t len;
+	/* Transfer direction and location */
+	int write;
+	size_t block, count;
+	void *buf;
+	/* Submission time, for statistics */
+	unsigned long long start;
+};
+
+/* State of the built-in backends, which all access a virtual disk file */
+struct file_dev {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Whole image mapping (%BLOCK_BACKEND_MMAP), or memory of a RAM disk */
+	char *map;
+	size_t map_len;
+	/* The image lives in @map and is saved to the file (RAM disks only) */
+	int ram;
+	/* Aligned staging buffers (%BLOCK_BACKEND_DIRECT only) */
+	char *pool;
+	/* Reads skip the holes of the image */
+	int sparse;
+	/* Requests follow @sim (%BLOCK_BACKEND_SIM only) */
+	int simulated;
+	struct block_sim sim;
+	/* End of the last request, requests so far and failure generator state */
+	off_t sim_end;
+	size_t sim_requests;
+	unsigned sim_rand;
+};
+
+/* Disk instance description */
+struct disk {
+	/* Backend and its state for this disk */
+	const struct block_ops *ops;
+	void *dev;
+	/* Block count */
+	size_t bcount;
+	/* Asynchronous I/O ring (%BLOCK_BACKEND_URING only) */
+	struct uring *ring;
+	/* Checksum of every block, NULL when checksums are disabled */
+	uint32_t *csums;
+	/* Checksum region: first block and block count */
+	size_t csum_start, csum_count;
+	/* Blocks of the checksum region holding changed checksums */
+	uint8_t *csum_dirty;
+	/* Range not covered by the checksums: first block and block count */
+	size_t csum_excl_start, csum_excl_count;
+	/* Asynchronous requests */
+	struct block_req reqs[BLOCK_QUEUE_DEPTH];
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Disk accessed by the block_*() functions (none by default) */
+static struct disk *cur_disk;
 
-int block_disk_open(const char *diskname)
+/* I/O statistics, shared by every disk */
+static int stats_enabled;
+static struct block_stats stats;
+
+#define stats_off() __builtin_expect(!stats_enabled, 1)
+
+/* Huge page size assumed for %BLOCK_BACKEND_RAM_HUGE */
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+/* Simulated requests busy-wait their last nanoseconds, sleeping is too coarse */
+#define SIM_SPIN_NS 100000
+
+static void block_drain(struct disk *d);
+
+/* Current time in nanoseconds */
+static unsigned long long clock_ns(void)
 {
-	int fd;
-	struct stat st;
+	struct timespec ts;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Current time in nanoseconds, 0 when statistics are disabled */
+static unsigned long long stats_clock(void)
+{
+	if (stats_off())
+		return 0;
+
+	return clock_ns();
+}
+
+static void stats_syscall(void)
+{
+	if (stats_off())
+		return;
+
+	/* Flushes run concurrently with the other requests */
+	__atomic_fetch_add(&stats.syscalls, 1, __ATOMIC_RELAXED);
+}
+
+/* Record an operation of @bytes bytes started at @start, with outcome @ret */
+static void stats_account(int write, size_t bytes, unsigned long long start,
+			  int ret)
+{
+	struct block_latency *lat;
+	unsigned long long ns;
+	int bucket;
+
+	if (stats_off())
+		return;
+
+	if (write) {
+		stats.writes++;
+		lat = &stats.write_latency;
+	} else {
+		stats.reads++;
+		lat = &stats.read_latency;
+	}
+
+	if (ret) {
+		stats.errors++;
+	} else if (write) {
+		stats.write_bytes += bytes;
+	} else {
+		stats.read_bytes += bytes;
+	}
+
+	/* Operations started before statistics were enabled are not timed */
+	if (!start)
+		return;
+
+	ns = stats_clock() - start;
+	bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= BLOCK_LATENCY_BUCKETS)
+		bucket = BLOCK_LATENCY_BUCKETS - 1;
+	lat->buckets[bucket]++;
+	lat->count++;
+}
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		       unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static void uring_free(struct uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+	    ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+}
+
+/* Create an io_uring instance able to hold %BLOCK_QUEUE_DEPTH requests */
+static struct uring *uring_create(void)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+	char *sq, *cq;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) {
+		perror("calloc");
+		return NULL;
+	}
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = uring_setup(BLOCK_QUEUE_DEPTH, &p);
+	if (ring->fd < 0) {
+		perror("io_uring_setup");
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		perror("mmap");
+		uring_free(ring);
+		return NULL;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED) {
+		perror("mmap");
+		uring_free(ring);
+		return NULL;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		perror("mmap");
+		uring_free(ring);
+		return NULL;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return ring;
+}
+
+/*
+ * Built-in backends
+ */
+
+/*
+ * Allocate the memory of a RAM disk of @size bytes, backed by huge pages if
+ * @huge is set and the host has some. Sets @len to the length of the mapping
+ */
+static char *ram_alloc(size_t size, int huge, size_t *len)
+{
+	char *map;
+
+	if (huge) {
+		*len = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		map = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (map != MAP_FAILED)
+			return map;
+	}
+
+	*len = size;
+	map = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	/* Best effort, transparent huge pages may be disabled */
+	if (huge)
+		madvise(map, *len, MADV_HUGEPAGE);
+
+	return map;
+}
+
+/* Load or save the whole image of a RAM disk */
+static int ram_io(struct file_dev *f, int write)
+{
+	size_t done, len = f->bcount * BLOCK_SIZE;
+	ssize_t ret;
+
+	for (done = 0; done < len; done += ret) {
+		stats_syscall();
+		if (write)
+			ret = pwrite(f->fd, f->map + done, len - done, done);
+		else
+			ret = pread(f->fd, f->map + done, len - done, done);
+
+		if (ret < 0) {
+			perror(write ? "pwrite" : "pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk at offset %zu",
+				    done);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Whether every buffer of @iov can be used for direct I/O */
+static int iov_aligned(const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		if ((uintptr_t)iov[i].iov_base % BLOCK_SIZE ||
+		    iov[i].iov_len % BLOCK_SIZE)
+			return 0;
+
+	return 1;
+}
+
+/* Copy @len bytes between @buf and the content of @iov starting at @off */
+static void iov_copy(const struct iovec *iov, int iovcnt, size_t off,
+		     char *buf, size_t len, int to_iov)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		n = iov[i].iov_len - off;
+		if (n > len)
+			n = len;
+		if (to_iov)
+			memcpy((char *)iov[i].iov_base + off, buf, n);
+		else
+			memcpy(buf, (char *)iov[i].iov_base + off, n);
+		buf += n;
+		len -= n;
+		off = 0;
+	}
+}
+
+/*
+ * Consume @len bytes at the start of the vector, zeroing them first if @zero
+ * is set. The vector is updated in place.
+ */
+static void iov_consume(struct iovec **iov, int *iovcnt, size_t len, int zero)
+{
+	size_t n;
+
+	while (*iovcnt > 0 && len) {
+		n = (*iov)->iov_len < len ? (*iov)->iov_len : len;
+		if (zero)
+			memset((*iov)->iov_base, 0, n);
+		(*iov)->iov_base = (char *)(*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+		len -= n;
+		if (!(*iov)->iov_len) {
+			(*iov)++;
+			(*iovcnt)--;
+		}
+	}
+}
+
+/* Total size of the vector in bytes */
+static size_t iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	return total;
+}
+
+/*
+ * Number of bytes of the hole of the image starting at @off, if any, up to
+ * @len. Errors are reported as no hole, so that the data is read normally.
+ */
+static size_t file_hole(struct file_dev *f, off_t off, size_t len)
+{
+	off_t data;
+
+	stats_syscall();
+	data = lseek(f->fd, off, SEEK_DATA);
+	/* ENXIO: no data past @off */
+	if (data < 0)
+		return errno == ENXIO ? len : 0;
+	if ((size_t)(data - off) < len)
+		return data - off;
+
+	return len;
+}
+
+/* Wait until @deadline, or return right away if it is 0 */
+static void sim_wait(unsigned long long deadline)
+{
+	unsigned long long now, ns;
+	struct timespec ts;
+
+	while ((now = clock_ns()) < deadline) {
+		ns = deadline - now;
+		if (ns <= SIM_SPIN_NS)
+			continue;
+		ns -= SIM_SPIN_NS;
+		ts.tv_sec = ns / 1000000000ULL;
+		ts.tv_nsec = ns % 1000000000ULL;
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* Start over with model @sim, or with the NVMe profile if NULL */
+static void sim_setup(struct file_dev *f, const struct block_sim *sim)
+{
+	if (sim)
+		f->sim = *sim;
+	else
+		block_sim_profile(BLOCK_SIM_NVME, &f->sim);
+	f->sim_end = 0;
+	f->sim_requests = 0;
+	f->sim_rand = f->sim.seed;
+}
+
+/*
+ * Start a request of @len bytes at @off on a simulated disk: fail it as the
+ * model says, or set @deadline to the time it should complete
+ */
+static int sim_request(struct file_dev *f, off_t off, size_t len, int write,
+		       unsigned long long *deadline)
+{
+	const struct block_sim *sim = &f->sim;
+	double rate = write ? sim->write_error_rate : sim->read_error_rate;
+	unsigned long long ns;
+	off_t dist;
+
+	f->sim_requests++;
+	if ((sim->fail_after && f->sim_requests > sim->fail_after) ||
+	    (rate > 0 && rand_r(&f->sim_rand) < rate * ((double)RAND_MAX + 1))) {
+		block_error("injected %s failure at offset %lld",
+			    write ? "write" : "read", (long long)off);
+		errno = EIO;
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
+	ns = write ? sim->write_ns : sim->read_ns;
+	if (off != f->sim_end && sim->seek_ns) {
+		dist = off > f->sim_end ? off - f->sim_end : f->sim_end - off;
+		ns += sim->seek_ns / 3 + (double)sim->seek_ns * 2 / 3 * dist /
+			(f->bcount * BLOCK_SIZE);
+	}
+	if (sim->bandwidth)
+		ns += (unsigned long long)len * 1000000000ULL / sim->bandwidth;
+
+	f->sim_end = off + len;
+	*deadline = clock_ns() + ns;
+
+	return 0;
+}
+
+static int file_xfer(struct file_dev *f, size_t block, struct iovec *iov,
+		     int iovcnt, int write);
+
+/* Transfer unaligned buffers through the staging pool, a pool at a time */
+static int file_xfer_staged(struct file_dev *f, size_t block,
+			    const struct iovec *iov, int iovcnt, int write)
+{
+	size_t total = iov_len(iov, iovcnt), done, len;
+	struct iovec chunk;
+
+	for (done = 0; done < total; done += len) {
+		len = total - done;
+		if (len > BLOCK_POOL_BLOCKS * BLOCK_SIZE)
+			len = BLOCK_POOL_BLOCKS * BLOCK_SIZE;
+
+		if (write)
+			iov_copy(iov, iovcnt, done, f->pool, len, 0);
+
+		chunk.iov_base = f->pool;
+		chunk.iov_len = len;
+		if (file_xfer(f, block + done / BLOCK_SIZE, &chunk, 1, write))
+			return -1;
+
+		if (!write)
+			iov_copy(iov, iovcnt, done, f->pool, len, 1);
+	}
+
+	return 0;
+}
+
+/*
+ * Transfer a vector of buffers to/from the disk image starting at block
+ * @block, restarting after short transfers. The vector is consumed in place.
+ */
+static int file_xfer(struct file_dev *f, size_t block, struct iovec *iov,
+		     int iovcnt, int write)
+{
+	off_t off = (off_t)block * BLOCK_SIZE;
+	size_t hole;
+	ssize_t ret;
+
+	/* Direct I/O needs aligned buffers */
+	if (f->pool && !iov_aligned(iov, iovcnt))
+		return file_xfer_staged(f, block, iov, iovcnt, write);
+
+	while (iovcnt > 0) {
+		/* Holes of sparse images are zeros, no need to read them */
+		if (f->sparse && !write) {
+			hole = file_hole(f, off, iov_len(iov, iovcnt));
+			if (hole) {
+				iov_consume(&iov, &iovcnt, hole, 1);
+				off += hole;
+				continue;
+			}
+		}
+
+		stats_syscall();
+		if (write)
+			ret = pwritev(f->fd, iov, iovcnt, off);
+		else
+			ret = preadv(f->fd, iov, iovcnt, off);
+
+		if (ret < 0) {
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk at offset %lld",
+				    (long long)off);
+			return -1;
+		}
+
+		off += ret;
+		iov_consume(&iov, &iovcnt, ret, 0);
+	}
+
+	return 0;
+}
+
+/* Transfer a single request, taking the modeled time on simulated disks */
+static int file_request(struct file_dev *f, size_t block, struct iovec *iov,
+			int iovcnt, int write)
+{
+	unsigned long long deadline = 0;
+
+	if (f->simulated &&
+	    sim_request(f, (off_t)block * BLOCK_SIZE, iov_len(iov, iovcnt),
+			write, &deadline))
+		return -1;
+
+	if (file_xfer(f, block, iov, iovcnt, write))
 		return -1;
+	sim_wait(deadline);
+
+	return 0;
+}
+
+/* Open virtual disk file @diskname, whose size is a multiple of the block size */
+static struct file_dev *file_dev_open(const char *diskname, int flags)
+{
+	struct file_dev *f;
+	struct stat st;
+	int fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return NULL;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	if ((fd = open(diskname, flags, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	f = calloc(1, sizeof(*f));
+	if (!f) {
+		perror("calloc");
+		close(fd);
+		return NULL;
+	}
+	f->fd = fd;
+	f->bcount = st.st_size / BLOCK_SIZE;
 
-	return 0;
+	return f;
 }
 
-int block_disk_close(void)
+static int file_close(void *dev)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
-		return -1;
+	struct file_dev *f = dev;
+	int ret = 0;
+
+	if (f->ram)
+		ret = ram_io(f, 1);
+
+	if (f->map)
+		munmap(f->map, f->map_len);
+
+	block_buf_free(f->pool);
+
+	close(f->fd);
+	free(f);
+
+	return ret;
+}
+
+static void *file_open(const char *diskname)
+{
+	return file_dev_open(diskname, O_RDWR);
+}
+
+static void *direct_open(const char *diskname)
+{
+	struct file_dev *f;
+
+	/* Bypass the host's page cache */
+	f = file_dev_open(diskname, O_RDWR | O_DIRECT);
+	if (!f)
+		return NULL;
+
+	f->pool = block_buf_alloc(BLOCK_POOL_BLOCKS);
+	if (!f->pool) {
+		file_close(f);
+		return NULL;
 	}
 
-	close(disk.fd);
+	return f;
+}
+
+static void *sim_open(const char *diskname)
+{
+	struct file_dev *f;
 
-	disk.fd = INVALID_FD;
+	f = file_dev_open(diskname, O_RDWR);
+	if (!f)
+		return NULL;
 
-	return 0;
+	f->simulated = 1;
+	sim_setup(f, NULL);
+
+	return f;
 }
 
-int block_disk_count(void)
+static void *mmap_open(const char *diskname)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
-		return -1;
+	struct file_dev *f;
+	void *map;
+
+	f = file_dev_open(diskname, O_RDWR);
+	if (!f)
+		return NULL;
+
+	if (!f->bcount) {
+		block_error("cannot map empty disk");
+		file_close(f);
+		return NULL;
+	}
+
+	map = mmap(NULL, f->bcount * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, f->fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		file_close(f);
+		return NULL;
 	}
+	f->map = map;
+	f->map_len = f->bcount * BLOCK_SIZE;
 
-	return disk.bcount;
+	return f;
 }
 
-int block_write(size_t block, const void *buf)
+static void *ram_open_huge(const char *diskname, int huge)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
-		return -1;
+	struct file_dev *f;
+
+	f = file_dev_open(diskname, O_RDWR);
+	if (!f)
+		return NULL;
+
+	if (!f->bcount) {
+		block_error("cannot load empty disk");
+		file_close(f);
+		return NULL;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
-		return -1;
+	f->map = ram_alloc(f->bcount * BLOCK_SIZE, huge, &f->map_len);
+	if (!f->map) {
+		file_close(f);
+		return NULL;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
+	/* RAM disks start from the content of the image */
+	if (ram_io(f, 0)) {
+		file_close(f);
+		return NULL;
 	}
+	f->ram = 1;
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
-		return -1;
+	return f;
+}
+
+static void *ram_open(const char *diskname)
+{
+	return ram_open_huge(diskname, 0);
+}
+
+static void *ram_huge_open(const char *diskname)
+{
+	return ram_open_huge(diskname, 1);
+}
+
+static size_t file_count(void *dev)
+{
+	struct file_dev *f = dev;
+
+	return f->bcount;
+}
+
+static int file_read(void *dev, size_t block, size_t count, void *buf)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count * BLOCK_SIZE };
+
+	return file_request(dev, block, &iov, 1, 0);
+}
+
+static int file_write(void *dev, size_t block, size_t count, const void *buf)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+
+	return file_request(dev, block, &iov, 1, 1);
+}
+
+/*
+ * Split @bvec into runs of consecutive block indices and transfer each run
+ * with a single vectored call.
+ */
+static int file_vec(void *dev, const struct block_iovec *bvec, size_t count,
+		    int write)
+{
+	struct iovec iov[IOV_MAX];
+	size_t i, n;
+
+	for (i = 0; i < count; i += n) {
+		for (n = 0; n < IOV_MAX && i + n < count; n++) {
+			if (n && bvec[i + n].block != bvec[i].block + n)
+				break;
+			iov[n].iov_base = bvec[i + n].buf;
+			iov[n].iov_len = BLOCK_SIZE;
+		}
+
+		if (file_request(dev, bvec[i].block, iov, n, write))
+			return -1;
 	}
 
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+static int file_readv(void *dev, const struct block_iovec *bvec, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
-		return -1;
-	}
+	return file_vec(dev, bvec, count, 0);
+}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
-		return -1;
-	}
+static int file_writev(void *dev, const struct block_iovec *bvec, size_t count)
+{
+	return file_vec(dev, bvec, count, 1);
+}
+
+/* The whole file is synchronized */
+static int file_flush(void *dev, size_t block, size_t count)
+{
+	struct file_dev *f = dev;
+
+	(void)block;
+	(void)count;
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	stats_syscall();
+	if (fdatasync(f->fd)) {
+		perror("fdatasync");
 		return -1;
 	}
+	if (f->simulated)
+		sim_wait(clock_ns() + f->sim.flush_ns);
+
+	return 0;
+}
+
+static int file_discard(void *dev, size_t block, size_t count)
+{
+	struct file_dev *f = dev;
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	/* Also drops the pages of the mapping, if any */
+	stats_syscall();
+	if (fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      (off_t)block * BLOCK_SIZE, (off_t)count * BLOCK_SIZE)) {
+		perror("fallocate");
 		return -1;
 	}
 
 	return 0;
 }
 
+static int file_set_sparse(void *dev, int enable)
+{
+	struct file_dev *f = dev;
+
+	f->sparse = enable;
+
+	return 0;
+}
+
+/* Images in memory (mapped or RAM disks) are accessed with plain copies */
+static int mem_read(void *dev, size_t block, size_t count, void *buf)
+{
+	struct file_dev *f = dev;
+
+	memcpy(buf, f->map + block * BLOCK_SIZE, count * BLOCK_SIZE);
+
+	return 0;
+}
+
+static int mem_write(void *dev, size_t block, size_t count, const void *buf)
+{
+	struct file_dev *f = dev;
+
+	memcpy(f->map + block * BLOCK_SIZE, buf, count * BLOCK_SIZE);
+
+	return 0;
+}
+
+static int mem_readv(void *dev, const struct block_iovec *bvec, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		mem_read(dev, bvec[i].block, 1, bvec[i].buf);
+
+	return 0;
+}
+
+static int mem_writev(void *dev, const struct block_iovec *bvec, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		mem_write(dev, bvec[i].block, 1, bvec[i].buf);
+
+	return 0;
+}
+
+static void *mem_map(void *dev, size_t block)
+{
+	struct file_dev *f = dev;
+
+	return f->map + block * BLOCK_SIZE;
+}
+
+static int mmap_flush(void *dev, size_t block, size_t count)
+{
+	struct file_dev *f = dev;
+
+	/* Mapping offsets are page aligned since blocks are */
+	stats_syscall();
+	if (msync(f->map + block * BLOCK_SIZE, count * BLOCK_SIZE, MS_SYNC)) {
+		perror("msync");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* RAM disks save the whole image */
+static int ram_flush(void *dev, size_t block, size_t count)
+{
+	struct file_dev *f = dev;
+
+	if (ram_io(f, 1))
+		return -1;
+
+	return file_flush(dev, block, count);
+}
+
+static int ram_discard(void *dev, size_t block, size_t count)
+{
+	struct file_dev *f = dev;
+
+	memset(f->map + block * BLOCK_SIZE, 0, count * BLOCK_SIZE);
+
+	return 0;
+}
+
+/* Backends accessing the file with positional I/O, differing in how they open it */
+#define FILE_OPS(backend, name_str, open_fn)				\
+	[backend] = {							\
+		.name = name_str,					\
+		.open = open_fn,					\
+		.close = file_close,					\
+		.read = file_read,					\
+		.write = file_write,					\
+		.readv = file_readv,					\
+		.writev = file_writev,					\
+		.flush = file_flush,					\
+		.discard = file_discard,				\
+		.count = file_count,					\
+		.set_sparse = file_set_sparse,				\
+	}
+
+/* Backends keeping the image in memory */
+#define MEM_OPS(backend, name_str, open_fn, flush_fn, discard_fn)	\
+	[backend] = {							\
+		.name = name_str,					\
+		.open = open_fn,					\
+		.close = file_close,					\
+		.read = mem_read,					\
+		.write = mem_write,					\
+		.readv = mem_readv,					\
+		.writev = mem_writev,					\
+		.flush = flush_fn,					\
+		.discard = discard_fn,					\
+		.count = file_count,					\
+		.map = mem_map,						\
+	}
+
+static const struct block_ops backend_ops[] = {
+	FILE_OPS(BLOCK_BACKEND_FILE, "file", file_open),
+	MEM_OPS(BLOCK_BACKEND_MMAP, "mmap", mmap_open, mmap_flush,
+		file_discard),
+	/* Asynchronous requests go through a ring, see disk_open_ops() */
+	FILE_OPS(BLOCK_BACKEND_URING, "uring", file_open),
+	FILE_OPS(BLOCK_BACKEND_DIRECT, "direct", direct_open),
+	FILE_OPS(BLOCK_BACKEND_SIM, "sim", sim_open),
+	MEM_OPS(BLOCK_BACKEND_RAM, "ram", ram_open, ram_flush, ram_discard),
+	MEM_OPS(BLOCK_BACKEND_RAM_HUGE, "ram_huge", ram_huge_open, ram_flush,
+		ram_discard),
+};
+
+/*
+ * Block layer, on top of the backends
+ */
+
+const struct block_ops *block_backend_ops(enum block_backend backend)
+{
+	if (backend < BLOCK_BACKEND_FILE || backend > BLOCK_BACKEND_RAM_HUGE) {
+		block_error("invalid backend '%d'", backend);
+		return NULL;
+	}
+
+	return &backend_ops[backend];
+}
+
+struct disk *disk_open(const char *diskname, enum block_backend backend)
+{
+	const struct block_ops *ops = block_backend_ops(backend);
+
+	if (!ops)
+		return NULL;
+
+	return disk_open_ops(diskname, ops);
+}
+
+struct disk *disk_open_ops(const char *diskname, const struct block_ops *ops)
+{
+	struct disk *d;
+
+	if (!ops) {
+		block_error("invalid backend");
+		return NULL;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (!d) {
+		perror("calloc");
+		return NULL;
+	}
+
+	d->ops = ops;
+	d->dev = ops->open(diskname);
+	if (!d->dev) {
+		free(d);
+		return NULL;
+	}
+	d->bcount = ops->count(d->dev);
+
+	if (ops == &backend_ops[BLOCK_BACKEND_URING]) {
+		d->ring = uring_create();
+		if (!d->ring) {
+			ops->close(d->dev);
+			free(d);
+			return NULL;
+		}
+	}
+
+	return d;
+}
+
+int disk_close(struct disk *d)
+{
+	int ret, csum_ret = 0;
+
+	if (!d) {
+		block_error("invalid disk");
+		return -1;
+	}
+
+	/* Let in-flight requests finish before their buffers go away */
+	if (d->ring) {
+		block_drain(d);
+		uring_free(d->ring);
+	}
+
+	/* Checksums that cannot be written back fail the close */
+	if (d->csums) {
+		csum_ret = disk_csum_sync(d);
+		block_buf_free(d->csums);
+		free(d->csum_dirty);
+	}
+
+	ret = d->ops->close(d->dev);
+	free(d);
+
+	return csum_ret ? csum_ret : ret;
+}
+
+int disk_count(struct disk *d)
+{
+	if (!d) {
+		block_error("invalid disk");
+		return -1;
+	}
+
+	return d->bcount;
+}
+
+/* Check that blocks [@block, @block + @count) can be accessed */
+static int block_check(struct disk *d, size_t block, size_t count)
+{
+	if (!d) {
+		block_error("invalid disk");
+		return -1;
+	}
+
+	if (block >= d->bcount || count > d->bcount - block) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, count, d->bcount);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Checksums held by a block of the checksum region */
+#define CSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+/*
+ * Update the checksums of the @count blocks starting at @block that were just
+ * written from @buf, or verify them if they were just read into @buf. Blocks
+ * of the checksum region and of the excluded range are not covered.
+ */
+static int csum_done(struct disk *d, size_t block, size_t count,
+		     const char *buf, int write)
+{
+	uint32_t crc;
+	size_t i;
+
+	if (!d->csums)
+		return 0;
+
+	for (i = 0; i < count; i++, buf += BLOCK_SIZE) {
+		if ((block + i >= d->csum_start &&
+		     block + i < d->csum_start + d->csum_count) ||
+		    (block + i >= d->csum_excl_start &&
+		     block + i < d->csum_excl_start + d->csum_excl_count))
+			continue;
+		crc = crc32c(0, buf, BLOCK_SIZE);
+		if (write) {
+			if (d->csums[block + i] != crc)
+				d->csum_dirty[(block + i) / CSUMS_PER_BLOCK] = 1;
+			d->csums[block + i] = crc;
+		} else if (crc != d->csums[block + i]) {
+			block_error("checksum mismatch on block %zu", block + i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int block_range(struct disk *d, size_t block, size_t count, void *buf,
+		       int write)
+{
+	unsigned long long start = stats_clock();
+	int ret;
+
+	if (block_check(d, block, count))
+		return -1;
+
+	if (write)
+		ret = d->ops->write(d->dev, block, count, buf);
+	else
+		ret = d->ops->read(d->dev, block, count, buf);
+	if (!ret)
+		ret = csum_done(d, block, count, buf, write);
+	stats_account(write, count * BLOCK_SIZE, start, ret);
+
+	return ret;
+}
+
+/* Transfer the blocks of @bvec, one by one if the backend has no vectored I/O */
+static int block_vec(struct disk *d, const struct block_iovec *bvec,
+		     size_t count, int write)
+{
+	unsigned long long start = stats_clock();
+	int (*vec)(void *dev, const struct block_iovec *bvec, size_t count);
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < count; i++)
+		if (block_check(d, bvec[i].block, 1))
+			return -1;
+
+	vec = write ? d->ops->writev : d->ops->readv;
+	if (vec) {
+		ret = vec(d->dev, bvec, count);
+	} else {
+		for (i = 0; i < count && !ret; i++) {
+			if (write)
+				ret = d->ops->write(d->dev, bvec[i].block, 1,
+						    bvec[i].buf);
+			else
+				ret = d->ops->read(d->dev, bvec[i].block, 1,
+						   bvec[i].buf);
+		}
+	}
+
+	for (i = 0; i < count && !ret; i++)
+		ret = csum_done(d, bvec[i].block, 1, bvec[i].buf, write);
+	stats_account(write, count * BLOCK_SIZE, start, ret);
+
+	return ret;
+}
+
+int disk_write(struct disk *d, size_t block, const void *buf)
+{
+	return block_range(d, block, 1, (void *)buf, 1);
+}
+
+int disk_read(struct disk *d, size_t block, void *buf)
+{
+	return block_range(d, block, 1, buf, 0);
+}
+
+int disk_write_range(struct disk *d, size_t block, size_t count,
+		     const void *buf)
+{
+	return block_range(d, block, count, (void *)buf, 1);
+}
+
+int disk_read_range(struct disk *d, size_t block, size_t count, void *buf)
+{
+	return block_range(d, block, count, buf, 0);
+}
+
+int disk_writev(struct disk *d, const struct block_iovec *bvec, size_t count)
+{
+	return block_vec(d, bvec, count, 1);
+}
+
+int disk_readv(struct disk *d, const struct block_iovec *bvec, size_t count)
+{
+	return block_vec(d, bvec, count, 0);
+}
+
+static int block_iovec_cmp(const void *a, const void *b)
+{
+	const struct block_iovec *x = a, *y = b;
+
+	return (x->block > y->block) - (x->block < y->block);
+}
+
+void block_iovec_sort(struct block_iovec *bvec, size_t count)
+{
+	qsort(bvec, count, sizeof(*bvec), block_iovec_cmp);
+}
+
+void *disk_map(struct disk *d, size_t block)
+{
+	if (!d || !d->ops->map || block >= d->bcount)
+		return NULL;
+
+	return d->ops->map(d->dev, block);
+}
+
+int disk_sync_range(struct disk *d, size_t block, size_t count)
+{
+	if (block_check(d, block, count))
+		return -1;
+
+	return d->ops->flush(d->dev, block, count);
+}
+
+int disk_discard(struct disk *d, size_t block, size_t count)
+{
+	static char zero_block[BLOCK_SIZE];
+	size_t i;
+
+	if (block_check(d, block, count))
+		return -1;
+
+	if (!count)
+		return 0;
+
+	if (!d->ops->discard) {
+		block_error("backend cannot discard blocks");
+		return -1;
+	}
+	if (d->ops->discard(d->dev, block, count))
+		return -1;
+
+	/* Released blocks read as zeros */
+	if (d->csums) {
+		memset(zero_block, 0, BLOCK_SIZE);
+		for (i = 0; i < count; i++)
+			if (csum_done(d, block + i, 1, zero_block, 1))
+				return -1;
+	}
+
+	return 0;
+}
+
+int disk_csum_enable(struct disk *d, size_t start, size_t count, int build)
+{
+	uint32_t *csums;
+	size_t block, n;
+	char *buf;
+
+	if (block_check(d, start, count))
+		return -1;
+
+	if (d->csums) {
+		block_error("checksums already enabled");
+		return -1;
+	}
+
+	if (count * BLOCK_SIZE / sizeof(uint32_t) < d->bcount) {
+		block_error("checksum region too small (%zu blocks)", count);
+		return -1;
+	}
+
+	csums = block_buf_alloc(count);
+	d->csum_dirty = calloc(count, 1);
+	if (!csums || !d->csum_dirty) {
+		block_buf_free(csums);
+		free(d->csum_dirty);
+		return -1;
+	}
+	memset(csums, 0, count * BLOCK_SIZE);
+
+	if (!build) {
+		if (block_range(d, start, count, csums, 0)) {
+			block_buf_free(csums);
+			free(d->csum_dirty);
+			return -1;
+		}
+		d->csums = csums;
+		d->csum_start = start;
+		d->csum_count = count;
+		return 0;
+	}
+
+	/* Checksum the current content of the disk, a pool at a time */
+	buf = block_buf_alloc(BLOCK_POOL_BLOCKS);
+	if (!buf) {
+		block_buf_free(csums);
+		free(d->csum_dirty);
+		return -1;
+	}
+	d->csums = csums;
+	d->csum_start = start;
+	d->csum_count = count;
+	for (block = 0; block < d->bcount; block += n) {
+		n = d->bcount - block;
+		if (n > BLOCK_POOL_BLOCKS)
+			n = BLOCK_POOL_BLOCKS;
+		/* Blocks read are not verified against the empty table yet */
+		d->csums = NULL;
+		if (block_range(d, block, n, buf, 0)) {
+			block_buf_free(buf);
+			block_buf_free(csums);
+			free(d->csum_dirty);
+			return -1;
+		}
+		d->csums = csums;
+		csum_done(d, block, n, buf, 1);
+	}
+	block_buf_free(buf);
+
+	/* The whole region is written, including the unused end */
+	memset(d->csum_dirty, 1, count);
+	if (disk_csum_sync(d)) {
+		d->csums = NULL;
+		block_buf_free(csums);
+		free(d->csum_dirty);
+		return -1;
+	}
+
+	return 0;
+}
+
+int disk_csum_exclude(struct disk *d, size_t start, size_t count)
+{
+	if (block_check(d, start, count))
+		return -1;
+
+	d->csum_excl_start = start;
+	d->csum_excl_count = count;
+	return 0;
+}
+
+int disk_csum_sync(struct disk *d)
+{
+	size_t i, n;
+
+	if (!d) {
+		block_error("invalid disk");
+		return -1;
+	}
+
+	if (!d->csums)
+		return 0;
+
+	/* Only the blocks holding changed checksums, a run at a time */
+	for (i = 0; i < d->csum_count; i += n) {
+		for (n = 0; i + n < d->csum_count && d->csum_dirty[i + n]; n++)
+			;
+		if (!n) {
+			n = 1;
+			continue;
+		}
+		if (block_range(d, d->csum_start + i, n,
+				(char *)d->csums + i * BLOCK_SIZE, 1))
+			return -1;
+		memset(d->csum_dirty + i, 0, n);
+	}
+
+	return 0;
+}
+
+int disk_set_sparse(struct disk *d, int enable)
+{
+	if (!d) {
+		block_error("invalid disk");
+		return -1;
+	}
+
+	/* Backends without holes to skip ignore it */
+	if (!d->ops->set_sparse)
+		return 0;
+
+	return d->ops->set_sparse(d->dev, enable);
+}
+
+int block_sim_profile(enum block_sim_profile profile, struct block_sim *sim)
+{
+	static const struct block_sim profiles[] = {
+		/* Seeks include half a rotation at 7200 rpm */
+		[BLOCK_SIM_HDD] = {
+			.read_ns = 200000, .write_ns = 200000,
+			.seek_ns = 12000000, .flush_ns = 5000000,
+			.bandwidth = 160000000,
+		},
+		[BLOCK_SIM_SATA_SSD] = {
+			.read_ns = 80000, .write_ns = 40000,
+			.flush_ns = 500000, .bandwidth = 530000000,
+		},
+		[BLOCK_SIM_NVME] = {
+			.read_ns = 15000, .write_ns = 10000,
+			.flush_ns = 50000, .bandwidth = 3000000000ULL,
+		},
+	};
+
+	if (!sim || profile < BLOCK_SIM_HDD || profile > BLOCK_SIM_NVME) {
+		block_error("invalid profile '%d'", profile);
+		return -1;
+	}
+
+	*sim = profiles[profile];
+
+	return 0;
+}
+
+int disk_sim_set(struct disk *d, const struct block_sim *sim)
+{
+	if (!d || d->ops != &backend_ops[BLOCK_BACKEND_SIM]) {
+		block_error("disk is not simulated");
+		return -1;
+	}
+
+	sim_setup(d->dev, sim);
+
+	return 0;
+}
+
+/* Move completions from the completion queue to their request */
+static void uring_reap(struct disk *d)
+{
+	struct uring *ring = d->ring;
+	unsigned head, tail;
+	struct io_uring_cqe *cqe;
+	struct block_req *req;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		req = &d->reqs[cqe->user_data];
+		if (cqe->res < 0 || (size_t)cqe->res != req->len) {
+			block_error("asynchronous request failed (%d)",
+				    cqe->res);
+			req->ret = -1;
+		} else if (csum_done(d, req->block, req->count, req->buf,
+				     req->write)) {
+			req->ret = -1;
+		}
+		req->done = 1;
+		stats_account(req->write, req->len, req->start, req->ret);
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Submit queued entries and wait for at least @min_complete completions */
+static int uring_submit(struct disk *d, unsigned min_complete)
+{
+	struct uring *ring = d->ring;
+	int ret;
+
+	while (ring->pending || min_complete) {
+		stats_syscall();
+		ret = uring_enter(ring->fd, ring->pending, min_complete,
+				  min_complete ? IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("io_uring_enter");
+			return -1;
+		}
+		ring->pending -= ret;
+		min_complete = 0;
+	}
+
+	uring_reap(d);
+
+	return 0;
+}
+
+static int block_async(struct disk *d, size_t block, size_t count, void *buf,
+		       int write)
+{
+	struct uring *ring;
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+	int ticket;
+
+	if (block_check(d, block, count))
+		return -1;
+
+	for (ticket = 0; ticket < BLOCK_QUEUE_DEPTH; ticket++)
+		if (!d->reqs[ticket].busy)
+			break;
+	if (ticket == BLOCK_QUEUE_DEPTH) {
+		block_error("too many requests in flight");
+		return -1;
+	}
+
+	ring = d->ring;
+	d->reqs[ticket].busy = 1;
+	d->reqs[ticket].done = 0;
+	d->reqs[ticket].ret = 0;
+	d->reqs[ticket].len = count * BLOCK_SIZE;
+	d->reqs[ticket].write = write;
+	d->reqs[ticket].block = block;
+	d->reqs[ticket].count = count;
+	d->reqs[ticket].buf = buf;
+	d->reqs[ticket].start = stats_clock();
+
+	/* Without a ring, the request is completed right away */
+	if (!ring) {
+		d->reqs[ticket].ret = block_range(d, block, count, buf, write);
+		d->reqs[ticket].done = 1;
+		return ticket;
+	}
+
+	tail = *ring->sq_tail;
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = ((struct file_dev *)d->dev)->fd;
+	sqe->off = (__u64)block * BLOCK_SIZE;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = count * BLOCK_SIZE;
+	sqe->user_data = ticket;
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+
+	return ticket;
+}
+
+int disk_write_async(struct disk *d, size_t block, size_t count,
+		     const void *buf)
+{
+	return block_async(d, block, count, (void *)buf, 1);
+}
+
+int disk_read_async(struct disk *d, size_t block, size_t count, void *buf)
+{
+	return block_async(d, block, count, buf, 0);
+}
+
+int disk_submit(struct disk *d)
+{
+	if (!d) {
+		block_error("invalid disk");
+		return -1;
+	}
+
+	if (!d->ring)
+		return 0;
+
+	return uring_submit(d, 0);
+}
+
+/* Release a completed request and return its outcome */
+static int block_complete(struct disk *d, int ticket)
+{
+	d->reqs[ticket].busy = 0;
+
+	return d->reqs[ticket].ret;
+}
+
+static int block_ticket_check(struct disk *d, int ticket)
+{
+	if (!d) {
+		block_error("invalid disk");
+		return -1;
+	}
+
+	if (ticket < 0 || ticket >= BLOCK_QUEUE_DEPTH ||
+	    !d->reqs[ticket].busy) {
+		block_error("invalid ticket '%d'", ticket);
+		return -1;
+	}
+
+	return 0;
+}
+
+int disk_poll(struct disk *d, int ticket)
+{
+	if (block_ticket_check(d, ticket))
+		return -1;
+
+	if (!d->reqs[ticket].done && d->ring && uring_submit(d, 0))
+		return -1;
+
+	if (!d->reqs[ticket].done)
+		return 0;
+
+	return block_complete(d, ticket) ? -1 : 1;
+}
+
+int disk_wait(struct disk *d, int ticket)
+{
+	if (block_ticket_check(d, ticket))
+		return -1;
+
+	while (!d->reqs[ticket].done)
+		if (uring_submit(d, 1))
+			return -1;
+
+	return block_complete(d, ticket);
+}
+
+/* Wait for every request in flight, forgetting about their tickets */
+static void block_drain(struct disk *d)
+{
+	int ticket;
+
+	for (ticket = 0; ticket < BLOCK_QUEUE_DEPTH; ticket++)
+		if (d->reqs[ticket].busy)
+			disk_wait(d, ticket);
+}
+
+void block_stats_enable(int enable)
+{
+	stats_enabled = enable;
+}
+
+void block_stats_get(struct block_stats *stats_out)
+{
+	*stats_out = stats;
+}
+
+void block_stats_reset(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+unsigned long long block_latency_percentile(const struct block_latency *lat,
+					    double p)
+{
+	size_t rank, seen = 0;
+	int i;
+
+	if (!lat->count)
+		return 0;
+
+	/* Smallest bucket covering at least @p of the operations */
+	rank = (size_t)(p * lat->count);
+	if (rank < p * lat->count || !rank)
+		rank++;
+	for (i = 0; i < BLOCK_LATENCY_BUCKETS - 1; i++) {
+		seen += lat->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	return i ? (1ULL << i) - 1 : 0;
+}
+
+void *block_buf_alloc(size_t count)
+{
+	void *buf;
+	int ret;
+
+	ret = posix_memalign(&buf, BLOCK_SIZE, count * BLOCK_SIZE);
+	if (ret) {
+		errno = ret;
+		perror("posix_memalign");
+		return NULL;
+	}
+
+	return buf;
+}
+
+void block_buf_free(void *buf)
+{
+	free(buf);
+}
+
+/*
+ * Single disk interface, operating on the disk opened with block_disk_open()
+ */
+
+#define CUR_DISK_OR(ret)					\
+do {								\
+	if (!cur_disk) {					\
+		block_error("no disk currently open");		\
+		return ret;					\
+	}							\
+} while (0)
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_open_backend(diskname, BLOCK_BACKEND_FILE);
+}
+
+int block_disk_open_backend(const char *diskname, enum block_backend backend)
+{
+	if (cur_disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	cur_disk = disk_open(diskname, backend);
+	if (!cur_disk)
+		return -1;
+
+	return 0;
+}
+
+int block_disk_open_ops(const char *diskname, const struct block_ops *ops)
+{
+	if (cur_disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	cur_disk = disk_open_ops(diskname, ops);
+	if (!cur_disk)
+		return -1;
+
+	return 0;
+}
+
+int block_disk_close(void)
+{
+	struct disk *d;
+
+	CUR_DISK_OR(-1);
+
+	d = cur_disk;
+	cur_disk = NULL;
+	return disk_close(d);
+}
+
+int block_disk_count(void)
+{
+	CUR_DISK_OR(-1);
+	return disk_count(cur_disk);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	CUR_DISK_OR(-1);
+	return disk_write(cur_disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	CUR_DISK_OR(-1);
+	return disk_read(cur_disk, block, buf);
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	CUR_DISK_OR(-1);
+	return disk_write_range(cur_disk, block, count, buf);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	CUR_DISK_OR(-1);
+	return disk_read_range(cur_disk, block, count, buf);
+}
+
+int block_writev(const struct block_iovec *bvec, size_t count)
+{
+	CUR_DISK_OR(-1);
+	return disk_writev(cur_disk, bvec, count);
+}
+
+int block_readv(const struct block_iovec *bvec, size_t count)
+{
+	CUR_DISK_OR(-1);
+	return disk_readv(cur_disk, bvec, count);
+}
+
+void *block_map(size_t block)
+{
+	if (!cur_disk)
+		return NULL;
+	return disk_map(cur_disk, block);
+}
+
+int block_sync_range(size_t block, size_t count)
+{
+	CUR_DISK_OR(-1);
+	return disk_sync_range(cur_disk, block, count);
+}
+
+int block_discard(size_t block, size_t count)
+{
+	CUR_DISK_OR(-1);
+	return disk_discard(cur_disk, block, count);
+}
+
+int block_set_sparse(int enable)
+{
+	CUR_DISK_OR(-1);
+	return disk_set_sparse(cur_disk, enable);
+}
+
+int block_csum_enable(size_t start, size_t count, int build)
+{
+	CUR_DISK_OR(-1);
+	return disk_csum_enable(cur_disk, start, count, build);
+}
+
+int block_csum_sync(void)
+{
+	CUR_DISK_OR(-1);
+	return disk_csum_sync(cur_disk);
+}
+
+int block_csum_exclude(size_t start, size_t count)
+{
+	CUR_DISK_OR(-1);
+	return disk_csum_exclude(cur_disk, start, count);
+}
+
+int block_sim_set(const struct block_sim *sim)
+{
+	CUR_DISK_OR(-1);
+	return disk_sim_set(cur_disk, sim);
+}
+
+int block_write_async(size_t block, size_t count, const void *buf)
+{
+	CUR_DISK_OR(-1);
+	return disk_write_async(cur_disk, block, count, buf);
+}
+
+int block_read_async(size_t block, size_t count, void *buf)
+{
+	CUR_DISK_OR(-1);
+	return disk_read_async(cur_disk, block, count, buf);
+}
+
+int block_submit(void)
+{
+	CUR_DISK_OR(-1);
+	return disk_submit(cur_disk);
+}
+
+int block_poll(int ticket)
+{
+	CUR_DISK_OR(-1);
+	return disk_poll(cur_disk, ticket);
+}
+
+int block_wait(int ticket)
+{
+	CUR_DISK_OR(-1);
+	return disk_wait(cur_disk, ticket);
+}
@@ -6,6 +6,104 @@
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Maximum number of asynchronous requests in flight */
+#define BLOCK_QUEUE_DEPTH 64
+
+/** Number of aligned staging blocks of a %BLOCK_BACKEND_DIRECT disk */
+#define BLOCK_POOL_BLOCKS 64
+
+/**
+ * enum block_backend - Method used to access the virtual disk file
+ * @BLOCK_BACKEND_FILE: Positional reads and writes on the file descriptor
+ * @BLOCK_BACKEND_MMAP: Whole image mapped in memory, blocks are accessible in
+ * place with block_map()
+ * @BLOCK_BACKEND_URING: Positional reads and writes on the file descriptor,
+ * asynchronous requests are queued to the kernel through io_uring
+ * @BLOCK_BACKEND_DIRECT: Positional reads and writes bypassing the host's page
+ * cache (O_DIRECT). Buffers obtained with block_buf_alloc() are transferred
+ * as is, others go through a fixed pool of %BLOCK_POOL_BLOCKS aligned blocks
+ * @BLOCK_BACKEND_SIM: Positional reads and writes on the file descriptor, each
+ * delayed and possibly failed according to a model of a slower disk (see
+ * block_sim_set()), an NVMe drive by default
+ * @BLOCK_BACKEND_RAM: Whole image loaded in anonymous memory with a single
+ * read when the disk is opened, and saved back with a single write by
+ * block_sync_range() and when the disk is closed. Blocks are accessible in
+ * place with block_map()
+ * @BLOCK_BACKEND_RAM_HUGE: Same as %BLOCK_BACKEND_RAM, with the memory backed
+ * by huge pages when the host has some reserved, or else by transparent huge
+ * pages when it allows them
+ */
+enum block_backend {
+	BLOCK_BACKEND_FILE,
+	BLOCK_BACKEND_MMAP,
+	BLOCK_BACKEND_URING,
+	BLOCK_BACKEND_DIRECT,
+	BLOCK_BACKEND_SIM,
+	BLOCK_BACKEND_RAM,
+	BLOCK_BACKEND_RAM_HUGE,
+};
+
+/**
+ * struct block_iovec - Scatter-gather element for vectored block I/O
+ * @block: Index of the block to transfer
+ * @buf: Buffer of %BLOCK_SIZE bytes holding or receiving the block's content
+ */
+struct block_iovec {
+	size_t block;
+	void *buf;
+};
+
+/**
+ * struct block_ops - Operations of a backend, accessing some block device
+ * @name: Short name of the backend
+ * @open: Open device @diskname, return its state or NULL on failure
+ * @close: Close the device and release its state
+ * @read: Read @count blocks starting at @block into @buf
+ * @write: Write @count blocks of @buf starting at @block
+ * @readv: Read the blocks of @bvec. Optional, blocks are read one by one
+ * with @read otherwise
+ * @writev: Write the blocks of @bvec. Optional, blocks are written one by one
+ * with @write otherwise
+ * @flush: Make blocks [@block, @block + @count) durable. Unless the backend
+ * has @map, it may be called while the other operations run on the device,
+ * see fs_sync_ex()
+ * @discard: Release blocks [@block, @block + @count), which then read as
+ * zeros. Optional, block_discard() fails otherwise
+ * @count: Number of blocks of the device
+ * @map: Address of block @block, if blocks are accessible in place.
+ * Optional, see block_map()
+ * @set_sparse: Skip reading the holes of the device if @enable is set.
+ * Optional, see block_set_sparse()
+ *
+ * Custom backends can be opened with block_disk_open_ops(). The block layer
+ * checks block indices before calling them, and handles checksums,
+ * statistics and the single disk interface on top of them. Functions return
+ * -1 on failure and 0 otherwise unless noted.
+ */
+struct block_ops {
+	const char *name;
+	void *(*open)(const char *diskname);
+	int (*close)(void *dev);
+	int (*read)(void *dev, size_t block, size_t count, void *buf);
+	int (*write)(void *dev, size_t block, size_t count, const void *buf);
+	int (*readv)(void *dev, const struct block_iovec *bvec, size_t count);
+	int (*writev)(void *dev, const struct block_iovec *bvec, size_t count);
+	int (*flush)(void *dev, size_t block, size_t count);
+	int (*discard)(void *dev, size_t block, size_t count);
+	size_t (*count)(void *dev);
+	void *(*map)(void *dev, size_t block);
+	int (*set_sparse)(void *dev, int enable);
+};
+
+/**
+ * block_backend_ops - Get the operations of a built-in backend
+ * @backend: Backend
+ *
+ * Return: NULL if @backend is invalid. The operations of @backend otherwise,
+ * which can be compared with those of other backends or wrapped.
+ */
+const struct block_ops *block_backend_ops(enum block_backend backend);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,10 +117,37 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_backend - Open virtual disk file with a given backend
+ * @diskname: Name of the virtual disk file
+ * @backend: Backend used to access the virtual disk file
+ *
+ * Same as block_disk_open() but access the virtual disk file @diskname through
+ * @backend. block_disk_open() uses %BLOCK_BACKEND_FILE.
+ *
+ * Return: -1 if @diskname or @backend is invalid, if the virtual disk file
+ * cannot be opened or is already open. 0 otherwise.
+ */
+int block_disk_open_backend(const char *diskname, enum block_backend backend);
+
+/**
+ * block_disk_open_ops - Open a block device with custom operations
+ * @diskname: Name of the device, passed to @ops->open
+ * @ops: Operations of the backend (see &struct block_ops), which must remain
+ * valid until the device is closed
+ *
+ * Same as block_disk_open_backend() but access the device through @ops.
+ *
+ * Return: -1 if @ops is invalid, if the device cannot be opened or if a
+ * virtual disk file is already open. 0 otherwise.
+ */
+int block_disk_open_ops(const char *diskname, const struct block_ops *ops);
+
 /**
  * block_disk_close - Close virtual disk file
  *
- * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ * Return: -1 if there was no virtual disk file opened, or if it cannot be
+ * closed, see disk_close(). 0 otherwise.
  */
 int block_disk_close(void);
 
@@ -55,10 +180,508 @@ int block_write(size_t block, const void *buf);
  * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
  * buffer @buf.
  *
- * Return: -1 if @block is out of bounds or inaccessible, or if the reading
- * operation fails. 0 otherwise.
+ * Return: -1 if @block is out of bounds or inaccessible, if the reading
+ * operation fails, or if the block does not match its checksum (see
+ * block_csum_enable()). 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write contiguous blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, using a single positional write
+ * whenever possible.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read contiguous blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, using a single positional
+ * read whenever possible.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_writev - Write a list of blocks to disk
+ * @bvec: Array of blocks to write
+ * @count: Number of elements in @bvec
+ *
+ * Write each buffer of @bvec in its associated block. Consecutive elements
+ * whose block indices are contiguous are merged and written with a single
+ * vectored call, so a fragmented list costs one call per contiguous run.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_writev(const struct block_iovec *bvec, size_t count);
+
+/**
+ * block_readv - Read a list of blocks from disk
+ * @bvec: Array of blocks to read
+ * @count: Number of elements in @bvec
+ *
+ * Read each block of @bvec into its associated buffer. Consecutive elements
+ * whose block indices are contiguous are merged and read with a single
+ * vectored call, so a fragmented list costs one call per contiguous run.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_readv(const struct block_iovec *bvec, size_t count);
+
+/**
+ * block_iovec_sort - Sort a list of blocks by block index
+ * @bvec: Array of blocks to sort
+ * @count: Number of elements in @bvec
+ *
+ * Order @bvec the way an elevator would serve it, so that block_writev() and
+ * block_readv() see every contiguous run of blocks as a single run.
+ */
+void block_iovec_sort(struct block_iovec *bvec, size_t count);
+
+/**
+ * block_map - Get direct access to a block
+ * @block: Index of the block
+ *
+ * Get a pointer to the content of the virtual disk's block @block (%BLOCK_SIZE
+ * bytes) inside the memory mapping of the disk. Blocks are laid out
+ * contiguously, so the pointer also gives access to the following blocks.
+ * Changes made through the pointer are part of the disk image, and reach the
+ * virtual disk file at the latest when it is closed or synchronized with
+ * block_sync_range(). The pointer is invalidated by block_disk_close().
+ *
+ * Return: NULL if no disk is open, if the disk was not opened with
+ * %BLOCK_BACKEND_MMAP or a RAM backend, or if @block is out of bounds. A
+ * pointer to the block otherwise.
+ */
+void *block_map(size_t block);
+
+/**
+ * block_sync_range - Synchronize blocks with the virtual disk file
+ * @block: Index of the first block to synchronize
+ * @count: Number of blocks to synchronize
+ *
+ * Make sure that the content of blocks @block to @block + @count - 1 is stored
+ * durably in the virtual disk file. Depending on the backend, more blocks than
+ * requested may be synchronized.
+ *
+ * Return: -1 if any of the blocks is out of bounds or if the synchronization
+ * fails. 0 otherwise.
+ */
+int block_sync_range(size_t block, size_t count);
+
+/**
+ * block_discard - Release the storage of blocks
+ * @block: Index of the first block to release
+ * @count: Number of blocks to release
+ *
+ * Punch a hole in the virtual disk file over blocks @block to @block + @count
+ * - 1, so that they no longer use space on the host. The blocks read as zeros
+ * afterwards. RAM disks zero the blocks in memory.
+ *
+ * Return: -1 if any of the blocks is out of bounds, or if the host file system
+ * cannot punch holes. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * block_set_sparse - Skip holes of the virtual disk file on reads
+ * @enable: Whether holes should be skipped
+ *
+ * With @enable set, synchronous reads first look for the data of the virtual
+ * disk file with SEEK_DATA/SEEK_HOLE and fill the blocks falling in holes
+ * (never written, or released with block_discard()) with zeros without reading
+ * them. This costs an extra system call per read, and pays off on images that
+ * are mostly empty. Mapped disks always read holes without any I/O.
+ *
+ * Return: -1 if no disk is open. 0 otherwise.
+ */
+int block_set_sparse(int enable);
+
+/**
+ * block_csum_enable - Enable per-block checksums
+ * @start: Index of the first block of the checksum region
+ * @count: Number of blocks of the checksum region
+ * @build: Whether to compute the checksums from the current content of the
+ * disk (1), or to load them from the checksum region (0)
+ *
+ * The checksum region holds the CRC32C of every block of the disk, as an array
+ * of 32-bit values indexed by block, and must be large enough for it. Once
+ * enabled, the checksum of each block written is updated, and each block read
+ * is verified against its checksum. Blocks of the region itself are not
+ * covered. Blocks accessed in place with block_map() are not covered either.
+ *
+ * The checksums are kept in memory and written to the checksum region by
+ * block_csum_sync() and when the disk is closed, only the blocks of the region
+ * holding changed checksums.
+ *
+ * Return: -1 if the region is out of bounds or too small, if checksums are
+ * already enabled, or if the disk or the region cannot be read or written. 0
+ * otherwise.
+ */
+int block_csum_enable(size_t start, size_t count, int build);
+
+/**
+ * block_csum_sync - Write the checksums to the checksum region
+ *
+ * Return: -1 if the checksum region cannot be written. 0 otherwise, including
+ * when checksums are disabled.
+ */
+int block_csum_sync(void);
+
+/**
+ * block_csum_exclude - Leave a range of blocks out of the checksums
+ * @start: Index of the first block of the range
+ * @count: Number of blocks of the range, 0 to cover every block again
+ *
+ * Blocks of the range are neither verified when read nor have their checksum
+ * updated when written, as blocks of the checksum region. This suits regions
+ * whose content carries checksums of its own, and which must stay readable
+ * when a crash leaves them written but their checksum not. A single range can
+ * be excluded at a time, which outlasts block_csum_enable().
+ *
+ * Return: -1 if the range is out of bounds. 0 otherwise.
+ */
+int block_csum_exclude(size_t start, size_t count);
+
+/**
+ * enum block_sim_profile - Typical disks, see block_sim_profile()
+ * @BLOCK_SIM_HDD: 7200 rpm hard drive
+ * @BLOCK_SIM_SATA_SSD: SATA solid state drive
+ * @BLOCK_SIM_NVME: NVMe solid state drive
+ */
+enum block_sim_profile {
+	BLOCK_SIM_HDD,
+	BLOCK_SIM_SATA_SSD,
+	BLOCK_SIM_NVME,
+};
+
+/**
+ * struct block_sim - Model of a simulated disk
+ * @read_ns: Latency of a read request, before any transfer
+ * @write_ns: Latency of a write request, before any transfer
+ * @seek_ns: Latency added to a request that does not start where the previous
+ * one ended, scaled from a third for nearby blocks up to full for a request
+ * across the whole disk
+ * @flush_ns: Latency of block_sync_range()
+ * @bandwidth: Transfer rate in bytes per second, 0 for no limit
+ * @read_error_rate: Probability that a read request fails, from 0 to 1
+ * @write_error_rate: Probability that a write request fails, from 0 to 1
+ * @fail_after: Number of requests after which every request fails, as if the
+ * disk died, 0 for never
+ * @seed: Seed of the pseudo-random failures, so that runs are reproducible
+ *
+ * Each request (a single block, a range, or a run of contiguous blocks of a
+ * vector) takes the modeled time, or the time the host takes if longer.
+ * Requests are served one at a time: asynchronous requests do not overlap.
+ */
+struct block_sim {
+	unsigned long read_ns;
+	unsigned long write_ns;
+	unsigned long seek_ns;
+	unsigned long flush_ns;
+	unsigned long long bandwidth;
+	double read_error_rate;
+	double write_error_rate;
+	size_t fail_after;
+	unsigned seed;
+};
+
+/**
+ * block_sim_profile - Get the model of a typical disk
+ * @profile: Disk to model
+ * @sim: Model to fill in, without any failure
+ *
+ * Return: -1 if @profile is invalid. 0 otherwise.
+ */
+int block_sim_profile(enum block_sim_profile profile, struct block_sim *sim);
+
+/**
+ * block_sim_set - Change the model of a simulated disk
+ * @sim: New model, or NULL for the %BLOCK_SIM_NVME profile
+ *
+ * The disk must have been opened with %BLOCK_BACKEND_SIM. Request counts and
+ * failures start over from the new model.
+ *
+ * Return: -1 if no disk is open, or if it is not simulated. 0 otherwise.
+ */
+int block_sim_set(const struct block_sim *sim);
+
+/**
+ * block_write_async - Queue an asynchronous write of contiguous blocks
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Queue the write of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1. Queued requests are handed to
+ * the disk in batches, by block_submit() or when waiting for a request. @buf
+ * must remain valid until the request is completed. Backends other than
+ * %BLOCK_BACKEND_URING perform the request immediately.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if
+ * %BLOCK_QUEUE_DEPTH requests are already in flight. Otherwise, a ticket to
+ * pass to block_poll() or block_wait().
+ */
+int block_write_async(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_async - Queue an asynchronous read of contiguous blocks
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Queue the read of the virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf. See block_write_async().
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if
+ * %BLOCK_QUEUE_DEPTH requests are already in flight. Otherwise, a ticket to
+ * pass to block_poll() or block_wait().
+ */
+int block_read_async(size_t block, size_t count, void *buf);
+
+/**
+ * block_submit - Submit queued asynchronous requests
+ *
+ * Hand all the queued asynchronous requests to the disk in a single batch.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the submission
+ * fails. 0 otherwise.
+ */
+int block_submit(void);
+
+/**
+ * block_poll - Check for the completion of an asynchronous request
+ * @ticket: Ticket of the request
+ *
+ * Check whether the request identified by @ticket has completed, without
+ * blocking. Once reported as completed, the ticket is released.
+ *
+ * Return: -1 if @ticket is invalid or if the request failed, 0 if the request
+ * is still in flight, 1 if the request completed successfully.
+ */
+int block_poll(int ticket);
+
+/**
+ * block_wait - Wait for the completion of an asynchronous request
+ * @ticket: Ticket of the request
+ *
+ * Wait until the request identified by @ticket completes, then release the
+ * ticket.
+ *
+ * Return: -1 if @ticket is invalid or if the request failed. 0 otherwise.
+ */
+int block_wait(int ticket);
+
+/**
+ * block_buf_alloc - Allocate block-aligned buffers
+ * @count: Number of blocks the buffer holds
+ *
+ * Allocate a buffer of @count * %BLOCK_SIZE bytes aligned on %BLOCK_SIZE,
+ * which %BLOCK_BACKEND_DIRECT disks can transfer without staging.
+ *
+ * Return: NULL if the buffer cannot be allocated. The buffer otherwise.
+ */
+void *block_buf_alloc(size_t count);
+
+/**
+ * block_buf_free - Free buffers allocated with block_buf_alloc()
+ * @buf: Buffer to free, or NULL
+ */
+void block_buf_free(void *buf);
+
+/** Number of buckets of a latency histogram */
+#define BLOCK_LATENCY_BUCKETS 40
+
+/**
+ * struct block_latency - Log-bucketed latency histogram
+ * @count: Number of operations recorded
+ * @buckets: Number of operations per latency range. Bucket 0 counts
+ * operations shorter than 1ns, bucket i > 0 those that took [2^(i-1), 2^i) ns.
+ * The last bucket also counts all longer operations.
+ */
+struct block_latency {
+	size_t count;
+	size_t buckets[BLOCK_LATENCY_BUCKETS];
+};
+
+/**
+ * struct block_stats - Block layer counters
+ * @reads: Read operations (single block, range, vector or asynchronous)
+ * @writes: Write operations
+ * @read_bytes: Bytes read
+ * @write_bytes: Bytes written
+ * @syscalls: System calls issued to transfer or sync data, or to drive the
+ * io_uring. Mapped disks transfer data without any.
+ * @errors: Failed operations
+ * @read_latency: Latency of read operations, from the call (or submission for
+ * asynchronous requests) to completion
+ * @write_latency: Latency of write operations
+ */
+struct block_stats {
+	size_t reads;
+	size_t writes;
+	size_t read_bytes;
+	size_t write_bytes;
+	size_t syscalls;
+	size_t errors;
+	struct block_latency read_latency;
+	struct block_latency write_latency;
+};
+
+/**
+ * block_stats_enable - Turn block layer statistics on or off
+ * @enable: Whether operations should be counted and timed
+ *
+ * Statistics cover every open disk and are off by default, in which case
+ * operations only pay for a flag check.
+ */
+void block_stats_enable(int enable);
+
+/**
+ * block_stats_get - Get block layer counters
+ * @stats: Counters to fill in
+ */
+void block_stats_get(struct block_stats *stats);
+
+/**
+ * block_stats_reset - Reset all block layer counters to zero
+ */
+void block_stats_reset(void);
+
+/**
+ * block_latency_percentile - Extract a percentile from a latency histogram
+ * @lat: Latency histogram
+ * @p: Percentile, between 0 and 1 (e.g. 0.99 for p99)
+ *
+ * Return: Upper bound in nanoseconds of the bucket holding the @p-th
+ * percentile, 0 if @lat is empty.
+ */
+unsigned long long block_latency_percentile(const struct block_latency *lat,
+					    double p);
+
+/*
+ * The block_*() functions above operate on the single disk opened with
+ * block_disk_open(). The disk_*() functions below do the same on any number of
+ * disks opened simultaneously with disk_open(), each identified by its handle.
+ */
+
+/** Opaque handle of an open virtual disk file */
+struct disk;
+
+/**
+ * disk_open - Open a virtual disk file and get its handle
+ * @diskname: Name of the virtual disk file
+ * @backend: Backend used to access the virtual disk file
+ *
+ * Return: NULL if @diskname or @backend is invalid, or if the virtual disk file
+ * cannot be opened. The handle of the disk otherwise.
+ */
+struct disk *disk_open(const char *diskname, enum block_backend backend);
+
+/**
+ * disk_open_ops - Open a block device with custom operations and get its handle
+ * @diskname: Name of the device, passed to @ops->open
+ * @ops: Operations of the backend (see &struct block_ops)
+ *
+ * Return: NULL if @ops is invalid, or if the device cannot be opened. The
+ * handle of the disk otherwise.
+ */
+struct disk *disk_open_ops(const char *diskname, const struct block_ops *ops);
+
+/**
+ * disk_close - Close a virtual disk file
+ * @d: Disk handle, invalid afterwards
+ *
+ * Write back the checksums of @d, if enabled, and close the device.
+ *
+ * Return: -1 if @d is invalid, or if the checksums cannot be written back or
+ * the device cannot be closed, in which case @d is released all the same. 0
+ * otherwise.
+ */
+int disk_close(struct disk *d);
+
+/**
+ * disk_count - Get disk's block count
+ * @d: Disk handle
+ *
+ * Return: -1 if @d is invalid. Otherwise the number of blocks of the disk.
+ */
+int disk_count(struct disk *d);
+
+/** disk_write - Same as block_write() on disk @d */
+int disk_write(struct disk *d, size_t block, const void *buf);
+
+/** disk_read - Same as block_read() on disk @d */
+int disk_read(struct disk *d, size_t block, void *buf);
+
+/** disk_write_range - Same as block_write_range() on disk @d */
+int disk_write_range(struct disk *d, size_t block, size_t count,
+		     const void *buf);
+
+/** disk_read_range - Same as block_read_range() on disk @d */
+int disk_read_range(struct disk *d, size_t block, size_t count, void *buf);
+
+/** disk_writev - Same as block_writev() on disk @d */
+int disk_writev(struct disk *d, const struct block_iovec *bvec, size_t count);
+
+/** disk_readv - Same as block_readv() on disk @d */
+int disk_readv(struct disk *d, const struct block_iovec *bvec, size_t count);
+
+/** disk_map - Same as block_map() on disk @d */
+void *disk_map(struct disk *d, size_t block);
+
+/** disk_sync_range - Same as block_sync_range() on disk @d */
+int disk_sync_range(struct disk *d, size_t block, size_t count);
+
+/** disk_discard - Same as block_discard() on disk @d */
+int disk_discard(struct disk *d, size_t block, size_t count);
+
+/** disk_set_sparse - Same as block_set_sparse() on disk @d */
+int disk_set_sparse(struct disk *d, int enable);
+
+/** disk_csum_enable - Same as block_csum_enable() on disk @d */
+int disk_csum_enable(struct disk *d, size_t start, size_t count, int build);
+
+/** disk_csum_sync - Same as block_csum_sync() on disk @d */
+int disk_csum_sync(struct disk *d);
+
+/** disk_csum_exclude - Same as block_csum_exclude() on disk @d */
+int disk_csum_exclude(struct disk *d, size_t start, size_t count);
+
+/** disk_sim_set - Same as block_sim_set() on disk @d */
+int disk_sim_set(struct disk *d, const struct block_sim *sim);
+
+/** disk_write_async - Same as block_write_async() on disk @d */
+int disk_write_async(struct disk *d, size_t block, size_t count,
+		     const void *buf);
+
+/** disk_read_async - Same as block_read_async() on disk @d */
+int disk_read_async(struct disk *d, size_t block, size_t count, void *buf);
+
+/** disk_submit - Same as block_submit() on disk @d */
+int disk_submit(struct disk *d);
+
+/** disk_poll - Same as block_poll() on disk @d */
+int disk_poll(struct disk *d, int ticket);
+
+/** disk_wait - Same as block_wait() on disk @d */
+int disk_wait(struct disk *d, int ticket);
+
 #endif /* _DISK_H */
 
@@ -0,0 +1,147 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "freemap.h"
+
+/* Levels of words, enough for 2^48 blocks */
+#define LEVELS_MAX 8
+
+/* Free-space map instance */
+struct freemap {
+	size_t nblocks;
+	size_t free;
+	/*
+	 * Level 0 has one bit per block, set if the block is free. Each level
+	 * above has one bit per word of the level below, set if the word is
+	 * not 0. The top level is a single word.
+	 */
+	uint64_t *levels[LEVELS_MAX];
+	size_t nwords[LEVELS_MAX];
+	int nlevels;
+};
+
+struct freemap *freemap_create(size_t nblocks)
+{
+	struct freemap *fm;
+	size_t n = nblocks;
+
+	fm = calloc(1, sizeof(*fm));
+	if (!fm) {
+		perror("calloc");
+		return NULL;
+	}
+
+	fm->nblocks = nblocks;
+	do {
+		n = (n + 63) / 64;
+		if (!n)
+			n = 1;
+		fm->nwords[fm->nlevels] = n;
+		fm->levels[fm->nlevels] = calloc(n, sizeof(uint64_t));
+		if (!fm->levels[fm->nlevels++]) {
+			perror("calloc");
+			freemap_destroy(fm);
+			return NULL;
+		}
+	} while (n > 1 && fm->nlevels < LEVELS_MAX);
+
+	return fm;
+}
+
+void freemap_destroy(struct freemap *fm)
+{
+	int l;
+
+	if (!fm)
+		return;
+
+	for (l = 0; l < fm->nlevels; l++)
+		free(fm->levels[l]);
+	free(fm);
+}
+
+void freemap_set(struct freemap *fm, size_t block, int free)
+{
+	uint64_t *word = &fm->levels[0][block / 64];
+	uint64_t bit = 1ull << (block % 64);
+	size_t w = block / 64;
+	int l;
+
+	if (!(*word & bit) == !free)
+		return;
+
+	*word ^= bit;
+	if (free)
+		fm->free++;
+	else
+		fm->free--;
+
+	/* Update the summaries up to the first one that does not change */
+	for (l = 1; l < fm->nlevels; l++) {
+		word = &fm->levels[l][w / 64];
+		bit = 1ull << (w % 64);
+		if (!(*word & bit) == !fm->levels[l - 1][w])
+			break;
+		*word ^= bit;
+		w /= 64;
+	}
+}
+
+size_t freemap_count(struct freemap *fm)
+{
+	return fm->free;
+}
+
+size_t freemap_find(struct freemap *fm, size_t start)
+{
+	size_t i = start, w;
+	uint64_t m;
+	int l;
+
+	if (start >= fm->nblocks)
+		return FREEMAP_NONE;
+
+	/* Go up until a word has a set bit at or after @i */
+	for (l = 0; l < fm->nlevels; l++) {
+		w = i / 64;
+		if (w >= fm->nwords[l])
+			return FREEMAP_NONE;
+		m = fm->levels[l][w] & (~0ull << (i % 64));
+		if (m) {
+			i = w * 64 + __builtin_ctzll(m);
+			break;
+		}
+		i = w + 1;
+	}
+	if (l == fm->nlevels)
+		return FREEMAP_NONE;
+
+	/* Then down to the first free block below it */
+	while (l-- > 0)
+		i = i * 64 + __builtin_ctzll(fm->levels[l][i]);
+
+	return i;
+}
+
+size_t freemap_run(struct freemap *fm, size_t start, size_t max)
+{
+	size_t i = start, n = 0, k, left;
+	uint64_t used;
+
+	while (n < max && i < fm->nblocks) {
+		/* Bits past the last block are clear, so the run stops there */
+		left = 64 - i % 64;
+		used = ~(fm->levels[0][i / 64] >> (i % 64));
+		k = used ? (size_t)__builtin_ctzll(used) : 64;
+		if (k > left)
+			k = left;
+		n += k;
+		if (k < left)
+			break;
+		i += k;
+	}
+
+	return n < max ? n : max;
+}
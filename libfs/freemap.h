@@ -0,0 +1,75 @@
+#ifndef _FREEMAP_H
+#define _FREEMAP_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * DOC: Free-space map
+ *
+ * The map tells which of a fixed number of blocks are free. It is a bitmap
+ * with a hierarchy of summary words on top: each bit of a summary word tells
+ * whether a word of the level below has any free block. Finding the next free
+ * block takes one word per level, and runs of used blocks are skipped 64 words
+ * at a time. The number of free blocks is counted as blocks are marked.
+ */
+
+/** Returned by the searches when there is no such block */
+#define FREEMAP_NONE SIZE_MAX
+
+/** Opaque handle of a free-space map */
+struct freemap;
+
+/**
+ * freemap_create - Create a free-space map
+ * @nblocks: Number of blocks, numbered from 0
+ *
+ * Every block starts as used.
+ *
+ * Return: NULL if the map cannot be allocated. The map otherwise.
+ */
+struct freemap *freemap_create(size_t nblocks);
+
+/**
+ * freemap_destroy - Release a free-space map
+ * @fm: Map, or NULL
+ */
+void freemap_destroy(struct freemap *fm);
+
+/**
+ * freemap_set - Mark a block as free or used
+ * @fm: Map
+ * @block: Index of the block
+ * @free: Whether the block is free
+ */
+void freemap_set(struct freemap *fm, size_t block, int free);
+
+/**
+ * freemap_count - Count the free blocks
+ * @fm: Map
+ *
+ * Return: Number of blocks marked as free.
+ */
+size_t freemap_count(struct freemap *fm);
+
+/**
+ * freemap_find - Find the next free block
+ * @fm: Map
+ * @start: Index of the first block to consider
+ *
+ * Return: Index of the first free block at or after @start, or
+ * %FREEMAP_NONE if there is none.
+ */
+size_t freemap_find(struct freemap *fm, size_t start);
+
+/**
+ * freemap_run - Measure a run of free blocks
+ * @fm: Map
+ * @start: Index of the first block of the run
+ * @max: Largest length of interest
+ *
+ * Return: Number of consecutive free blocks from @start on, up to @max.
+ */
+size_t freemap_run(struct freemap *fm, size_t start, size_t max);
+
+#endif /* _FREEMAP_H */
@@ -1,31 +1,22 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "cache.h"
+#include "dedup.h"
 #include "disk.h"
+#include "freemap.h"
 #include "fs.h"
-
-#define BLOCK_SIZE 4096
-#define FAT_EOC 0xFFFF
-
-struct __attribute__((__packed__)) superblock {
-    char signature[8];
-    uint16_t virtual_disk_blocks_count;
-    uint16_t root_directory_block_index;
-    uint16_t data_block_start_index;
-    uint16_t data_blocks_count;
-    uint8_t fat_blocks_count;
-    char padding[BLOCK_SIZE];
-};
-
-struct __attribute__((__packed__)) root_dir {
-    char filename[16];
-    uint32_t file_size;
-    uint16_t first_data_block_index;
-    char padding[10];
-};
+#include "journal.h"
+#include "layout.h"
+#include "lz.h"
 
 struct __attribute__((__packed__)) file_descriptor {
     char filename[16];
@@ -33,382 +24,2717 @@ struct __attribute__((__packed__)) file_descriptor {
     int offset;
 };
 
-typedef struct superblock super_block;
 typedef struct file_descriptor fd_t;
-super_block sb;
-fd_t file_d[FS_OPEN_MAX_COUNT];
-struct root_dir * rd;
-uint8_t open_files = 0;
-uint16_t *fat_table;
+
+struct fs_volume {
+    struct disk *disk;
+    struct cache *cache;
+    // backend the disk was opened with
+    enum block_backend disk_backend;
+    super_block sb;
+    // size of the blocks of the file system, and number of disk blocks each
+    size_t block_size;
+    size_t spb;
+    fd_t file_d[FS_OPEN_MAX_COUNT];
+    struct root_dir *rd;
+    uint8_t open_files;
+    uint16_t *fat_table;
+    // FAT blocks loaded so far, NULL once they all are (see fat_get()), the
+    // number of blocks still to load, and whether loading one failed
+    uint8_t *fat_loaded;
+    size_t fat_unloaded;
+    int fat_error;
+    // free data blocks, among those whose FAT block is loaded
+    struct freemap *free_map;
+    // FAT blocks and root directory changed since they were last written
+    uint8_t *fat_dirty;
+    int rd_dirty;
+    // background loading of the FAT (FS_FAT_PREFETCH)
+    pthread_t prefetch_thread;
+    int prefetching;
+    int prefetch_stop;
+    // root directory and FAT are used in place in the disk mapping
+    int mapped;
+    // storage of freed data blocks is released
+    int sparse;
+    // new files are compressed
+    int compress;
+    // closed files share their blocks with identical files, see merge_chain()
+    struct dedup *dedup;
+    // references to each data block, from the FAT and from the root
+    // directory, and the blocks whose FAT entry is each block (or FAT_EOC,
+    // last), linked through pred_next and pred_prev. NULL until first needed
+    // by deduplication, see build_refs(), and kept up to date from then on
+    uint32_t *refs;
+    uint16_t *pred_first;
+    uint16_t *pred_next;
+    uint16_t *pred_prev;
+    // the superblock needs to be written back
+    int sb_dirty;
+    // where changes to the FAT, the root directory and the superblock are
+    // logged before they are written in place, NULL without a journal
+    struct journal *journal;
+    // serializes the operations on the volume
+    pthread_mutex_t lock;
+    // group commit: syncs started and completed so far, whether one is in
+    // progress and how the last one went. callers of fs_sync_ex() wait on
+    // @sync_done_cond for a sync that started after they called
+    unsigned long syncs_started;
+    unsigned long syncs_done;
+    int syncing;
+    int sync_ret;
+    pthread_cond_t sync_done_cond;
+    struct fs_sync_stats sync_stats;
+    // background writeback: settings, thread, whether it must stop, and
+    // conditions to wake it up and to wait for the end of a round
+    struct fs_writeback writeback;
+    pthread_t wb_thread;
+    int wb_running;
+    int wb_stop;
+    pthread_cond_t wb_cond;
+    pthread_cond_t wb_done_cond;
+    unsigned long wb_rounds;
+    // when the writeback thread first saw the metadata dirty, 0 if clean
+    uint64_t meta_dirtied;
+    struct fs_writeback_stats wb_stats;
+};
+
+// volume used by the fs_*() functions that do not take one
+static fs_volume_t *default_vol = NULL;
+// cache counters of the last unmounted default volume
+static struct cache_stats last_stats;
+
+// allocate a buffer of @n file system blocks
+static void *alloc_blocks(fs_volume_t *vol, size_t n)
+{
+    return block_buf_alloc(n * vol->spb);
+}
+
+// address of file system block @b in the disk mapping
+static void *map_block(fs_volume_t *vol, size_t b)
+{
+    return disk_map(vol->disk, b * vol->spb);
+}
+
+// number of FAT entries per block
+static size_t fat_per_block(fs_volume_t *vol)
+{
+    return vol->block_size / sizeof(uint16_t);
+}
+
+// add the free data blocks of FAT block @fb to the free-space map
+static void index_fat_block(fs_volume_t *vol, size_t fb)
+{
+    size_t end = (fb + 1) * fat_per_block(vol);
+    if (end > vol->sb.data_blocks_count){
+        end = vol->sb.data_blocks_count;
+    }
+    // entry 0 is reserved
+    for (size_t i=fb ? fb * fat_per_block(vol) : 1; i<end; i++){
+        if (vol->fat_table[i] == 0){
+            freemap_set(vol->free_map, i, 1);
+        }
+    }
+}
+
+// once the whole FAT is indexed, fix the free block count of the superblock
+// if it is missing or wrong, as left by other implementations
+static void check_free_count(fs_volume_t *vol)
+{
+    size_t free_blocks = freemap_count(vol->free_map);
+    if (!(vol->sb.features & FS_FEATURE_COUNTS)){
+        // written with the next change, if any
+        vol->sb.features |= FS_FEATURE_COUNTS;
+        vol->sb.free_blocks_count = free_blocks;
+    } else if (vol->sb.free_blocks_count != free_blocks){
+        vol->sb.free_blocks_count = free_blocks;
+        vol->sb_dirty = 1;
+    }
+}
+
+// same as check_free_count() for the free root directory entries, counted
+// when the root directory is read. runs before check_free_count(), so that the
+// counters are only written back if they already were on the disk
+static void check_free_entries(fs_volume_t *vol)
+{
+    size_t free_entries = 0;
+    for (int i=0; i<FS_FILE_MAX_COUNT; i++){
+        if (vol->rd[i].filename[0] == '\0'){
+            free_entries++;
+        }
+    }
+    if (vol->sb.free_entries_count != free_entries){
+        vol->sb.free_entries_count = free_entries;
+        if (vol->sb.features & FS_FEATURE_COUNTS){
+            vol->sb_dirty = 1;
+        }
+    }
+}
+
+// load block @fb of the FAT, unless it already is. returns -1 on failure
+static int fat_load_block(fs_volume_t *vol, size_t fb)
+{
+    if (vol->fat_loaded == NULL || vol->fat_loaded[fb]){
+        return 0;
+    }
+    char *buf = (char*)vol->fat_table + fb * vol->block_size;
+    if (cache_read_range(vol->cache, (1 + fb) * vol->spb, vol->spb, buf) == -1){
+        vol->fat_error = 1;
+        return -1;
+    }
+    vol->fat_loaded[fb] = 1;
+    index_fat_block(vol, fb);
+    // every block is there, no need to check anymore
+    if (--vol->fat_unloaded == 0){
+        free(vol->fat_loaded);
+        vol->fat_loaded = NULL;
+        check_free_count(vol);
+    }
+    return 0;
+}
+
+// FAT entry @i, whose block is loaded on first touch. entries that cannot be
+// loaded read as FAT_EOC, so that chains end there and nothing is allocated
+static uint16_t fat_get(fs_volume_t *vol, size_t i)
+{
+    if (vol->fat_loaded != NULL && fat_load_block(vol, i / fat_per_block(vol)) == -1){
+        return FAT_EOC;
+    }
+    return vol->fat_table[i];
+}
+
+// whether FAT entry value @value links a block to the next one, or ends a
+// chain, so that the block is listed among the predecessors of @value
+static int pred_listed(fs_volume_t *vol, uint16_t value)
+{
+    return value != 0 && (value < vol->sb.data_blocks_count || value == FAT_EOC);
+}
+
+// FAT entry @i went from @old to @value: move block @i from the predecessors
+// of @old to those of @value, and count the reference to @value instead
+static void move_ref(fs_volume_t *vol, size_t i, uint16_t old, uint16_t value)
+{
+    size_t n = vol->sb.data_blocks_count;
+    if (pred_listed(vol, old)){
+        if (old != FAT_EOC){
+            vol->refs[old]--;
+        }
+        if (vol->pred_prev[i] == FAT_EOC){
+            vol->pred_first[old == FAT_EOC ? n : old] = vol->pred_next[i];
+        } else {
+            vol->pred_next[vol->pred_prev[i]] = vol->pred_next[i];
+        }
+        if (vol->pred_next[i] != FAT_EOC){
+            vol->pred_prev[vol->pred_next[i]] = vol->pred_prev[i];
+        }
+    }
+    if (pred_listed(vol, value)){
+        if (value != FAT_EOC){
+            vol->refs[value]++;
+        }
+        uint16_t *first = &vol->pred_first[value == FAT_EOC ? n : value];
+        vol->pred_next[i] = *first;
+        vol->pred_prev[i] = FAT_EOC;
+        if (*first != FAT_EOC){
+            vol->pred_prev[*first] = i;
+        }
+        *first = i;
+    }
+}
+
+// release the references to the data blocks of @vol
+static void free_refs(fs_volume_t *vol)
+{
+    free(vol->refs);
+    free(vol->pred_first);
+    free(vol->pred_next);
+    free(vol->pred_prev);
+    vol->refs = NULL;
+    vol->pred_first = vol->pred_next = vol->pred_prev = NULL;
+}
+
+// set FAT entry @i, whose block is loaded on first touch. entries that cannot
+// be loaded are left alone, and the next write-back fails
+static void fat_set(fs_volume_t *vol, size_t i, uint16_t value)
+{
+    if (vol->fat_loaded != NULL && fat_load_block(vol, i / fat_per_block(vol)) == -1){
+        return;
+    }
+    // blocks change hands when their entry goes from or to 0
+    if ((vol->fat_table[i] == 0) != (value == 0) && i != 0 && i < vol->sb.data_blocks_count){
+        freemap_set(vol->free_map, i, value == 0);
+        if (vol->sb.features & FS_FEATURE_COUNTS){
+            vol->sb.free_blocks_count += value == 0 ? 1 : -1;
+            vol->sb_dirty = 1;
+        }
+    }
+    if (vol->refs != NULL && vol->fat_table[i] != value && i != 0 &&
+        i < vol->sb.data_blocks_count){
+        move_ref(vol, i, vol->fat_table[i], value);
+    }
+    if (vol->fat_dirty != NULL && vol->fat_table[i] != value){
+        vol->fat_dirty[i / fat_per_block(vol)] = 1;
+    }
+    vol->fat_table[i] = value;
+}
+
+// load the FAT blocks that are not loaded yet. returns -1 on failure
+static int fat_load_all(fs_volume_t *vol)
+{
+    int ret = 0;
+    for (size_t fb=0; vol->fat_loaded != NULL && fb<vol->sb.fat_blocks_count; fb++){
+        if (fat_load_block(vol, fb) == -1){
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+// first free data block at or after @start, or FREEMAP_NONE. the FAT blocks
+// that are not loaded yet are loaded as the search reaches them
+static size_t next_free_block(fs_volume_t *vol, size_t start)
+{
+    size_t b = start;
+    while (vol->fat_loaded != NULL && b < vol->sb.data_blocks_count){
+        size_t fb = b / fat_per_block(vol);
+        size_t end = (fb + 1) * fat_per_block(vol);
+        fat_load_block(vol, fb);
+        size_t f = freemap_find(vol->free_map, b);
+        if (f < end || vol->fat_loaded == NULL){
+            return f;
+        }
+        b = end;
+    }
+    return freemap_find(vol->free_map, b);
+}
+
+// first data block at or after @start that starts a run of @len free blocks,
+// or FREEMAP_NONE if there is none
+static size_t free_run(fs_volume_t *vol, size_t start, size_t len)
+{
+    for (size_t b=next_free_block(vol, start); b!=FREEMAP_NONE; ){
+        // the blocks of the run need to be indexed to be counted
+        size_t last = b + len - 1;
+        if (last >= vol->sb.data_blocks_count){
+            last = vol->sb.data_blocks_count - 1;
+        }
+        for (size_t fb=b / fat_per_block(vol); fb<=last / fat_per_block(vol); fb++){
+            fat_load_block(vol, fb);
+        }
+        size_t run = freemap_run(vol->free_map, b, len);
+        if (run == len){
+            return b;
+        }
+        b = next_free_block(vol, b + run);
+    }
+    return FREEMAP_NONE;
+}
+
+// load the FAT in the background, one block at a time so that the volume can
+// be used meanwhile
+static void *prefetch_fat(void *arg)
+{
+    fs_volume_t *vol = arg;
+    for (size_t fb=0; ; fb++){
+        pthread_mutex_lock(&vol->lock);
+        int done = vol->prefetch_stop || vol->fat_loaded == NULL ||
+                   fb >= vol->sb.fat_blocks_count;
+        if (!done){
+            fat_load_block(vol, fb);
+        }
+        pthread_mutex_unlock(&vol->lock);
+        if (done){
+            return NULL;
+        }
+    }
+}
+
+// stop loading the FAT in the background
+static void stop_prefetch(fs_volume_t *vol)
+{
+    if (!vol->prefetching){
+        return;
+    }
+    pthread_mutex_lock(&vol->lock);
+    vol->prefetch_stop = 1;
+    pthread_mutex_unlock(&vol->lock);
+    pthread_join(vol->prefetch_thread, NULL);
+    vol->prefetching = 0;
+}
+
+// defined with the write-back functions below
+static int flush_volume(fs_volume_t *vol);
+
+// current time in nanoseconds
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// whether more than @ratio percent of the cache is dirty
+static int dirty_over(fs_volume_t *vol, unsigned int ratio)
+{
+    size_t size = cache_size(vol->cache);
+    return size > 0 && cache_dirty(vol->cache, NULL) * 100 > size * ratio;
+}
+
+// whether the FAT, the root directory or the superblock changed since they
+// were last written
+static int metadata_dirty(fs_volume_t *vol)
+{
+    if (vol->rd_dirty || vol->sb_dirty){
+        return 1;
+    }
+    for (size_t fb=0; vol->fat_dirty != NULL && fb<vol->sb.fat_blocks_count; fb++){
+        if (vol->fat_dirty[fb]){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// largest number of blocks written back without letting the writers in
+#define WRITEBACK_BATCH 64
+
+// write back the data blocks dirtied before @before, or while more than
+// @ratio percent of the cache is dirty, a batch at a time so that the lock
+// of @vol is released in between
+static void writeback_data(fs_volume_t *vol, uint64_t before, unsigned int ratio)
+{
+    while (!vol->wb_stop && (ratio == 0 || dirty_over(vol, ratio))){
+        if (cache_writeback(vol->cache, before, WRITEBACK_BATCH) <= 0){
+            return;
+        }
+        pthread_mutex_unlock(&vol->lock);
+        sched_yield();
+        pthread_mutex_lock(&vol->lock);
+    }
+}
+
+// one round of background writeback, with the lock of @vol held: the
+// metadata once it is dirty for long enough, after all the data, or the
+// oldest blocks while too many are dirty, or the data blocks dirty for long
+// enough
+static void writeback_round(fs_volume_t *vol)
+{
+    uint64_t now = now_ns();
+    uint64_t expire = (uint64_t)vol->writeback.expire_ms * 1000000;
+    uint64_t oldest;
+    struct cache_stats before, after;
+    cache_stats_get(vol->cache, &before);
+
+    if (vol->meta_dirtied == 0 && metadata_dirty(vol)){
+        vol->meta_dirtied = now;
+    }
+    if (vol->meta_dirtied != 0 && vol->meta_dirtied + expire <= now){
+        // so that the metadata never points to data that is not written
+        writeback_data(vol, UINT64_MAX, 0);
+        if (!vol->wb_stop){
+            flush_volume(vol);
+        }
+        vol->wb_stats.expired++;
+    } else if (dirty_over(vol, vol->writeback.background_ratio)){
+        writeback_data(vol, UINT64_MAX, vol->writeback.background_ratio);
+        vol->wb_stats.background++;
+    } else if (cache_dirty(vol->cache, &oldest) > 0 && oldest + expire <= now){
+        writeback_data(vol, now - expire, 0);
+        vol->wb_stats.expired++;
+    }
+
+    cache_stats_get(vol->cache, &after);
+    vol->wb_stats.blocks += after.writebacks - before.writebacks;
+}
+
+// write back dirty blocks in the background every interval, or when woken
+// up by a writer
+static void *writeback_thread(void *arg)
+{
+    fs_volume_t *vol = arg;
+    pthread_mutex_lock(&vol->lock);
+    while (!vol->wb_stop){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t ns = ts.tv_nsec + (uint64_t)vol->writeback.interval_ms * 1000000;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&vol->wb_cond, &vol->lock, &ts);
+        if (vol->wb_stop){
+            break;
+        }
+        vol->wb_stats.wakeups++;
+        writeback_round(vol);
+        vol->wb_rounds++;
+        pthread_cond_broadcast(&vol->wb_done_cond);
+    }
+    pthread_mutex_unlock(&vol->lock);
+    return NULL;
+}
+
+// start the background writeback of @vol with settings @wb. returns -1 if
+// the thread cannot be started
+static int start_writeback(fs_volume_t *vol, const struct fs_writeback *wb)
+{
+    vol->writeback = *wb;
+    if (vol->writeback.interval_ms == 0){
+        vol->writeback.interval_ms = 500;
+    }
+    if (vol->writeback.expire_ms == 0){
+        vol->writeback.expire_ms = 5000;
+    }
+    if (vol->writeback.background_ratio == 0){
+        vol->writeback.background_ratio = 10;
+    }
+    if (vol->writeback.dirty_ratio == 0){
+        vol->writeback.dirty_ratio = 20;
+    }
+    // writers only wait for the thread once it writes back everything
+    if (vol->writeback.background_ratio > vol->writeback.dirty_ratio){
+        vol->writeback.background_ratio = vol->writeback.dirty_ratio;
+    }
+
+    // the thread wakes up on its own every interval, whatever the wall clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&vol->wb_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&vol->wb_done_cond, NULL);
+    if (pthread_create(&vol->wb_thread, NULL, writeback_thread, vol) != 0){
+        pthread_cond_destroy(&vol->wb_done_cond);
+        pthread_cond_destroy(&vol->wb_cond);
+        return -1;
+    }
+    vol->wb_running = 1;
+    return 0;
+}
+
+// stop the background writeback, leaving the dirty blocks to the caller
+static void stop_writeback(fs_volume_t *vol)
+{
+    if (!vol->wb_running){
+        return;
+    }
+    pthread_mutex_lock(&vol->lock);
+    vol->wb_stop = 1;
+    pthread_cond_signal(&vol->wb_cond);
+    pthread_cond_broadcast(&vol->wb_done_cond);
+    pthread_mutex_unlock(&vol->lock);
+    pthread_join(vol->wb_thread, NULL);
+    pthread_cond_destroy(&vol->wb_done_cond);
+    pthread_cond_destroy(&vol->wb_cond);
+    vol->wb_running = 0;
+}
+
+// with background writeback, wake the thread up when enough of the cache is
+// dirty, and wait for it while too much is, like balance_dirty_pages() of
+// Linux. called by writers with the lock of @vol held
+static void balance_dirty(fs_volume_t *vol)
+{
+    if (!vol->wb_running){
+        return;
+    }
+    if (dirty_over(vol, vol->writeback.background_ratio)){
+        pthread_cond_signal(&vol->wb_cond);
+    }
+    if (!dirty_over(vol, vol->writeback.dirty_ratio)){
+        return;
+    }
+
+    uint64_t start = now_ns();
+    vol->wb_stats.throttled++;
+    while (dirty_over(vol, vol->writeback.dirty_ratio) && !vol->wb_stop){
+        unsigned long round = vol->wb_rounds;
+        size_t blocks = vol->wb_stats.blocks;
+        pthread_cond_signal(&vol->wb_cond);
+        while (vol->wb_rounds == round && !vol->wb_stop){
+            pthread_cond_wait(&vol->wb_done_cond, &vol->lock);
+        }
+        // the blocks cannot be written, waiting more would not help
+        if (vol->wb_stats.blocks == blocks){
+            break;
+        }
+    }
+    vol->wb_stats.throttle_ns += now_ns() - start;
+}
+
+// expand the @n file system blocks of @bvec into the disk blocks they span.
+// returns @bvec itself when both have the same size, a new vector to free
+// otherwise, or NULL if it cannot be allocated
+static struct block_iovec *disk_iovec(fs_volume_t *vol, struct block_iovec *bvec, size_t n)
+{
+    if (vol->spb == 1){
+        return bvec;
+    }
+    struct block_iovec *dvec = malloc(sizeof(struct block_iovec) * n * vol->spb);
+    if (dvec == NULL){
+        return NULL;
+    }
+    for (size_t i=0; i<n; i++){
+        for (size_t k=0; k<vol->spb; k++){
+            dvec[i * vol->spb + k].block = bvec[i].block * vol->spb + k;
+            dvec[i * vol->spb + k].buf = (char*)bvec[i].buf + k * BLOCK_SIZE;
+        }
+    }
+    return dvec;
+}
+
+// allocate the @count data blocks from @first on as a single chain that
+// belongs to no file
+static void chain_region(fs_volume_t *vol, size_t first, size_t count)
+{
+    for (size_t i=first; i<first + count; i++){
+        fat_set(vol, i, i + 1 < first + count ? i + 1 : FAT_EOC);
+    }
+}
+
+// set up the checksum region of a file system mounted for the first time
+// with checksums, in the last data blocks. returns -1 if they are not free
+static int enable_checksums(fs_volume_t *vol)
+{
+    size_t total = vol->sb.virtual_disk_blocks_count * vol->spb;
+    size_t count = (total * sizeof(uint32_t) + vol->block_size - 1) / vol->block_size;
+    // entry 0 is reserved
+    if (count >= vol->sb.data_blocks_count) {
+        return -1;
+    }
+    size_t first = vol->sb.data_blocks_count - count;
+    for (size_t i=first; i<vol->sb.data_blocks_count; i++){
+        if (fat_get(vol, i) != 0){
+            return -1;
+        }
+    }
+
+    if (disk_csum_enable(vol->disk, (vol->sb.data_block_start_index + first) * vol->spb,
+                         count * vol->spb, 1) == -1) {
+        return -1;
+    }
+
+    chain_region(vol, first, count);
+    vol->sb.features |= FS_FEATURE_CSUM;
+    vol->sb.csum_block_start = vol->sb.data_block_start_index + first;
+    vol->sb.csum_blocks_count = count;
+    vol->sb_dirty = 1;
+    return 0;
+}
+
+// set up the journal of a file system mounted for the first time with one,
+// in the last run of @blocks free data blocks, or more if a transaction with
+// the whole FAT, the root directory and the superblock would not fit. returns
+// -1 if there is no such run
+static int enable_journal(fs_volume_t *vol, size_t blocks)
+{
+    size_t max = (vol->sb.fat_blocks_count + 1) * vol->spb + 1;
+    size_t min = (journal_min_blocks(max) + vol->spb - 1) / vol->spb;
+    if (blocks < min){
+        blocks = min;
+    }
+
+    // entry 0 is reserved
+    size_t first = 0, run = 0;
+    for (size_t i=vol->sb.data_blocks_count - 1; i>0 && run<blocks; i--){
+        run = fat_get(vol, i) == 0 ? run + 1 : 0;
+        first = i;
+    }
+    if (run < blocks){
+        return -1;
+    }
+
+    size_t start = vol->sb.data_block_start_index + first;
+    if (journal_format(vol->disk, start * vol->spb, blocks * vol->spb) == -1){
+        return -1;
+    }
+    vol->journal = journal_open(vol->disk, start * vol->spb, blocks * vol->spb);
+    if (vol->journal == NULL){
+        return -1;
+    }
+
+    // declared by the first transaction, which only needs the region to be
+    // free if it does not make it
+    chain_region(vol, first, blocks);
+    vol->sb.features |= FS_FEATURE_JOURNAL;
+    vol->sb.journal_block_start = start;
+    vol->sb.journal_blocks_count = blocks;
+    vol->sb_dirty = 1;
+    return 0;
+}
+
+// undo a partial mount, returns NULL
+static fs_volume_t *mount_fail(fs_volume_t *vol)
+{
+    if (!vol->mapped) {
+        block_buf_free(vol->fat_table);
+        block_buf_free(vol->rd);
+    }
+    free(vol->fat_loaded);
+    free(vol->fat_dirty);
+    freemap_destroy(vol->free_map);
+    cache_destroy(vol->cache);
+    dedup_destroy(vol->dedup);
+    journal_close(vol->journal);
+    disk_close(vol->disk);
+    pthread_cond_destroy(&vol->sync_done_cond);
+    pthread_mutex_destroy(&vol->lock);
+    free(vol);
+    return NULL;
+}
 
 /**
- * fs_mount - Mount a file system
+ * fs_mount_ex - Mount a file system as a new volume
  * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
  *
- * Open the virtual disk file @diskname and mount the file system that it
- * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * Open the virtual disk file @diskname as described by @opts and mount the
+ * file system that it contains as a volume of its own, with its own FAT, root
+ * directory, file descriptors and block cache.
  *
- * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
- * file system can be located. 0 otherwise.
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. The handle of the volume otherwise.
  */
-int fs_mount(const char *diskname)
+fs_volume_t *fs_mount_ex(const char *diskname, const struct fs_mount_opts *opts)
 {
-    // if disk cannot be opened, return -1
-    if (block_disk_open(diskname) == -1) {
-        return -1;
+    struct fs_mount_opts defaults = {
+        .backend = BLOCK_BACKEND_FILE,
+        .cache_blocks = 0,
+        .cache_policy = CACHE_POLICY_CLOCK,
+    };
+    if (opts == NULL) {
+        opts = &defaults;
+    }
+
+    fs_volume_t *vol = calloc(1, sizeof(fs_volume_t));
+    if (vol == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&vol->lock, NULL);
+    pthread_cond_init(&vol->sync_done_cond, NULL);
+
+    // if disk cannot be opened, return NULL
+    if (opts->ops != NULL) {
+        vol->disk = disk_open_ops(diskname, opts->ops);
+    } else {
+        vol->disk = disk_open(diskname, opts->backend);
+    }
+    if (vol->disk == NULL) {
+        pthread_cond_destroy(&vol->sync_done_cond);
+        pthread_mutex_destroy(&vol->lock);
+        free(vol);
+        return NULL;
+    }
+
+    // custom backends have no asynchronous interface of their own
+    vol->disk_backend = opts->backend;
+    if (opts->ops != NULL && opts->ops != block_backend_ops(BLOCK_BACKEND_URING)) {
+        vol->disk_backend = BLOCK_BACKEND_FILE;
+    }
+    vol->sparse = opts->sparse;
+    vol->compress = opts->compress;
+    disk_set_sparse(vol->disk, opts->sparse);
+    if (opts->sim != NULL && disk_sim_set(vol->disk, opts->sim) == -1) {
+        return mount_fail(vol);
+    }
+
+    // read into super block
+    if (disk_read(vol->disk, 0, (void*)&vol->sb) == -1) {
+        return mount_fail(vol);
+    }
+
+    // error checking to verify that the file system has the expected format
+    // check that signature of file system is ECS150FS
+    if (memcmp("ECS150FS", vol->sb.signature, 8) != 0) {
+        return mount_fail(vol);
+    }
+
+    // check that the block size is supported
+    vol->block_size = vol->sb.block_shift ? (size_t)1 << (vol->sb.block_shift & 31) : 4096;
+    if (vol->block_size < FS_BLOCK_SIZE_MIN || vol->block_size > FS_BLOCK_SIZE_MAX) {
+        return mount_fail(vol);
+    }
+    vol->spb = vol->block_size / BLOCK_SIZE;
+
+    // check that the total number of block corresponds to what disk_count() returns
+    if (vol->sb.virtual_disk_blocks_count * vol->spb != (size_t)disk_count(vol->disk)) {
+        return mount_fail(vol);
+    }
+
+    // load the checksums of the disk, then replay the journal, which may
+    // change the superblock, and read the super block again, verified
+    uint8_t features = vol->sb.features;
+    if ((features & FS_FEATURE_CSUM) &&
+        disk_csum_enable(vol->disk, vol->sb.csum_block_start * vol->spb,
+                         vol->sb.csum_blocks_count * vol->spb, 0) == -1) {
+        return mount_fail(vol);
+    }
+    if (features & FS_FEATURE_JOURNAL) {
+        vol->journal = journal_open(vol->disk, vol->sb.journal_block_start * vol->spb,
+                                    vol->sb.journal_blocks_count * vol->spb);
+        if (vol->journal == NULL) {
+            return mount_fail(vol);
+        }
+    }
+    struct journal_stats js = {0};
+    if (vol->journal != NULL) {
+        journal_stats_get(vol->journal, &js);
+    }
+    if (((features & FS_FEATURE_CSUM) || js.replayed > 0) &&
+        disk_read(vol->disk, 0, (void*)&vol->sb) == -1) {
+        return mount_fail(vol);
+    }
+    // the replayed superblock has a checksum region that was not loaded, and
+    // whose checksums predate the replay
+    if ((vol->sb.features & FS_FEATURE_CSUM) && !(features & FS_FEATURE_CSUM) &&
+        disk_csum_enable(vol->disk, vol->sb.csum_block_start * vol->spb,
+                         vol->sb.csum_blocks_count * vol->spb, 1) == -1) {
+        return mount_fail(vol);
+    }
+    int checksums = opts->checksums || (vol->sb.features & FS_FEATURE_CSUM);
+    int journal = opts->journal_blocks > 0 || vol->journal != NULL;
+
+    // with a mapped disk, blocks are accessed in place and not cached, unless
+    // they are checksummed or journaled
+    vol->mapped = disk_map(vol->disk, 0) != NULL && !checksums && !journal;
+    vol->cache = cache_create(vol->disk, vol->mapped ? 0 : opts->cache_blocks,
+                              opts->cache_policy);
+    if (vol->cache == NULL) {
+        return mount_fail(vol);
+    }
+
+    if (opts->dedup) {
+        vol->dedup = dedup_create(vol->sb.data_blocks_count, vol->block_size);
+        if (vol->dedup == NULL) {
+            return mount_fail(vol);
+        }
+    }
+
+    vol->free_map = freemap_create(vol->sb.data_blocks_count);
+    if (vol->free_map == NULL) {
+        return mount_fail(vol);
+    }
+
+    // with a mapped disk, the root directory and fat table are used in place
+    if (vol->mapped) {
+        vol->rd = map_block(vol, vol->sb.root_directory_block_index);
+        vol->fat_table = map_block(vol, 1);
+        for (size_t fb=0; fb<vol->sb.fat_blocks_count; fb++) {
+            index_fat_block(vol, fb);
+        }
+        check_free_entries(vol);
+        check_free_count(vol);
+        return vol;
+    }
+
+    // create root directory and read into it
+    vol->rd = (struct root_dir*)alloc_blocks(vol, 1);
+    // create fat table, whose blocks are loaded as they are needed unless
+    // all of them are read at once
+    vol->fat_table = alloc_blocks(vol, vol->sb.fat_blocks_count);
+    vol->fat_dirty = calloc(vol->sb.fat_blocks_count, 1);
+    if (vol->rd == NULL || vol->fat_table == NULL || vol->fat_dirty == NULL ||
+        cache_read_range(vol->cache, vol->sb.root_directory_block_index * vol->spb,
+                         vol->spb, vol->rd) == -1) {
+        return mount_fail(vol);
+    }
+    check_free_entries(vol);
+    if (opts->fat_load == FS_FAT_EAGER) {
+        if (cache_read_range(vol->cache, vol->spb, vol->sb.fat_blocks_count * vol->spb,
+                             vol->fat_table) == -1) {
+            return mount_fail(vol);
+        }
+        for (size_t fb=0; fb<vol->sb.fat_blocks_count; fb++) {
+            index_fat_block(vol, fb);
+        }
+        check_free_count(vol);
+    } else {
+        vol->fat_loaded = calloc(vol->sb.fat_blocks_count, 1);
+        vol->fat_unloaded = vol->sb.fat_blocks_count;
+        if (vol->fat_loaded == NULL) {
+            return mount_fail(vol);
+        }
+    }
+
+    if (checksums && !(vol->sb.features & FS_FEATURE_CSUM) &&
+        enable_checksums(vol) == -1) {
+        return mount_fail(vol);
     }
 
-    // read into super block
-    block_read(0, (void*)&sb);
+    if (journal && vol->journal == NULL && enable_journal(vol, opts->journal_blocks) == -1) {
+        return mount_fail(vol);
+    }
+
+    if (opts->writeback.enabled && start_writeback(vol, &opts->writeback) == -1) {
+        return mount_fail(vol);
+    }
+
+    // best effort, blocks are still loaded on first touch otherwise
+    if (opts->fat_load == FS_FAT_PREFETCH && vol->fat_loaded != NULL &&
+        pthread_create(&vol->prefetch_thread, NULL, prefetch_fat, vol) == 0) {
+        vol->prefetching = 1;
+    }
+
+    return vol;
+}
+
+/**
+ * fs_mount - Mount a file system
+ * @diskname: Name of the virtual disk file
+ *
+ * Open the virtual disk file @diskname and mount the file system that it
+ * contains. A file system needs to be mounted before files can be read from it
+ * with fs_read() or written to it with fs_write().
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_mount(const char *diskname)
+{
+    return fs_mount_with(diskname, NULL);
+}
+
+/**
+ * fs_mount_with - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Same as fs_mount(), but the virtual disk file is accessed as described by
+ * @opts.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_mount_with(const char *diskname, const struct fs_mount_opts *opts)
+{
+    // only one file system can be mounted as the default volume
+    if (default_vol != NULL) {
+        return -1;
+    }
+    default_vol = fs_mount_ex(diskname, opts);
+    return default_vol == NULL ? -1 : 0;
+}
+
+int fs_format(const char *diskname, size_t data_blocks, size_t block_size)
+{
+    // the block size is a power of two that spans whole disk blocks
+    if (diskname == NULL || block_size < FS_BLOCK_SIZE_MIN || block_size > FS_BLOCK_SIZE_MAX ||
+        (block_size & (block_size - 1)) != 0){
+        return -1;
+    }
+    size_t fat_blocks = (data_blocks * sizeof(uint16_t) + block_size - 1) / block_size;
+    size_t total = 2 + fat_blocks + data_blocks;
+    if (data_blocks == 0 || data_blocks >= FAT_EOC || total > UINT16_MAX){
+        return -1;
+    }
+    size_t spb = block_size / BLOCK_SIZE;
+
+    // the new disk reads as zeros, only the superblock and the first FAT
+    // entry need to be written
+    int fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        return -1;
+    }
+    int ret = ftruncate(fd, (off_t)total * block_size);
+    close(fd);
+    if (ret == -1){
+        return -1;
+    }
+
+    struct disk *disk = disk_open(diskname, BLOCK_BACKEND_FILE);
+    uint16_t *fat = block_buf_alloc(1);
+    super_block *sb = block_buf_alloc(1);
+    ret = -1;
+    if (disk == NULL || fat == NULL || sb == NULL){
+        goto out;
+    }
+
+    memset(sb, 0, sizeof(*sb));
+    memcpy(sb->signature, "ECS150FS", 8);
+    sb->virtual_disk_blocks_count = total;
+    sb->fat_blocks_count = fat_blocks;
+    sb->root_directory_block_index = 1 + fat_blocks;
+    sb->data_block_start_index = 2 + fat_blocks;
+    sb->data_blocks_count = data_blocks;
+    // 4 KiB file systems keep the original format
+    if (block_size != 4096){
+        sb->block_shift = __builtin_ctzl(block_size);
+    }
+    // every data block but the reserved one is free
+    sb->features = FS_FEATURE_COUNTS;
+    sb->free_blocks_count = data_blocks - 1;
+    sb->free_entries_count = FS_FILE_MAX_COUNT;
+
+    // entry 0 is reserved
+    memset(fat, 0, BLOCK_SIZE);
+    fat[0] = FAT_EOC;
+    if (disk_write(disk, 0, sb) == 0 && disk_write(disk, spb, fat) == 0){
+        ret = disk_sync_range(disk, 0, disk_count(disk));
+    }
+
+out:
+    block_buf_free(sb);
+    block_buf_free(fat);
+    if (disk != NULL && disk_close(disk) == -1){
+        ret = -1;
+    }
+    return ret;
+}
+
+// fs_flush_ex() with the lock of @vol held
+static int flush_volume(fs_volume_t *vol)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    // a mapped disk is modified in place, except for the superblock
+    if (!vol->mapped) {
+        // the superblock, the FAT blocks and the root directory that changed
+        // are written together, in one run with 4 KiB blocks if they are
+        // contiguous. only the first disk block of the superblock is used
+        size_t nfat = vol->sb.fat_blocks_count * vol->spb;
+        struct block_iovec *bvec = malloc(sizeof(struct block_iovec) * (nfat + vol->spb + 1));
+        if (bvec == NULL){
+            return -1;
+        }
+        size_t n = 0;
+        for (size_t i=0; i<nfat; i++){
+            if (!vol->fat_dirty[i / vol->spb]){
+                continue;
+            }
+            bvec[n].block = vol->spb + i;
+            bvec[n++].buf = (char*)vol->fat_table + i * BLOCK_SIZE;
+        }
+        for (size_t i=0; vol->rd_dirty && i<vol->spb; i++, n++){
+            bvec[n].block = vol->sb.root_directory_block_index * vol->spb + i;
+            bvec[n].buf = (char*)vol->rd + i * BLOCK_SIZE;
+        }
+        if (vol->sb_dirty){
+            bvec[n].block = 0;
+            bvec[n++].buf = &vol->sb;
+        }
+        block_iovec_sort(bvec, n);
+        // with a journal, the blocks are logged before they are written in
+        // place, and after the data blocks they point to
+        if (n > 0 && vol->journal != NULL &&
+            (cache_flush(vol->cache) == -1 || journal_commit(vol->journal, bvec, n) == -1)){
+            free(bvec);
+            return -1;
+        }
+        if (n > 0 && cache_writev(vol->cache, bvec, n) == 0){
+            memset(vol->fat_dirty, 0, vol->sb.fat_blocks_count);
+            vol->rd_dirty = 0;
+            vol->sb_dirty = 0;
+        }
+        free(bvec);
+    } else if (vol->sb_dirty && cache_write(vol->cache, 0, &vol->sb) == 0){
+        vol->sb_dirty = 0;
+    }
+    // the root directory of a mapped disk is written in place
+    if (vol->mapped){
+        vol->rd_dirty = 0;
+    }
+    if (!vol->sb_dirty && !vol->rd_dirty){
+        vol->meta_dirtied = 0;
+    }
+
+    if (cache_flush(vol->cache) == -1 || vol->fat_error){
+        return -1;
+    }
+    return disk_csum_sync(vol->disk);
+}
+
+/**
+ * fs_flush_ex - Write back cached changes of a volume
+ * @vol: Volume
+ *
+ * Write the root directory, the FAT and all the data blocks modified since
+ * they were last written back to the virtual disk file of @vol.
+ *
+ * Return: -1 if @vol is NULL, or if any block cannot be written. 0 otherwise.
+ */
+int fs_flush_ex(fs_volume_t *vol)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    int ret = flush_volume(vol);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+int fs_flush(void)
+{
+    return fs_flush_ex(default_vol);
+}
+
+/**
+ * fs_sync_ex - Make the changes of a volume durable
+ * @vol: Volume
+ *
+ * Write back volume @vol like fs_flush_ex(), then flush the virtual disk file
+ * to stable storage. Concurrent callers are served together (group commit): a
+ * single caller at a time writes back the volume and flushes the disk, while
+ * the others wait. Once it is done, the callers that were waiting are all
+ * covered by the next write-back and flush, run by one of them. A sync that
+ * is already running when fs_sync_ex() is called may have written back the
+ * volume before the changes of the caller, so it does not count.
+ *
+ * Return: -1 if @vol is NULL, or if the write-back or the disk flush fails. 0
+ * otherwise.
+ */
+int fs_sync_ex(fs_volume_t *vol)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    vol->sync_stats.requests++;
+    unsigned long target = vol->syncs_started + 1;
+    while (vol->syncs_done < target){
+        if (vol->syncing){
+            pthread_cond_wait(&vol->sync_done_cond, &vol->lock);
+            continue;
+        }
+
+        // lead the next sync, for all the callers waiting so far
+        vol->syncing = 1;
+        unsigned long id = ++vol->syncs_started;
+        vol->sync_stats.commits++;
+        int ret = flush_volume(vol);
+
+        // the volume can be used while the disk is flushed, new callers queue
+        // up for the next sync. a disk in memory is flushed from the memory
+        // that the volume changes, so it stays locked
+        int locked = disk_map(vol->disk, 0) != NULL;
+        if (!locked){
+            pthread_mutex_unlock(&vol->lock);
+        }
+        if (ret == 0){
+            ret = disk_sync_range(vol->disk, 0, disk_count(vol->disk));
+        }
+        if (!locked){
+            pthread_mutex_lock(&vol->lock);
+        }
+
+        vol->syncing = 0;
+        vol->syncs_done = id;
+        vol->sync_ret = ret;
+        pthread_cond_broadcast(&vol->sync_done_cond);
+    }
+    int ret = vol->sync_ret;
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+int fs_sync(void)
+{
+    return fs_sync_ex(default_vol);
+}
+
+/**
+ * fs_sync_stats_ex - Get group commit counters of a volume
+ * @vol: Volume
+ * @stats: Counters to fill in
+ *
+ * Return: -1 if @vol or @stats is NULL. 0 otherwise.
+ */
+int fs_sync_stats_ex(fs_volume_t *vol, struct fs_sync_stats *stats)
+{
+    if (vol == NULL || stats == NULL){
+        return -1;
+    }
+    pthread_mutex_lock(&vol->lock);
+    *stats = vol->sync_stats;
+    pthread_mutex_unlock(&vol->lock);
+    return 0;
+}
+
+/**
+ * fs_writeback_stats_ex - Get background writeback counters of a volume
+ * @vol: Volume
+ * @stats: Counters to fill in
+ *
+ * Return: -1 if @vol or @stats is NULL. 0 otherwise.
+ */
+int fs_writeback_stats_ex(fs_volume_t *vol, struct fs_writeback_stats *stats)
+{
+    if (vol == NULL || stats == NULL){
+        return -1;
+    }
+    pthread_mutex_lock(&vol->lock);
+    *stats = vol->wb_stats;
+    pthread_mutex_unlock(&vol->lock);
+    return 0;
+}
+
+/**
+ * fs_journal_stats_ex - Get journal counters of a volume
+ * @vol: Volume
+ * @stats: Counters to fill in
+ *
+ * Return: -1 if @vol or @stats is NULL. 0 otherwise.
+ */
+int fs_journal_stats_ex(fs_volume_t *vol, struct journal_stats *stats)
+{
+    if (vol == NULL || stats == NULL){
+        return -1;
+    }
+    pthread_mutex_lock(&vol->lock);
+    if (vol->journal != NULL){
+        journal_stats_get(vol->journal, stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+    pthread_mutex_unlock(&vol->lock);
+    return 0;
+}
+
+/**
+ * fs_umount_ex - Unmount a volume
+ * @vol: Volume
+ *
+ * Write back volume @vol, close its virtual disk file and release it. @vol
+ * cannot be used anymore afterwards.
+ *
+ * Return: -1 if @vol is NULL, or if there are still open file descriptors on
+ * @vol, or if @vol cannot be written back or the virtual disk cannot be closed,
+ * in which case @vol is released all the same. 0 otherwise.
+ */
+int fs_umount_ex(fs_volume_t *vol)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    if (vol->open_files > 0){
+        return -1;
+    }
+
+    // write all meta info and file data to disk, then empty the journal so
+    // that the disk can be used without it. the volume goes away either way
+    stop_prefetch(vol);
+    stop_writeback(vol);
+    int ret = flush_volume(vol);
+    if (ret == 0 && vol->journal != NULL &&
+        journal_checkpoint(vol->journal) == -1){
+        ret = -1;
+    }
+    cache_destroy(vol->cache);
+    dedup_destroy(vol->dedup);
+    free_refs(vol);
+    journal_close(vol->journal);
+    if (!vol->mapped) {
+        block_buf_free(vol->fat_table);
+        block_buf_free(vol->rd);
+    }
+    free(vol->fat_loaded);
+    free(vol->fat_dirty);
+    freemap_destroy(vol->free_map);
+
+    if (disk_close(vol->disk) == -1){
+        ret = -1;
+    }
+    pthread_cond_destroy(&vol->sync_done_cond);
+    pthread_mutex_destroy(&vol->lock);
+    free(vol);
+    return ret;
+}
+
+int fs_umount(void)
+{
+    if (default_vol == NULL || default_vol->open_files > 0){
+        return -1;
+    }
+
+    // keep the counters of the default volume around for fs_cache_stats()
+    fs_cache_stats_ex(default_vol, &last_stats);
+    int ret = fs_umount_ex(default_vol);
+    default_vol = NULL;
+    return ret;
+}
+
+/**
+ * fs_cache_stats_ex - Get block cache counters of a volume
+ * @vol: Volume
+ * @stats: Counters to fill in
+ *
+ * Return: -1 if @vol or @stats is NULL. 0 otherwise.
+ */
+int fs_cache_stats_ex(fs_volume_t *vol, struct cache_stats *stats)
+{
+    if (vol == NULL || stats == NULL){
+        return -1;
+    }
+    pthread_mutex_lock(&vol->lock);
+    cache_stats_get(vol->cache, stats);
+    pthread_mutex_unlock(&vol->lock);
+    return 0;
+}
+
+int fs_cache_stats(struct cache_stats *stats)
+{
+    if (stats == NULL){
+        return -1;
+    }
+    if (default_vol == NULL){
+        *stats = last_stats;
+        return 0;
+    }
+    return fs_cache_stats_ex(default_vol, stats);
+}
+
+// helper functions
+static int get_fat_free_blocks(fs_volume_t *vol){
+    // Entries marked as 0 correspond to free data blocks. they are counted
+    // in the superblock, unless it comes from another implementation and the
+    // FAT was not loaded yet
+    if (!(vol->sb.features & FS_FEATURE_COUNTS)){
+        fat_load_all(vol);
+    }
+    if (!(vol->sb.features & FS_FEATURE_COUNTS)){
+        return freemap_count(vol->free_map);
+    }
+    return vol->sb.free_blocks_count;
+}
+
+static int get_rdir_free_blocks(fs_volume_t *vol){
+    // An empty entry is defined by the first character of the entry’s
+    // filename being equal to the NULL character, counted in the superblock
+    return vol->sb.free_entries_count;
+}
+
+// an entry of the root directory was taken (@delta = -1) or freed (+1)
+static void count_free_entry(fs_volume_t *vol, int delta){
+    vol->sb.free_entries_count += delta;
+    if (vol->sb.features & FS_FEATURE_COUNTS){
+        vol->sb_dirty = 1;
+    }
+}
+
+// returns the root directory index of file @filename, or -1 if it does not exist
+static int get_rdir_index(fs_volume_t *vol, const char *filename){
+    for (int i=0; i<FS_FILE_MAX_COUNT; i++){
+        if (vol->rd[i].filename[0] != '\0' && strncmp(vol->rd[i].filename, filename, FS_FILENAME_LEN) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// returns the root directory entry of open file descriptor @fd, or NULL if @vol or @fd is invalid
+static struct root_dir *get_fd_entry(fs_volume_t *vol, int fd){
+    if (vol == NULL || fd >= FS_OPEN_MAX_COUNT || fd < 0 || vol->file_d[fd].filename[0] == '\0'){
+        return NULL;
+    }
+    int i = get_rdir_index(vol, vol->file_d[fd].filename);
+    if (i == -1){
+        return NULL;
+    }
+    return &vol->rd[i];
+}
+
+// returns the number of blocks of the chain starting at @start
+static size_t chain_length(fs_volume_t *vol, uint16_t start){
+    size_t n = 0;
+    for (uint16_t i=start; i!=FAT_EOC && n<vol->sb.data_blocks_count; i=fat_get(vol, i)){
+        n++;
+    }
+    return n;
+}
+
+// release the storage of the @count data blocks of @bvec, one run of
+// contiguous blocks at a time. blocks are released on a best effort basis
+static void release_data_blocks(fs_volume_t *vol, struct block_iovec *bvec, size_t count){
+    block_iovec_sort(bvec, count);
+    size_t run;
+    for (size_t i=0; i<count; i+=run){
+        run = 1;
+        while (i + run < count && bvec[i + run].block == bvec[i].block + run){
+            run++;
+        }
+        cache_discard(vol->cache, bvec[i].block * vol->spb, run * vol->spb);
+    }
+}
+
+// used by the deduplication helpers, defined with the data path below
+static uint16_t alloc_data_block(fs_volume_t *vol, size_t hint);
+static size_t run_hint(fs_volume_t *vol, size_t hint, size_t len);
+static int blocks_io(fs_volume_t *vol, struct block_iovec *bvec, size_t nblocks, int write);
+
+// count the references to each data block of @vol, from the FAT and from the
+// root directory, and list the predecessors of each block. only blocks shared
+// between files have more than one reference. fat_set() and set_first_block()
+// keep them up to date from then on. returns -1 if they cannot be built
+static int build_refs(fs_volume_t *vol){
+    if (vol->refs != NULL){
+        return 0;
+    }
+    size_t n = vol->sb.data_blocks_count;
+    vol->refs = calloc(n, sizeof(uint32_t));
+    vol->pred_first = malloc(sizeof(uint16_t) * (n + 1));
+    vol->pred_next = malloc(sizeof(uint16_t) * n);
+    vol->pred_prev = malloc(sizeof(uint16_t) * n);
+    if (vol->refs == NULL || vol->pred_first == NULL || vol->pred_next == NULL ||
+        vol->pred_prev == NULL){
+        free_refs(vol);
+        return -1;
+    }
+    for (size_t i=0; i<=n; i++){
+        vol->pred_first[i] = FAT_EOC;
+    }
+    // entry 0 is reserved
+    for (size_t i=1; i<n; i++){
+        move_ref(vol, i, 0, fat_get(vol, i));
+    }
+    for (int i=0; i<FS_FILE_MAX_COUNT; i++){
+        if (vol->rd[i].filename[0] != '\0' &&
+            vol->rd[i].first_data_block_index < n){
+            vol->refs[vol->rd[i].first_data_block_index]++;
+        }
+    }
+    // entries that could not be loaded would be counted wrong
+    if (vol->fat_error){
+        free_refs(vol);
+        return -1;
+    }
+    return 0;
+}
+
+// the root directory entry of a file stops (@delta = -1) or starts (+1)
+// referencing first block @b
+static void ref_first_block(fs_volume_t *vol, uint16_t b, int delta){
+    if (vol->refs != NULL && b < vol->sb.data_blocks_count){
+        vol->refs[b] += delta;
+    }
+}
+
+// make block @b the first one of file @entry
+static void set_first_block(fs_volume_t *vol, struct root_dir *entry, uint16_t b){
+    ref_first_block(vol, entry->first_data_block_index, -1);
+    ref_first_block(vol, b, 1);
+    entry->first_data_block_index = b;
+    vol->rd_dirty = 1;
+}
+
+// mark in @marks the blocks of the uncompressed files other than @skip, and
+// count the marked blocks with and without the ones shared between files
+static void mark_file_blocks(fs_volume_t *vol, uint8_t *marks, const struct root_dir *skip,
+                             size_t *physical, size_t *logical){
+    *physical = *logical = 0;
+    for (int i=0; i<FS_FILE_MAX_COUNT; i++){
+        if (vol->rd[i].filename[0] == '\0' || &vol->rd[i] == skip ||
+            (vol->rd[i].flags & RD_COMPRESSED)){
+            continue;
+        }
+        size_t n = 0;
+        for (uint16_t b=vol->rd[i].first_data_block_index;
+             b!=FAT_EOC && n<vol->sb.data_blocks_count; b=fat_get(vol, b)){
+            if (!marks[b]){
+                marks[b] = 1;
+                (*physical)++;
+            }
+            n++;
+        }
+        *logical += n;
+    }
+}
+
+// free the chain starting at @start, except for the blocks that are still
+// shared with other files. the freed blocks are added to @freed if not NULL,
+// which has room for all data blocks. returns the number of freed blocks
+static size_t free_chain(fs_volume_t *vol, uint16_t start, struct block_iovec *freed){
+    if ((vol->sb.features & FS_FEATURE_DEDUP) && build_refs(vol) == -1){
+        return 0; // leaking blocks is better than freeing shared ones
+    }
+
+    // freeing a block drops the reference to the next one
+    size_t n = 0;
+    uint16_t b = start;
+    while (b != FAT_EOC && (vol->refs == NULL || vol->refs[b] == 0)){
+        uint16_t next = fat_get(vol, b);
+        fat_set(vol, b, 0);
+        if (vol->dedup != NULL){
+            dedup_forget(vol->dedup, b);
+        }
+        if (freed != NULL){
+            freed[n].block = b + vol->sb.data_block_start_index;
+        }
+        n++;
+        b = next;
+    }
+    return n;
+}
+
+// copy-on-write: give file @entry its own copy of the blocks that it shares
+// with other files, up to block number @last of its chain (or up to its last
+// block, whose FAT entry changes when the file grows). the blocks after them
+// stay shared. returns -1 if the disk is full, leaving the chain untouched
+static int unshare_chain(fs_volume_t *vol, struct root_dir *entry, size_t last){
+    if (!(vol->sb.features & FS_FEATURE_DEDUP)){
+        return 0;
+    }
+    if (build_refs(vol) == -1){
+        return -1;
+    }
+
+    // every block after the first shared one is shared as well
+    uint16_t prev = FAT_EOC;
+    uint16_t b = entry->first_data_block_index;
+    size_t pos = 0;
+    while (b != FAT_EOC && pos <= last && vol->refs[b] <= 1){
+        prev = b;
+        b = fat_get(vol, b);
+        pos++;
+    }
+    if (b == FAT_EOC || pos > last){
+        return 0;
+    }
+
+    size_t n = 0;
+    for (uint16_t i=b; i!=FAT_EOC && pos + n<=last; i=fat_get(vol, i)){
+        n++;
+    }
+    struct block_iovec *bvec = malloc(sizeof(struct block_iovec) * n);
+    uint16_t *copies = malloc(sizeof(uint16_t) * n);
+    char *data = alloc_blocks(vol, n);
+    int ret = -1;
+    size_t allocated = 0;
+    if (bvec == NULL || copies == NULL || data == NULL){
+        goto out;
+    }
+
+    uint16_t old = b;
+    for (size_t i=0; i<n; i++){
+        bvec[i].block = old + vol->sb.data_block_start_index;
+        bvec[i].buf = data + i * vol->block_size;
+        old = fat_get(vol, old);
+    }
+    if (blocks_io(vol, bvec, n, 0) == -1){
+        goto out;
+    }
+
+    size_t hint = run_hint(vol, prev == FAT_EOC ? 1 : prev + 1, n);
+    for (; allocated<n; allocated++){
+        copies[allocated] = alloc_data_block(vol, hint);
+        if (copies[allocated] == FAT_EOC){
+            goto out;
+        }
+        bvec[allocated].block = copies[allocated] + vol->sb.data_block_start_index;
+        hint = copies[allocated] + 1;
+    }
+    if (blocks_io(vol, bvec, n, 1) == -1){
+        goto out;
+    }
+
+    // link the copies in place of the shared blocks, the last one to the
+    // block that followed the last shared block
+    for (size_t i=0; i+1<n; i++){
+        fat_set(vol, copies[i], copies[i + 1]);
+    }
+    fat_set(vol, copies[n - 1], old);
+    if (prev == FAT_EOC){
+        set_first_block(vol, entry, copies[0]);
+    } else {
+        fat_set(vol, prev, copies[0]);
+    }
+    ret = 0;
+
+out:
+    if (ret == -1){
+        for (size_t i=0; i<allocated; i++){
+            fat_set(vol, copies[i], 0);
+        }
+    }
+    block_buf_free(data);
+    free(copies);
+    free(bvec);
+    return ret;
+}
+
+// index the blocks of other files (marked in @owned) followed by block @next,
+// reading the ones whose content is not known yet into @buf
+static void index_predecessors(fs_volume_t *vol, uint16_t next, const uint8_t *owned, char *buf){
+    size_t slot = next == FAT_EOC ? vol->sb.data_blocks_count : next;
+    for (uint16_t p=vol->pred_first[slot]; p!=FAT_EOC; p=vol->pred_next[p]){
+        if (!owned[p]){
+            continue;
+        }
+        uint32_t hash;
+        if (!dedup_hashed(vol->dedup, p, &hash)){
+            struct block_iovec bvec = { .block = p + vol->sb.data_block_start_index, .buf = buf };
+            if (blocks_io(vol, &bvec, 1, 0) == -1){
+                continue;
+            }
+            dedup_hash(vol->dedup, p, buf);
+        }
+        dedup_insert(vol->dedup, p, next);
+    }
+}
+
+// find a block of another file (marked in @owned) with the same content as
+// block @b and followed by block @next. @mine and @theirs are buffers of one
+// block. returns FAT_EOC if there is none
+static uint16_t find_duplicate(fs_volume_t *vol, uint16_t b, uint16_t next, const uint8_t *owned,
+                               char *mine, char *theirs){
+    struct block_iovec bvec = { .block = b + vol->sb.data_block_start_index, .buf = mine };
+    uint32_t hash;
+    int loaded = 0;
+    if (!dedup_hashed(vol->dedup, b, &hash)){
+        if (blocks_io(vol, &bvec, 1, 0) == -1){
+            return FAT_EOC;
+        }
+        hash = dedup_hash(vol->dedup, b, mine);
+        loaded = 1;
+    }
+
+    size_t cands[8];
+    size_t n = dedup_lookup(vol->dedup, hash, next, cands, 8);
+    if (n == 0){
+        index_predecessors(vol, next, owned, theirs);
+        n = dedup_lookup(vol->dedup, hash, next, cands, 8);
+    }
+
+    // candidates may be stale, or share the hash only
+    for (size_t i=0; i<n; i++){
+        uint16_t c = cands[i];
+        if (c == b || !owned[c] || fat_get(vol, c) != next){
+            continue;
+        }
+        if (!loaded){
+            if (blocks_io(vol, &bvec, 1, 0) == -1){
+                return FAT_EOC;
+            }
+            loaded = 1;
+        }
+        struct block_iovec other = { .block = c + vol->sb.data_block_start_index, .buf = theirs };
+        if (blocks_io(vol, &other, 1, 0) == 0 && memcmp(mine, theirs, vol->block_size) == 0){
+            return c;
+        }
+    }
+    return FAT_EOC;
+}
+
+// share the end of the chain of file @entry with other files: from its last
+// block backwards, each block is replaced by an identical block of another
+// file followed by the same blocks, until there is none. the blocks left are
+// indexed for the files closed later. returns the number of freed blocks
+static size_t merge_chain(fs_volume_t *vol, struct root_dir *entry){
+    size_t len = chain_length(vol, entry->first_data_block_index);
+    uint16_t *chain = malloc(sizeof(uint16_t) * (len + 1));
+    uint8_t *owned = calloc(vol->sb.data_blocks_count, 1);
+    char *mine = alloc_blocks(vol, 1);
+    char *theirs = alloc_blocks(vol, 1);
+    struct block_iovec *freed = vol->sparse ? malloc(sizeof(struct block_iovec) * (len + 1)) : NULL;
+    size_t merged = 0;
+    if (chain == NULL || owned == NULL || mine == NULL || theirs == NULL ||
+        (vol->sparse && freed == NULL) || build_refs(vol) == -1){
+        goto out;
+    }
+
+    size_t physical, logical;
+    mark_file_blocks(vol, owned, entry, &physical, &logical);
+
+    // the blocks from the first one already shared on stay as they are
+    size_t k = 0;
+    for (uint16_t b=entry->first_data_block_index; k<len; b=fat_get(vol, b)){
+        chain[k++] = b;
+    }
+    size_t shared = 0;
+    while (shared < len && vol->refs[chain[shared]] <= 1){
+        shared++;
+    }
+
+    uint16_t next = shared < len ? chain[shared] : FAT_EOC;
+    for (k=shared; k>0; k--){
+        uint16_t b = chain[k - 1];
+        uint16_t dup = find_duplicate(vol, b, next, owned, mine, theirs);
+        if (dup == FAT_EOC){
+            break;
+        }
+        if (k == 1){
+            set_first_block(vol, entry, dup);
+        } else {
+            fat_set(vol, chain[k - 2], dup);
+        }
+        fat_set(vol, b, 0);
+        dedup_forget(vol->dedup, b);
+        if (freed != NULL){
+            freed[merged].block = b + vol->sb.data_block_start_index;
+        }
+        merged++;
+        next = dup;
+    }
+
+    for (size_t i=0; i<k; i++){
+        dedup_insert(vol->dedup, chain[i], fat_get(vol, chain[i]));
+    }
+    if (merged > 0 && !(vol->sb.features & FS_FEATURE_DEDUP)){
+        vol->sb.features |= FS_FEATURE_DEDUP;
+        vol->sb_dirty = 1;
+    }
+    if (freed != NULL){
+        release_data_blocks(vol, freed, merged);
+    }
+
+out:
+    free(freed);
+    block_buf_free(theirs);
+    block_buf_free(mine);
+    free(owned);
+    free(chain);
+    return merged;
+}
+
+// end helper functions
+
+// fs_info_ex() with the lock of @vol held
+static int info_volume(fs_volume_t *vol)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    int fat_free = get_fat_free_blocks(vol);
+    int rdir_free = get_rdir_free_blocks(vol);
+    printf("FS Info:\n");
+    printf("total_blk_count=%d\n", vol->sb.virtual_disk_blocks_count);
+    printf("fat_blk_count=%d\n", vol->sb.fat_blocks_count);
+    printf("rdir_blk=%d\n", vol->sb.root_directory_block_index);
+    printf("data_blk=%d\n", vol->sb.data_block_start_index);
+    printf("data_blk_count=%d\n", vol->sb.data_blocks_count);
+    printf("fat_free_ratio=%d/%d\n", fat_free, vol->sb.data_blocks_count);
+    printf("rdir_free_ratio=%d/%d\n", rdir_free, FS_FILE_MAX_COUNT);
+    if (vol->block_size != 4096){
+        printf("blk_size=%zu\n", vol->block_size);
+    }
+
+    // blocks used by compressed files, over the blocks their data would use
+    size_t stored = 0, logical = 0;
+    for (int i=0; i<FS_FILE_MAX_COUNT; i++){
+        if (vol->rd[i].filename[0] != '\0' && (vol->rd[i].flags & RD_COMPRESSED)){
+            stored += chain_length(vol, vol->rd[i].first_data_block_index);
+            logical += (vol->rd[i].file_size + vol->block_size - 1) / vol->block_size;
+        }
+    }
+    if (logical > 0){
+        printf("compress_ratio=%zu/%zu\n", stored, logical);
+    }
+
+    // blocks used by uncompressed files, over the blocks they would use
+    // without sharing
+    if (vol->sb.features & FS_FEATURE_DEDUP){
+        uint8_t *marks = calloc(vol->sb.data_blocks_count, 1);
+        if (marks != NULL){
+            mark_file_blocks(vol, marks, NULL, &stored, &logical);
+            printf("dedup_ratio=%zu/%zu\n", stored, logical);
+            free(marks);
+        }
+    }
+    return 0;
+}
+
+/**
+ * fs_info_ex - Display information about file system
+ * @vol: Volume
+ *
+ * Display some information about the file system of volume @vol.
+ *
+ * Return: -1 if @vol is NULL. 0 otherwise.
+ */
+int fs_info_ex(fs_volume_t *vol)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    int ret = info_volume(vol);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+int fs_info(void)
+{
+    return fs_info_ex(default_vol);
+}
+
+/**
+ * fs_statfs_ex - Get space usage of a volume
+ * @vol: Volume
+ * @st: Space usage to fill in
+ *
+ * Return: -1 if @vol or @st is NULL. 0 otherwise.
+ */
+int fs_statfs_ex(fs_volume_t *vol, struct fs_statfs *st)
+{
+    if (vol == NULL || st == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    st->block_size = vol->block_size;
+    st->total_blocks = vol->sb.virtual_disk_blocks_count;
+    st->data_blocks = vol->sb.data_blocks_count;
+    st->free_blocks = get_fat_free_blocks(vol);
+    st->files = FS_FILE_MAX_COUNT;
+    st->free_files = get_rdir_free_blocks(vol);
+    pthread_mutex_unlock(&vol->lock);
+    return 0;
+}
+
+int fs_statfs(struct fs_statfs *st)
+{
+    return fs_statfs_ex(default_vol, st);
+}
+
+// fs_create_ex() with the lock of @vol held
+static int create_file(fs_volume_t *vol, const char *filename)
+{
+    if (vol == NULL || filename == NULL || strlen(filename) >= FS_FILENAME_LEN){
+        return -1;
+    }
+
+    if (get_rdir_index(vol, filename) != -1){
+        return -1;
+    }
+
+    // iterate over root directory
+    for (int i=0; i<FS_FILE_MAX_COUNT; i++){
+        if (vol->rd[i].filename[0] == '\0'){
+           // found empty entry, now fill it with file name, set size to 0, and set index to FAT_EOC
+           memset(vol->rd[i].filename, '\0', FS_FILENAME_LEN);
+           strcpy(vol->rd[i].filename, filename);
+           vol->rd[i].file_size = 0;
+           vol->rd[i].first_data_block_index = FAT_EOC;
+           vol->rd[i].flags = vol->compress ? RD_COMPRESSED : 0;
+           vol->rd_dirty = 1;
+           count_free_entry(vol, -1);
+           return 0;
+        }
+    }
+
+    // root directory already contains FS_FILE_MAX_COUNT files
+    return -1;
+}
+
+/**
+ * fs_create_ex - Create a new file
+ * @vol: Volume
+ * @filename: File name
+ *
+ * Create a new and empty file named @filename in the root directory of the
+ * file system of @vol. String @filename must be NULL-terminated and its total
+ * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
+ * character).
+ *
+ * Return: -1 if @vol is NULL, or if @filename is invalid, or if a
+ * file named @filename already exists, or if string @filename is too long, or
+ * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ */
+int fs_create_ex(fs_volume_t *vol, const char *filename)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    int ret = create_file(vol, filename);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+int fs_create(const char *filename)
+{
+    return fs_create_ex(default_vol, filename);
+}
+
+// fs_delete_ex() with the lock of @vol held
+static int delete_file(fs_volume_t *vol, const char *filename)
+{
+    if (vol == NULL || filename == NULL || strlen(filename) >= FS_FILENAME_LEN){
+        return -1;
+    }
+
+    int i = get_rdir_index(vol, filename);
+    if (i == -1){
+        return -1;
+    }
+
+    // cannot delete a file that is currently open
+    for (int fd=0; fd<FS_OPEN_MAX_COUNT; fd++){
+        if (strcmp(vol->file_d[fd].filename, filename) == 0){
+            return -1;
+        }
+    }
+
+    // set entry name back to null
+    uint16_t current_index = vol->rd[i].first_data_block_index;
+    ref_first_block(vol, current_index, -1);
+    memset(vol->rd[i].filename, '\0', FS_FILENAME_LEN);
+    vol->rd[i].flags = 0;
+    vol->rd_dirty = 1;
+    count_free_entry(vol, 1);
+
+    // freed blocks are collected to release their storage
+    struct block_iovec *freed = NULL;
+    if (vol->sparse){
+        freed = malloc(sizeof(struct block_iovec) * vol->sb.data_blocks_count);
+    }
+
+    // free FAT contents
+    size_t nfreed = free_chain(vol, current_index, freed);
+
+    if (freed != NULL){
+        release_data_blocks(vol, freed, nfreed);
+        free(freed);
+    }
+    return 0;
+}
+
+/**
+ * fs_delete_ex - Delete a file
+ * @vol: Volume
+ * @filename: File name
+ *
+ * Delete the file named @filename from the root directory of the file system
+ * of @vol.
+ *
+ * On file systems mounted with the sparse option, the storage of the file's
+ * data blocks is released in the virtual disk file. Data blocks shared with
+ * other files are kept.
+ *
+ * Return: -1 if @vol is NULL, or if @filename is invalid, if there is no file
+ * named @filename to delete, or if file @filename is currently open. 0
+ * otherwise.
+ */
+int fs_delete_ex(fs_volume_t *vol, const char *filename)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    int ret = delete_file(vol, filename);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+int fs_delete(const char *filename)
+{
+    return fs_delete_ex(default_vol, filename);
+}
+
+// fs_ls_ex() with the lock of @vol held
+static int list_files(fs_volume_t *vol)
+{
+    if (vol == NULL){
+        return -1;
+    }
+    printf("FS Ls:\n");
+    for (int i=0; i<FS_FILE_MAX_COUNT; i++){
+        if (vol->rd[i].filename[0] != '\0'){
+            printf("file: %s, size: %d, data_blk: %d\n", vol->rd[i].filename, vol->rd[i].file_size, vol->rd[i].first_data_block_index);
+        }
+    }
+    return 0;
+}
+
+/**
+ * fs_ls_ex - List files on file system
+ * @vol: Volume
+ *
+ * List information about the files located in the root directory.
+ *
+ * Return: -1 if @vol is NULL. 0 otherwise.
+ */
+int fs_ls_ex(fs_volume_t *vol)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    int ret = list_files(vol);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+int fs_ls(void)
+{
+    return fs_ls_ex(default_vol);
+}
+
+// fs_open_ex() with the lock of @vol held
+static int open_file(fs_volume_t *vol, const char *filename)
+{
+    if (vol == NULL || filename == NULL || strlen(filename) >= FS_FILENAME_LEN){
+        return -1;
+    }
+
+    if (get_rdir_index(vol, filename) == -1){
+        return -1;
+    }
+
+    // the same file can be opened multiple times, each with its own descriptor
+    for (int fd=0; fd<FS_OPEN_MAX_COUNT; fd++){
+       if (vol->file_d[fd].filename[0] == '\0'){
+           vol->open_files++;
+           strcpy(vol->file_d[fd].filename, filename);
+           vol->file_d[fd].offset = 0;
+           vol->file_d[fd].fd_return = fd;
+           return vol->file_d[fd].fd_return;
+       }
+    }
+
+    // already FS_OPEN_MAX_COUNT files open
+    return -1;
+}
+
+/**
+ * fs_open_ex - Open a file
+ * @vol: Volume
+ * @filename: File name
+ *
+ * Open file named @filename for reading and writing, and return the
+ * corresponding file descriptor. The file descriptor is a non-negative integer
+ * that is used subsequently to access the contents of the file. The file offset
+ * of the file descriptor is set to 0 initially (beginning of the file). If the
+ * same file is opened multiple files, fs_open() must return distinct file
+ * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
+ * simultaneously.
+ *
+ * Return: -1 if @vol is NULL, or if @filename is invalid, or if
+ * there is no file named @filename to open, or if there are already
+ * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
+ * descriptor.
+ */
+int fs_open_ex(fs_volume_t *vol, const char *filename)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    int ret = open_file(vol, filename);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+int fs_open(const char *filename)
+{
+    return fs_open_ex(default_vol, filename);
+}
+
+// fs_close_ex() with the lock of @vol held
+static int close_file(fs_volume_t *vol, int fd)
+{
+    struct root_dir *entry = get_fd_entry(vol, fd);
+    if (entry == NULL){
+        return -1;
+    }
+
+    int last_fd = 1;
+    for (int i=0; i<FS_OPEN_MAX_COUNT; i++){
+        if (i != fd && strcmp(vol->file_d[i].filename, vol->file_d[fd].filename) == 0){
+            last_fd = 0;
+        }
+    }
+    if (vol->dedup != NULL && last_fd && !(entry->flags & RD_COMPRESSED)){
+        merge_chain(vol, entry);
+    }
+
+    memset(vol->file_d[fd].filename, '\0', FS_FILENAME_LEN);
+    vol->file_d[fd].offset = 0;
+    vol->file_d[fd].fd_return = -1;
+    vol->open_files--;
+    return 0;
+}
+
+/**
+ * fs_close_ex - Close a file
+ * @vol: Volume
+ * @fd: File descriptor
+ *
+ * Close file descriptor @fd.
+ *
+ * On volumes mounted with the dedup option, the data blocks of the file are
+ * shared with identical files once its last file descriptor is closed.
+ *
+ * Return: -1 if @vol is NULL, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open). 0 otherwise.
+ */
+int fs_close_ex(fs_volume_t *vol, int fd)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    int ret = close_file(vol, fd);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+int fs_close(int fd)
+{
+    return fs_close_ex(default_vol, fd);
+}
+
+// fs_stat_ex() with the lock of @vol held
+static int stat_file(fs_volume_t *vol, int fd)
+{
+    struct root_dir *entry = get_fd_entry(vol, fd);
+    if(entry == NULL){
+        return -1;
+    }
+
+    return entry->file_size;
+}
+
+/**
+ * fs_stat_ex - Get file status
+ * @vol: Volume
+ * @fd: File descriptor
+ *
+ * Get the current size of the file pointed by file descriptor @fd.
+ *
+ * Return: -1 if @vol is NULL, of if file descriptor @fd is
+ * invalid (out of bounds or not currently open). Otherwise return the current
+ * size of file.
+ */
+int fs_stat_ex(fs_volume_t *vol, int fd)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    int ret = stat_file(vol, fd);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+int fs_stat(int fd)
+{
+    return fs_stat_ex(default_vol, fd);
+}
+
+// fs_lseek_ex() with the lock of @vol held
+static int lseek_file(fs_volume_t *vol, int fd, size_t offset)
+{
+    struct root_dir *entry = get_fd_entry(vol, fd);
+    if (entry == NULL || offset > entry->file_size){
+        return -1;
+    }
+    vol->file_d[fd].offset = offset;
+    return 0;
+}
+
+/**
+ * fs_lseek_ex - Set file offset
+ * @vol: Volume
+ * @fd: File descriptor
+ * @offset: File offset
+ *
+ * Set the file offset (used for read and write operations) associated with file
+ * descriptor @fd to the argument @offset. To append to a file, one can call
+ * fs_lseek(fd, fs_stat(fd));
+ *
+ * Return: -1 if @vol is NULL, or if file descriptor @fd is
+ * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
+ * than the current file size. 0 otherwise.
+ */
+int fs_lseek_ex(fs_volume_t *vol, int fd, size_t offset)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    int ret = lseek_file(vol, fd, offset);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+    return fs_lseek_ex(default_vol, fd, offset);
+}
+
+/**
+ * fs_fsync_ex - Make the changes of a file durable
+ * @vol: Volume
+ * @fd: File descriptor
+ *
+ * Same as fs_sync_ex(): files share the FAT and the root directory, so the
+ * whole volume is synchronized.
+ *
+ * Return: -1 if @vol is NULL, or if file descriptor @fd is invalid (out of
+ * bounds or not currently open), or if the synchronization fails. 0
+ * otherwise.
+ */
+int fs_fsync_ex(fs_volume_t *vol, int fd)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    struct root_dir *entry = get_fd_entry(vol, fd);
+    pthread_mutex_unlock(&vol->lock);
+    if (entry == NULL){
+        return -1;
+    }
+    return fs_sync_ex(vol);
+}
+
+int fs_fsync(int fd)
+{
+    return fs_fsync_ex(default_vol, fd);
+}
+
+// returns index of the data block holding block number @n of the chain starting at @file_start
+static uint16_t data_block_index(fs_volume_t *vol, size_t n, uint16_t file_start){
+    uint16_t index = file_start;
+    while(index != FAT_EOC && n > 0){
+        index = fat_get(vol, index);
+        n--;
+    }
+    return index;
+}
+
+// allocate a free data block, preferring @hint so that chains stay contiguous
+// returns FAT_EOC if the disk is full
+static uint16_t alloc_data_block(fs_volume_t *vol, size_t hint){
+    uint16_t b = FAT_EOC;
+    if (hint < vol->sb.data_blocks_count && fat_get(vol, hint) == 0){
+        b = hint;
+    } else {
+        // entry 0 is reserved, so the search starts at 1
+        size_t f = next_free_block(vol, 1);
+        if (f != FREEMAP_NONE){
+            b = f;
+        }
+    }
+    if (b != FAT_EOC){
+        fat_set(vol, b, FAT_EOC);
+        // whatever was known about the previous content is stale
+        if (vol->dedup != NULL){
+            dedup_forget(vol->dedup, b);
+        }
+    }
+    return b;
+}
+
+// where to allocate @len blocks so that they form a single run, preferably
+// from @hint on. returns @hint if there is no such run
+static size_t run_hint(fs_volume_t *vol, size_t hint, size_t len){
+    size_t b = free_run(vol, hint, len);
+    if (b == FREEMAP_NONE){
+        b = free_run(vol, 1, len);
+    }
+    return b == FREEMAP_NONE ? hint : b;
+}
+
+// point each block of @block_size bytes of a transfer of @count bytes at
+// @offset into @buf, except for partially covered first and last blocks which
+// go through @bounce (2 blocks). returns the number of bytes of the first block
+// going through @bounce, and sets @tail to the number of bytes of the last one
+static size_t setup_block_iovec(struct block_iovec *bvec, size_t nblocks, size_t block_size,
+                                size_t offset, size_t count, char *buf, char *bounce, size_t *tail){
+    size_t first = offset / block_size;
+    size_t byte_location = offset % block_size;
+    size_t end_location = (offset + count) % block_size;
+    size_t head = 0;
 
-    // error checking to verify that the file system has the expected format
-    // check that signature of file system is ECS150FS
-    if (memcmp("ECS150FS", sb.signature, 8) != 0) {
-        return -1;
+    for (size_t i=0; i<nblocks; i++){
+        bvec[i].buf = buf + (first + i) * block_size - offset;
     }
 
-    // check that the total number of block corresponds to what block_disk_count() returns
-    if (sb.virtual_disk_blocks_count != block_disk_count()) {
-        return -1;
+    *tail = 0;
+    if (byte_location != 0 || (nblocks == 1 && end_location != 0)){
+        head = nblocks == 1 ? count : block_size - byte_location;
+        bvec[0].buf = bounce;
+    }
+    if (nblocks > 1 && end_location != 0){
+        *tail = end_location;
+        bvec[nblocks - 1].buf = bounce + block_size;
     }
+    return head;
+}
 
-    // create root directory and read into it
-    rd = (struct root_dir*)malloc(sizeof(struct root_dir) * FS_FILE_MAX_COUNT);
-    block_read(sb.root_directory_block_index, rd);
+// transfer the blocks of @bvec with asynchronous requests, one per run of
+// contiguous blocks and buffers, submitting up to BLOCK_QUEUE_DEPTH of them
+// at once. returns -1 if any request fails
+static int transfer_blocks_async(fs_volume_t *vol, struct block_iovec *bvec, size_t nblocks, int write){
+    int tickets[BLOCK_QUEUE_DEPTH];
+    int ret = 0;
+    size_t i = 0;
 
-    // create fat table and read into it
-    fat_table = malloc(sizeof(uint16_t) * sb.fat_blocks_count * BLOCK_SIZE);
-    for (int i=0; i <= sb.fat_blocks_count; i++){
-        block_read(i+1, &fat_table[i*(BLOCK_SIZE/2)]);
+    while (i < nblocks && ret == 0){
+        int n = 0;
+        while (i < nblocks && n < BLOCK_QUEUE_DEPTH){
+            size_t len = 1;
+            while (i + len < nblocks && bvec[i + len].block == bvec[i].block + len &&
+                   bvec[i + len].buf == (char*)bvec[i].buf + len * BLOCK_SIZE){
+                len++;
+            }
+            if (write){
+                tickets[n] = disk_write_async(vol->disk, bvec[i].block, len, bvec[i].buf);
+            } else {
+                tickets[n] = disk_read_async(vol->disk, bvec[i].block, len, bvec[i].buf);
+            }
+            if (tickets[n] == -1){
+                ret = -1;
+                break;
+            }
+            n++;
+            i += len;
+        }
+
+        if (disk_submit(vol->disk) == -1){
+            ret = -1;
+        }
+        for (int k=0; k<n; k++){
+            if (disk_wait(vol->disk, tickets[k]) == -1){
+                ret = -1;
+            }
+        }
     }
-   
-    return 0;
+    return ret;
 }
 
-/**
- * fs_umount - Unmount file system
- *
- * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
- *
- * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
- */
-int fs_umount(void)
-{
-    if(block_disk_count() == -1){
+// read or write the file system blocks of @bvec through the block cache, or
+// through the asynchronous interface when the disk is backed by io_uring and
+// not cached
+static int transfer_blocks(fs_volume_t *vol, struct block_iovec *bvec, size_t nblocks, int write){
+    struct block_iovec *dvec = disk_iovec(vol, bvec, nblocks);
+    if (dvec == NULL){
         return -1;
     }
-    // write all meta info and file data to disk
-    block_write(sb.root_directory_block_index, rd);
-    
-    for (int i=0; i<sb.fat_blocks_count;i++){
-        block_write(i+1, &fat_table[i*(BLOCK_SIZE/2)]);
-    }
-    
-    
-    memset(sb.signature, '\0', 8);
-    sb.fat_blocks_count = 0;
-    sb.virtual_disk_blocks_count = 0;
-    sb.data_block_start_index = 0;
-    sb.root_directory_block_index = 0;
+    nblocks *= vol->spb;
 
-    free(fat_table);
-    free(rd);
-
-    if(block_disk_close() == -1){
-        return -1;
+    int ret;
+    if (vol->disk_backend == BLOCK_BACKEND_URING && !cache_enabled(vol->cache)){
+        ret = transfer_blocks_async(vol, dvec, nblocks, write);
+    } else if (write){
+        ret = cache_writev(vol->cache, dvec, nblocks);
+    } else {
+        ret = cache_readv(vol->cache, dvec, nblocks);
     }
-    return 0;
-    
+    if (dvec != bvec){
+        free(dvec);
+    }
+    return ret;
 }
 
-// helper functions
-int get_fat_free_blocks(){
-    int fat_free_blocks = 0;
-    for (int i=0; i<sb.data_blocks_count; i++){
-        // Entries marked as 0 correspond to free data blocks
-        if (fat_table[i] == 0){
-            fat_free_blocks++;
+// copy a transfer of @count bytes at @offset directly between @buf and the
+// mapped data blocks of @bvec, in the direction given by @to_disk
+static void copy_mapped(fs_volume_t *vol, struct block_iovec *bvec, size_t nblocks, size_t offset,
+                        size_t count, char *buf, int to_disk){
+    size_t byte_location = offset % vol->block_size;
+    for (size_t i=0; i<nblocks; i++){
+        size_t len = vol->block_size - byte_location;
+        if (len > count){
+            len = count;
+        }
+        char *block = (char*)map_block(vol, bvec[i].block) + byte_location;
+        if (to_disk){
+            memcpy(block, buf, len);
+        } else {
+            memcpy(buf, block, len);
         }
+        buf += len;
+        count -= len;
+        byte_location = 0;
     }
-    return fat_free_blocks;
 }
 
-int get_rdir_free_blocks(){
-    int rdir_free_blocks =0;
-    for (int i=0; i< FS_FILE_MAX_COUNT; i++){
-       // An empty entry is defined by the first character of the entry’s filename being equal to the NULL character.
-        if (rd[i].filename[0] == '\0'){
-            rdir_free_blocks++;
+// read or write whole blocks, in place when the disk is mapped
+static int blocks_io(fs_volume_t *vol, struct block_iovec *bvec, size_t nblocks, int write){
+    if (vol->mapped){
+        for (size_t i=0; i<nblocks; i++){
+            char *block = map_block(vol, bvec[i].block);
+            memcpy(write ? block : bvec[i].buf, write ? bvec[i].buf : block, vol->block_size);
         }
+        return 0;
     }
-    return rdir_free_blocks;
+    return transfer_blocks(vol, bvec, nblocks, write);
 }
 
-// end helper functions
+// number of blocks holding a group whose index entry is @stored
+static size_t group_blocks(fs_volume_t *vol, uint32_t stored){
+    return ((stored & ~GROUP_RAW) + vol->block_size - 1) / vol->block_size;
+}
 
-/**
- * fs_info - Display information about file system
- *
- * Display some information about the currently mounted file system.
- *
- * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
- */
-int fs_info(void)
-{
-    if (block_disk_count() == -1){
-        return -1;
+// whether index entry @stored describes a group that can be stored, rather
+// than a corrupted index
+static int group_valid(fs_volume_t *vol, uint32_t stored){
+    return (stored & ~GROUP_RAW) <= GROUP_SIZE && group_blocks(vol, stored) <= GROUP_BLOCKS_MAX;
+}
+
+// position in its chain of the first block of group @g of a compressed file
+static size_t group_position(fs_volume_t *vol, const uint32_t *index, size_t g){
+    size_t pos = 1; // index block
+    for (size_t i=0; i<g; i++){
+        pos += group_blocks(vol, index[i]);
     }
-    
-    int fat_free = get_fat_free_blocks();
-    int rdir_free = get_rdir_free_blocks();
-    printf("FS Info:\n");
-    printf("total_blk_count=%d\n", sb.virtual_disk_blocks_count);
-    printf("fat_blk_count=%d\n", sb.fat_blocks_count);
-    printf("rdir_blk=%d\n", sb.root_directory_block_index);
-    printf("data_blk=%d\n", sb.data_block_start_index);
-    printf("data_blk_count=%d\n", sb.data_blocks_count);
-    printf("fat_free_ratio=%d/%d\n", fat_free, sb.data_blocks_count);
-    printf("rdir_free_ratio=%d/%d\n", rdir_free, FS_FILE_MAX_COUNT);
-    return 0;
+    return pos;
 }
 
-/**
- * fs_create - Create a new file
- * @filename: File name
- *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
- * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
- */
-int fs_create(const char *filename)
-{
-    if (filename == NULL || strlen(filename) > FS_FILENAME_LEN){
+// read the index block of compressed file @entry into @index
+static int read_group_index(fs_volume_t *vol, struct root_dir *entry, uint32_t *index){
+    struct block_iovec bvec = {
+        .block = entry->first_data_block_index + vol->sb.data_block_start_index,
+        .buf = index,
+    };
+    return blocks_io(vol, &bvec, 1, 0);
+}
+
+// read and decompress group @g of compressed file @entry, whose data is @len
+// bytes long, into @out. @cbuf receives the stored group. returns -1 if it
+// cannot be read, or if its index entry is corrupted
+static int read_group(fs_volume_t *vol, struct root_dir *entry, const uint32_t *index,
+                      size_t g, char *out, size_t len, char *cbuf){
+    struct block_iovec bvec[GROUP_BLOCKS_MAX];
+    if (!group_valid(vol, index[g])){
         return -1;
     }
-
-    int count =0;
-    // iterate over root directory
-    for (int i=1; i<FS_FILE_MAX_COUNT; i++){
-        if (strcmp(rd[i].filename, filename) == 0 ){
+    size_t n = group_blocks(vol, index[g]);
+    uint16_t b = data_block_index(vol, group_position(vol, index, g), entry->first_data_block_index);
+    for (size_t i=0; i<n; i++){
+        if (b == FAT_EOC){
             return -1;
         }
-        
-        if (rd[i].filename[0] != '\0'){
-            count++;
-        }
-         else if (rd[i].filename[0] == '\0'){
-           // found empty entry, now fill it with file name, set size to 0, and set index to FAT_EOC
-           memcpy(rd[i].filename, filename, FS_FILENAME_LEN);
-           fat_table[i] = i;
-           rd[i].file_size = 0;
-           rd[i].first_data_block_index = FAT_EOC;
-           break;
-        }
+        bvec[i].block = b + vol->sb.data_block_start_index;
+        bvec[i].buf = cbuf + i * vol->block_size;
+        b = fat_get(vol, b);
     }
-    
-    if(count > FS_FILE_MAX_COUNT){
+    if (blocks_io(vol, bvec, n, 0) == -1){
         return -1;
     }
 
-    return -1;
+    if (index[g] & GROUP_RAW){
+        memcpy(out, cbuf, len);
+        return 0;
+    }
+    return lz_decompress(cbuf, index[g], out, len) == (long)len ? 0 : -1;
 }
-/**
- * fs_delete - Delete a file
- * @filename: File name
- *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
- */
-int fs_delete(const char *filename)
-{
-    if (filename == NULL || strlen(filename) > FS_FILENAME_LEN){
+
+// compress group @g of @len bytes from @in and store it in place of the
+// current version of the group in the chain of compressed file @entry. the
+// new blocks are allocated before the old ones are freed, so that the group
+// is left untouched if the disk is full. returns -1 on failure
+static int write_group(fs_volume_t *vol, struct root_dir *entry, uint32_t *index,
+                       size_t g, char *in, size_t len, char *cbuf){
+    // keep the group as is when compressing would not save a single block
+    uint32_t stored = 0;
+    if (lz_compressible(in, len)){
+        stored = lz_compress(in, len, cbuf, len > vol->block_size ? len - vol->block_size : 0);
+    }
+    char *data = cbuf;
+    if (stored == 0){
+        memset(in + len, 0, GROUP_SIZE - len);
+        stored = len | GROUP_RAW;
+        data = in;
+    }
+
+    // the group sits between block @prev and block @next of the chain
+    if (g * GROUP_SIZE < entry->file_size && !group_valid(vol, index[g])){
         return -1;
     }
+    size_t pos = group_position(vol, index, g);
+    size_t old = g * GROUP_SIZE < entry->file_size ? group_blocks(vol, index[g]) : 0;
+    uint16_t prev = data_block_index(vol, pos - 1, entry->first_data_block_index);
+    uint16_t next = data_block_index(vol, old, fat_get(vol, prev));
 
-    int found = -1;
-    uint16_t current_index = FAT_EOC;
-    for (int i=1; i<FS_FILE_MAX_COUNT; i++){
-        if (rd[i].filename[0] != '\0'){
-            // find the file and set entry name back to null
-            if (strcmp((char*)rd[i].filename, filename) == 0){
-                memset(rd[i].filename, '\0', FS_FILENAME_LEN);
-                found = 1;
-                current_index = rd[i].first_data_block_index;
-                break;
+    struct block_iovec bvec[GROUP_BLOCKS_MAX];
+    size_t n = group_blocks(vol, stored);
+    size_t hint = run_hint(vol, prev + 1, n);
+    for (size_t i=0; i<n; i++){
+        uint16_t b = alloc_data_block(vol, hint);
+        if (b == FAT_EOC){
+            // disk is full, give the blocks back
+            for (size_t k=0; k<i; k++){
+                fat_set(vol, bvec[k].block - vol->sb.data_block_start_index, 0);
             }
+            return -1;
         }
+        bvec[i].block = b + vol->sb.data_block_start_index;
+        bvec[i].buf = data + i * vol->block_size;
+        hint = b + 1;
     }
-    
-    if (found == -1){
+    if (n * vol->block_size > (stored & ~GROUP_RAW)){
+        memset(data + (stored & ~GROUP_RAW), 0, n * vol->block_size - (stored & ~GROUP_RAW));
+    }
+    if (blocks_io(vol, bvec, n, 1) == -1){
+        for (size_t k=0; k<n; k++){
+            fat_set(vol, bvec[k].block - vol->sb.data_block_start_index, 0);
+        }
         return -1;
     }
-    
-    // free FAT contents
-   while (current_index != FAT_EOC){
-       uint16_t temp_index = fat_table[current_index];
-       fat_table[current_index] = 0;
-       current_index = temp_index;
 
-   }
+    // free the old version of the group and link the new one in its place
+    uint16_t b = fat_get(vol, prev);
+    for (size_t i=0; i<old; i++){
+        uint16_t temp = fat_get(vol, b);
+        fat_set(vol, b, 0);
+        b = temp;
+    }
+    for (size_t i=0; i<n; i++){
+        uint16_t cur = bvec[i].block - vol->sb.data_block_start_index;
+        fat_set(vol, prev, cur);
+        prev = cur;
+    }
+    fat_set(vol, prev, next);
+    index[g] = stored;
     return 0;
 }
 
-/**
- * fs_ls - List files on file system
- *
- * List information about the files located in the root directory.
- *
- * Return: -1 if no FS is currently mounted. 0 otherwise.
- */
-int fs_ls(void)
-{
-    if (block_disk_count() == -1){
-        
+// fs_write() on a compressed file: every group touched by the write is
+// decompressed if needed, modified, then compressed again
+static int write_compressed(fs_volume_t *vol, struct root_dir *entry, size_t offset,
+                            const char *buf, size_t count){
+    uint32_t *index = alloc_blocks(vol, 1);
+    char *group = block_buf_alloc(GROUP_SIZE / BLOCK_SIZE);
+    char *cbuf = block_buf_alloc(GROUP_SIZE / BLOCK_SIZE);
+    int written = -1;
+    if (index == NULL || group == NULL || cbuf == NULL){
+        goto out;
     }
-    printf("FS Ls:\n");
-    for (int i=0; i<FS_FILE_MAX_COUNT; i++){
-        if (rd[i].filename[0] != '\0'){
-            printf("file: %s, size: %d, data_blk: %d\n", rd[i].filename, rd[i].file_size, rd[i].first_data_block_index);
+
+    // an empty file gets its index block first
+    if (entry->first_data_block_index == FAT_EOC){
+        uint16_t b = alloc_data_block(vol, 1);
+        if (b == FAT_EOC){
+            written = 0;
+            goto out;
         }
+        set_first_block(vol, entry, b);
+        memset(index, 0, vol->block_size);
+    } else if (read_group_index(vol, entry, index) == -1){
+        goto out;
     }
-    return 0;
-}
 
-/**
- * fs_open - Open a file
- * @filename: File name
- *
- * Open file named @filename for reading and writing, and return the
- * corresponding file descriptor. The file descriptor is a non-negative integer
- * that is used subsequently to access the contents of the file. The file offset
- * of the file descriptor is set to 0 initially (beginning of the file). If the
- * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
- *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
- */
-int fs_open(const char *filename)
-{
-    if (filename == NULL || strlen(filename) > FS_FILENAME_LEN){
-        return -1;
-    }
+    written = 0;
+    size_t end = offset + count;
+    for (size_t g=offset / GROUP_SIZE; g<=(end - 1) / GROUP_SIZE; g++){
+        if (g >= vol->block_size / sizeof(uint32_t)){
+            break; // file is as large as its index can describe
+        }
+        size_t base = g * GROUP_SIZE;
+        size_t lo = offset > base ? offset - base : 0;
+        size_t hi = end < base + GROUP_SIZE ? end - base : GROUP_SIZE;
+        size_t len = 0;
+        if (entry->file_size > base){
+            len = entry->file_size - base < GROUP_SIZE ? entry->file_size - base : GROUP_SIZE;
+        }
 
-    int found = -1;
-    for (int i=0; i<FS_FILE_MAX_COUNT; i++){
-       if (strcmp((char*)rd[i].filename, filename) == 0){
-           found = 1;
-           open_files++;
-           strcpy(file_d[i].filename, filename);
-           file_d[i].offset = 0;
-           file_d[i].fd_return = i;
-           return file_d[i].fd_return;
-       }
+        // data kept from the current version of the group
+        if (len > 0 && (lo > 0 || hi < len) &&
+            read_group(vol, entry, index, g, group, len, cbuf) == -1){
+            break;
+        }
+        memcpy(group + lo, buf + base + lo - offset, hi - lo);
+        if (hi > len){
+            len = hi;
+        }
+        if (write_group(vol, entry, index, g, group, len, cbuf) == -1){
+            break;
+        }
+        written += hi - lo;
+        if (base + len > entry->file_size){
+            entry->file_size = base + len;
+            vol->rd_dirty = 1;
+        }
     }
 
-    if (found == -1){
-        return -1;
+    struct block_iovec bvec = {
+        .block = entry->first_data_block_index + vol->sb.data_block_start_index,
+        .buf = index,
+    };
+    if (blocks_io(vol, &bvec, 1, 1) == -1){
+        written = -1;
     }
-       
-    return 0;
+
+out:
+    block_buf_free(cbuf);
+    block_buf_free(group);
+    block_buf_free(index);
+    return written;
 }
 
-/**
- * fs_close - Close a file
- * @fd: File descriptor
- *
- * Close file descriptor @fd.
- *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
- */
-int fs_close(int fd)
-{
-    if (fd > FS_OPEN_MAX_COUNT || fd < 0 || file_d[fd].fd_return == -1){
-        return -1;
+// fs_read() of @count bytes at @offset, all within a compressed file
+static int read_compressed(fs_volume_t *vol, struct root_dir *entry, size_t offset,
+                           char *buf, size_t count){
+    uint32_t *index = alloc_blocks(vol, 1);
+    char *group = block_buf_alloc(GROUP_SIZE / BLOCK_SIZE);
+    char *cbuf = block_buf_alloc(GROUP_SIZE / BLOCK_SIZE);
+    int read_bytes = -1;
+    if (index == NULL || group == NULL || cbuf == NULL ||
+        read_group_index(vol, entry, index) == -1){
+        goto out;
     }
-    strcpy(file_d[fd].filename, "");
-    file_d[fd].offset = 0;
-    file_d[fd].fd_return = -1;
-    open_files--;
-    return 0;
+
+    size_t end = offset + count;
+    read_bytes = 0;
+    for (size_t g=offset / GROUP_SIZE; g<=(end - 1) / GROUP_SIZE; g++){
+        size_t base = g * GROUP_SIZE;
+        size_t lo = offset > base ? offset - base : 0;
+        size_t hi = end < base + GROUP_SIZE ? end - base : GROUP_SIZE;
+        size_t len = entry->file_size - base < GROUP_SIZE ? entry->file_size - base : GROUP_SIZE;
+        if (read_group(vol, entry, index, g, group, len, cbuf) == -1){
+            read_bytes = -1;
+            break;
+        }
+        memcpy(buf + base + lo - offset, group + lo, hi - lo);
+        read_bytes += hi - lo;
+    }
+
+out:
+    block_buf_free(cbuf);
+    block_buf_free(group);
+    block_buf_free(index);
+    return read_bytes;
 }
 
-/**
- * fs_stat - Get file status
- * @fd: File descriptor
- *
- * Get the current size of the file pointed by file descriptor @fd.
- *
- * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
- * invalid (out of bounds or not currently open). Otherwise return the current
- * size of file.
- */
-int fs_stat(int fd)
+
+// fs_write_ex() with the lock of @vol held
+static int write_file(fs_volume_t *vol, int fd, void *buf, size_t count)
 {
-    if(fd > FS_OPEN_MAX_COUNT || fd < 0 || file_d[fd].fd_return == -1){
+    struct root_dir *entry = get_fd_entry(vol, fd);
+    if (entry == NULL || buf == NULL){
         return -1;
     }
 
-    char *file = file_d[fd].filename;
-    for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-        if(strcmp(rd[i].filename, file) == 0){
-            return rd[i].file_size;
+    if (count == 0){
+        return 0;
+    }
+
+    size_t offset = vol->file_d[fd].offset;
+    if (entry->flags & RD_COMPRESSED){
+        int written = write_compressed(vol, entry, offset, buf, count);
+        if (written > 0){
+            vol->file_d[fd].offset += written;
         }
+        return written;
     }
 
-    return 0;
-}
+    size_t first = offset / vol->block_size;
+    size_t last = (offset + count - 1) / vol->block_size;
+    size_t nblocks = last - first + 1;
 
-/**
- * fs_lseek - Set file offset
- * @fd: File descriptor
- * @offset: File offset
- *
- * Set the file offset (used for read and write operations) associated with file
- * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
- *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
- */
-int fs_lseek(int fd, size_t offset)
-{
-    if (fd > FS_OPEN_MAX_COUNT || fd < 0 || file_d[fd].fd_return == -1 || offset > rd[fd].file_size){
+    // blocks shared with other files are copied before being modified
+    if (unshare_chain(vol, entry, last) == -1){
+        return 0;
+    }
+
+    struct block_iovec *bvec = malloc(sizeof(struct block_iovec) * nblocks);
+    char *bounce = alloc_blocks(vol, 2);
+    if (bvec == NULL || bounce == NULL){
+        free(bvec);
+        block_buf_free(bounce);
         return -1;
     }
-    file_d[fd].offset = offset;
-    return 0;
-}
 
-// returns index of data block corresponding to file's offset
-int data_block_index(size_t offset, uint16_t file_start){
-    int index = file_start;
-    while(index != FAT_EOC && BLOCK_SIZE < offset ){
-        index = fat_table[index];
+    // walk the chain up to the last written block, extending it as needed
+    uint16_t prev = FAT_EOC;
+    uint16_t current = entry->first_data_block_index;
+    size_t n = 0;
+    int extending = 0;
+    for (size_t i=0; i<=last; i++){
+        if (current == FAT_EOC){
+            size_t hint = prev == FAT_EOC ? 1 : (size_t)prev + 1;
+            // the blocks added to the chain go in one run if there is one
+            if (!extending){
+                hint = run_hint(vol, hint, last - i + 1);
+                extending = 1;
+            }
+            current = alloc_data_block(vol, hint);
+            if (current == FAT_EOC){
+                break; // disk is full
+            }
+            if (prev == FAT_EOC){
+                set_first_block(vol, entry, current);
+            } else {
+                fat_set(vol, prev, current);
+            }
+        }
+        if (i >= first){
+            bvec[n++].block = current + vol->sb.data_block_start_index;
+        }
+        prev = current;
+        current = fat_get(vol, current);
+    }
+
+    // write as many bytes as the disk can hold
+    if (n < nblocks){
+        count = n ? (first + n) * vol->block_size - offset : 0;
+        nblocks = n;
+    }
+
+    int bytes_written = 0;
+    if (vol->mapped){
+        copy_mapped(vol, bvec, nblocks, offset, count, buf, 1);
+        bytes_written = count;
+    } else if (nblocks > 0){
+        size_t tail;
+        size_t head = setup_block_iovec(bvec, nblocks, vol->block_size, offset, count,
+                                        buf, bounce, &tail);
+
+        // partially written blocks are read, modified and written back
+        struct block_iovec partial[2];
+        size_t npartial = 0;
+        if (head){
+            partial[npartial++] = bvec[0];
+        }
+        if (tail){
+            partial[npartial++] = bvec[nblocks - 1];
+        }
+        if (npartial && transfer_blocks(vol, partial, npartial, 0) == -1){
+            bytes_written = -1;
+        } else {
+            if (head){
+                memcpy(bounce + offset % vol->block_size, buf, head);
+            }
+            if (tail){
+                memcpy(bounce + vol->block_size, (char*)buf + count - tail, tail);
+            }
+            // write in block order so that contiguous runs go out together
+            block_iovec_sort(bvec, nblocks);
+            if (transfer_blocks(vol, bvec, nblocks, 1) == -1){
+                bytes_written = -1;
+            } else {
+                bytes_written = count;
+            }
+        }
+    }
+
+    if (bytes_written > 0){
+        vol->file_d[fd].offset += bytes_written;
+        if (offset + bytes_written > entry->file_size){
+            entry->file_size = offset + bytes_written;
+            vol->rd_dirty = 1;
+        }
+
+        // remember the new content of the blocks, so that they do not need to
+        // be read back to be shared when the file is closed
+        for (size_t i=0; vol->dedup != NULL && i<nblocks; i++){
+            const void *data = vol->mapped ? map_block(vol, bvec[i].block) : bvec[i].buf;
+            dedup_hash(vol->dedup, bvec[i].block - vol->sb.data_block_start_index, data);
+        }
     }
-    return index;
-}
 
+    block_buf_free(bounce);
+    free(bvec);
+    return bytes_written;
+}
 
 /**
- * fs_write - Write to a file
+ * fs_write_ex - Write to a file
+ * @vol: Volume
  * @fd: File descriptor
  * @buf: Data buffer to write in the file
  * @count: Number of bytes of data to be written
@@ -423,45 +2749,118 @@ int data_block_index(size_t offset, uint16_t file_start){
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * Return: -1 if @vol is NULL, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually written.
  */
+int fs_write_ex(fs_volume_t *vol, int fd, void *buf, size_t count)
+{
+    if (vol == NULL){
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->lock);
+    int ret = write_file(vol, fd, buf, count);
+    balance_dirty(vol);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
+}
+
 int fs_write(int fd, void *buf, size_t count)
 {
-    
-    char *filename = (char*)file_d[fd].filename;
-    int offset = file_d[fd].offset;
-    // locate file
-    int file_location = -1;
-    uint16_t file_start = FAT_EOC;
+    return fs_write_ex(default_vol, fd, buf, count);
+}
 
-    for (int i=0; i<FS_FILE_MAX_COUNT; i++){
-        if (strcmp(rd[i].filename, filename) == 0){
-            file_location = i;
-            file_start = rd[i].first_data_block_index;
-            break;
+// fs_read_ex() with the lock of @vol held
+static int read_file(fs_volume_t *vol, int fd, void *buf, size_t count)
+{
+    //check if fd is invalid
+    struct root_dir *entry = get_fd_entry(vol, fd);
+    if(entry == NULL){
+        return -1;
+    }
+
+    //check if buf is null
+    if(buf == NULL){
+        return -1;
+    }
+
+    if (count == 0){
+        return 0;
+    }
+
+    size_t offset = vol->file_d[fd].offset;
+    if (offset >= entry->file_size){
+        return 0;
+    } //at end of file
+
+    if (count > entry->file_size - offset){
+        count = entry->file_size - offset;
+    }
+
+    if (entry->flags & RD_COMPRESSED){
+        int read_bytes = read_compressed(vol, entry, offset, buf, count);
+        if (read_bytes > 0){
+            vol->file_d[fd].offset += read_bytes;
         }
+        return read_bytes;
     }
 
-    if (file_location == -1){
+    size_t first = offset / vol->block_size;
+    size_t nblocks = (offset + count - 1) / vol->block_size - first + 1;
+    struct block_iovec *bvec = malloc(sizeof(struct block_iovec) * nblocks);
+    char *bounce = alloc_blocks(vol, 2);
+    if (bvec == NULL || bounce == NULL){
+        free(bvec);
+        block_buf_free(bounce);
         return -1;
     }
 
-    struct root_dir *rdir = &rd[file_location];
+    // collect the data blocks of the chain so that contiguous runs are read at once
+    uint16_t b_iter = data_block_index(vol, first, entry->first_data_block_index);
+    for (size_t i=0; i<nblocks; i++){
+        if (b_iter == FAT_EOC){
+            // chain is shorter than the file size, read what is there
+            nblocks = i;
+            count = i ? (first + i) * vol->block_size - offset : 0;
+            break;
+        }
+        bvec[i].block = b_iter + vol->sb.data_block_start_index;
+        b_iter = fat_get(vol, b_iter);
+    }
 
+    int read_bytes = 0;
+    if (vol->mapped){
+        copy_mapped(vol, bvec, nblocks, offset, count, buf, 0);
+        read_bytes = count;
+        vol->file_d[fd].offset += read_bytes;
+    } else if (nblocks > 0){
+        size_t tail;
+        size_t head = setup_block_iovec(bvec, nblocks, vol->block_size, offset, count,
+                                        buf, bounce, &tail);
 
-    char *write_buf = (char*)buf;
-    void *bounce_buffer = (void*)malloc(BLOCK_SIZE);
-    uint16_t index = data_block_index(offset, file_start);
-    int bytes_written =0;
-    
-    
-    return bytes_written;
+        if (transfer_blocks(vol, bvec, nblocks, 0) == -1){
+            read_bytes = -1;
+        } else {
+            if (head){
+                memcpy(buf, bounce + offset % vol->block_size, head);
+            }
+            if (tail){
+                memcpy((char*)buf + count - tail, bounce + vol->block_size, tail);
+            }
+            read_bytes = count;
+            vol->file_d[fd].offset += read_bytes;
+        }
+    }
+
+    block_buf_free(bounce);
+    free(bvec);
+    return read_bytes;
 }
 
 /**
- * fs_read - Read from a file
+ * fs_read_ex - Read from a file
+ * @vol: Volume
  * @fd: File descriptor
  * @buf: Data buffer to be filled with data
  * @count: Number of bytes of data to be read
@@ -475,64 +2874,24 @@ int fs_write(int fd, void *buf, size_t count)
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
- * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * Return: -1 if @vol is NULL, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually read.
  */
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_read_ex(fs_volume_t *vol, int fd, void *buf, size_t count)
 {
-     //check if fd is invalid
-    if(fd > FS_OPEN_MAX_COUNT || fd < 0 || file_d[fd].fd_return == -1){
-            return -1;
-    }
-
-    //check if buf is null
-    if(buf == NULL){
+    if (vol == NULL){
         return -1;
     }
 
-    size_t offset = file_d[fd].offset;
-    void * buffer_b = malloc(BLOCK_SIZE);
-    int read_bytes = 0;
-
-    while(count > 0){
-        if (offset >= rd->file_size){
-            break;
-        } //at end of file
-
-        //      size_t offset = file_d[fd].offset;
-        uint16_t b_iter = rd->first_data_block_index; // block iterator
-        int b_current = offset/BLOCK_SIZE; //current block
-        int byte_location = offset % BLOCK_SIZE;
-        int new_shift = BLOCK_SIZE;
-        void* b_bounce = buffer_b + byte_location;
-
-        for (int i = 0; i < b_current; i++){
-            b_iter = fat_table[b_iter];
-        } //obtain current block
-
-        for(int i = 0; i < ((count/BLOCK_SIZE) + 1); i++) {
-            block_read(b_iter + sb.data_block_start_index, buffer_b);
-
-            if(byte_location > 0){
-               new_shift = BLOCK_SIZE - byte_location;
-            } else if(BLOCK_SIZE <= count+byte_location){
-               b_bounce -= byte_location;
-            } else {
-               memcpy(buf+read_bytes, b_bounce, count);
-               read_bytes += count;
-               offset += count;
-               break;
-            }
-
-            memcpy(buf+read_bytes, b_bounce, new_shift);
-            read_bytes += new_shift;
-            offset += new_shift;
-            count -= new_shift;
-        }
-    }
-    file_d[fd].offset += read_bytes;
-    return read_bytes;
+    pthread_mutex_lock(&vol->lock);
+    int ret = read_file(vol, fd, buf, count);
+    pthread_mutex_unlock(&vol->lock);
+    return ret;
 }
 
+int fs_read(int fd, void *buf, size_t count)
+{
+    return fs_read_ex(default_vol, fd, buf, count);
+}
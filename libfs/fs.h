@@ -3,6 +3,10 @@
 
 #include <stddef.h> /* for size_t definition */
 
+#include "cache.h"
+#include "disk.h"
+#include "journal.h"
+
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
@@ -12,6 +16,146 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Smallest and largest block sizes of a file system */
+#define FS_BLOCK_SIZE_MIN 4096
+#define FS_BLOCK_SIZE_MAX 65536
+
+/**
+ * fs_format - Create an empty file system
+ * @diskname: Name of the virtual disk file, created or truncated
+ * @data_blocks: Number of data blocks
+ * @block_size: Size of the blocks in bytes, a power of two between
+ * %FS_BLOCK_SIZE_MIN and %FS_BLOCK_SIZE_MAX
+ *
+ * Create virtual disk file @diskname holding an empty file system, with a
+ * superblock, a FAT, a root directory and @data_blocks data blocks, all made of
+ * blocks of @block_size bytes. Larger blocks make shorter FAT chains and
+ * larger volumes (there are at most 65535 blocks), at the cost of more space
+ * lost at the end of files. File systems with 4 KiB blocks have the layout
+ * of the original format.
+ *
+ * Return: -1 if @block_size or @data_blocks is invalid, or if the virtual disk
+ * file cannot be created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks, size_t block_size);
+
+/**
+ * enum fs_check_phase - Phases of fs_check()
+ * @FS_CHECK_SUPERBLOCK: Check of the geometry of the superblock, and replay of
+ * the journal when repairing
+ * @FS_CHECK_LOAD: Reading of the FAT and the root directory
+ * @FS_CHECK_CHAINS: Walk of the chain of each file and region, in parallel
+ * @FS_CHECK_FREE: Scan of the FAT for orphaned blocks, in parallel, and check
+ * of the free counts
+ * @FS_CHECK_REPAIR: Write-back of the repaired FAT, root directory and
+ * superblock
+ * @FS_CHECK_PHASES: Number of phases
+ */
+enum fs_check_phase {
+	FS_CHECK_SUPERBLOCK,
+	FS_CHECK_LOAD,
+	FS_CHECK_CHAINS,
+	FS_CHECK_FREE,
+	FS_CHECK_REPAIR,
+	FS_CHECK_PHASES,
+};
+
+/**
+ * struct fs_check_opts - File system check options
+ * @repair: Fix the problems found. Chains are cut where they leave the data
+ * blocks, run into a free block, into themselves, or into a block of another
+ * chain (the chain of the first file in the root directory keeps the block,
+ * checksum and journal regions come first). The size of files is reduced to
+ * what their chain holds, or for compressed files to the groups before the
+ * first one that is corrupted, and blocks past the end of files are freed, as
+ * well as orphaned blocks. Unterminated names are cut, and the free counts of
+ * the superblock fixed. Checksum and journal regions are chained again. Duplicate
+ * names are only reported.
+ * @threads: Number of threads walking the chains and scanning the FAT, 0 for
+ * one per CPU, as long as each has at least 16384 data blocks to check
+ * @verbose: Print each problem found
+ * @backend: Backend used to access the virtual disk file
+ */
+struct fs_check_opts {
+	int repair;
+	unsigned int threads;
+	int verbose;
+	enum block_backend backend;
+};
+
+/**
+ * struct fs_check_report - Outcome of fs_check()
+ * @files: Files in the root directory
+ * @used_blocks: Data blocks reached from the files and regions
+ * @free_blocks: Free data blocks
+ * @bad_entries: Root directory entries with an unterminated or duplicate name
+ * @bad_links: Chains that leave the data blocks or run into a free block,
+ * including from the root directory, checksum and journal regions whose FAT
+ * entries do not chain their blocks in order, and a reserved FAT entry that is
+ * not the end of a chain
+ * @cycles: Chains that run into themselves
+ * @cross_links: Chains that run into a block of another chain, unless blocks
+ * can be shared (see &struct fs_mount_opts)
+ * @bad_sizes: Files whose size does not match the length of their chain
+ * @bad_groups: Compressed files whose index has a corrupted entry, or does not
+ * list the groups of their size in the blocks of their chain
+ * @orphans: Blocks used by no chain
+ * @bad_counts: Wrong free counts in the superblock
+ * @errors: Number of problems found, the sum of the above
+ * @repaired: Number of problems fixed
+ * @threads: Number of threads used
+ * @phase_ns: Time spent in each phase (see &enum fs_check_phase), in
+ * nanoseconds
+ */
+struct fs_check_report {
+	size_t files;
+	size_t used_blocks;
+	size_t free_blocks;
+	size_t bad_entries;
+	size_t bad_links;
+	size_t cycles;
+	size_t cross_links;
+	size_t bad_sizes;
+	size_t bad_groups;
+	size_t orphans;
+	size_t bad_counts;
+	size_t errors;
+	size_t repaired;
+	unsigned int threads;
+	unsigned long long phase_ns[FS_CHECK_PHASES];
+};
+
+/**
+ * fs_check - Check the consistency of a file system
+ * @diskname: Name of the virtual disk file, which must not be mounted
+ * @opts: Check options, or NULL to check without repairing
+ * @report: Outcome to fill in
+ *
+ * Verify the geometry of the superblock, then walk the FAT chain of each file
+ * and of the checksum and journal regions, in parallel, marking the blocks
+ * reached in a shared bitmap. Chains that run into a block already marked by
+ * another chain are cross-linked, and orphaned blocks are those that are used
+ * but not marked. The length of each chain is checked against the size of its
+ * file, or against the group index of compressed files, and the free counts of
+ * the superblock against the FAT. File systems
+ * with a journal are checked as they are on the disk, unless @opts asks for
+ * repairs: their journal is then replayed first, as when mounting them.
+ *
+ * Return: -1 if @diskname or @report is NULL, if the virtual disk file cannot
+ * be read, or written when repairing, or if it does not hold a file system
+ * with a valid geometry. 0 otherwise, even if problems were found.
+ */
+int fs_check(const char *diskname, const struct fs_check_opts *opts,
+             struct fs_check_report *report);
+
+/**
+ * fs_check_phase_name - Get the name of a phase of fs_check()
+ * @phase: Phase
+ *
+ * Return: Name of @phase, for reporting.
+ */
+const char *fs_check_phase_name(enum fs_check_phase phase);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,6 +169,123 @@
  */
 int fs_mount(const char *diskname);
 
+/**
+ * enum fs_fat_load - When the FAT is read from the disk
+ * @FS_FAT_LAZY: Each block of the FAT is read the first time it is needed, so
+ * that mounting only reads the superblock and the root directory
+ * @FS_FAT_PREFETCH: Same as %FS_FAT_LAZY, and a background thread reads the
+ * blocks that are still needed, one at a time, while the volume is in use
+ * @FS_FAT_EAGER: The whole FAT is read when mounting
+ */
+enum fs_fat_load {
+	FS_FAT_LAZY,
+	FS_FAT_PREFETCH,
+	FS_FAT_EAGER,
+};
+
+/**
+ * struct fs_writeback - Background writeback settings
+ * @enabled: Start a thread that writes back dirty blocks while the volume is
+ * mounted, instead of leaving them all to fs_sync() and fs_umount()
+ * @interval_ms: Period at which the thread looks for blocks to write back, 0
+ * for 500 ms
+ * @expire_ms: Age after which dirty blocks are written back, 0 for 5000 ms.
+ * The FAT and the root directory are written back with all the dirty data
+ * blocks, so that they never point to data that is not on the disk yet.
+ * @background_ratio: Percentage of the cache that can be dirty before the
+ * thread writes back every dirty block, 0 for 10
+ * @dirty_ratio: Percentage of the cache that can be dirty before fs_write()
+ * waits for the thread, 0 for 20
+ *
+ * Like the dirty_expire_centisecs, dirty_background_ratio and dirty_ratio
+ * settings of Linux. The ratios only apply to volumes with a cache.
+ */
+struct fs_writeback {
+	int enabled;
+	unsigned int interval_ms;
+	unsigned int expire_ms;
+	unsigned int background_ratio;
+	unsigned int dirty_ratio;
+};
+
+/**
+ * struct fs_mount_opts - File system mount options
+ * @backend: Backend used to access the virtual disk file. With
+ * %BLOCK_BACKEND_MMAP, the FAT and root directory are used in place and file
+ * data is copied directly from/to the mapping.
+ * @cache_blocks: Number of blocks held by the write-back block cache, 0 to
+ * disable caching. Ignored with %BLOCK_BACKEND_MMAP.
+ * @cache_policy: Replacement policy of the block cache. %CACHE_POLICY_ARC
+ * keeps frequently read blocks cached across large sequential reads.
+ * @sparse: Keep the virtual disk file sparse. The storage of the data blocks
+ * freed by fs_delete() is released on the host, and reads fill the holes of
+ * the file with zeros without reading them (see block_set_sparse()).
+ * @checksums: Checksum every block (see block_csum_enable()), so that reading
+ * corrupted blocks fails. The first time a file system is mounted with
+ * @checksums set, a checksum region is allocated in its last data blocks,
+ * which must be free, and recorded in the superblock. File systems with a
+ * checksum region are always mounted with checksums, and never used in place
+ * with %BLOCK_BACKEND_MMAP.
+ * @compress: Compress the data of the files created while mounted. Files are
+ * compressed by groups of 64 KiB (the last group of a file may be shorter)
+ * with a built-in LZ codec, and groups that do not compress are stored as is.
+ * Compressed files remain compressed when the file system is mounted without
+ * @compress, and are limited to 64 MiB.
+ * @dedup: Share the data blocks of files closed while mounted with files
+ * holding the same data. As blocks are linked in the FAT, only the ends of
+ * chains can be shared: each block is compared, from the last one backwards,
+ * to blocks with the same content (found through an in-memory index of content
+ * hashes) that are followed by the same blocks. Shared blocks are copied when
+ * written to, and only freed with their last file. Once blocks are shared, it
+ * is recorded in the superblock and the file system must only be modified by
+ * this implementation, with or without @dedup. Compressed files are never
+ * shared.
+ * @sim: Model of the disk when @backend is %BLOCK_BACKEND_SIM, or NULL for
+ * the default one (see block_sim_set())
+ * @ops: Operations of the backend used to access the disk instead of
+ * @backend (see &struct block_ops), or NULL
+ * @fat_load: When the FAT is read (see &enum fs_fat_load). Ignored when the
+ * FAT is used in place with %BLOCK_BACKEND_MMAP.
+ * @writeback: Background writeback (see &struct fs_writeback)
+ * @journal_blocks: Log the changes to the FAT, the root directory and the
+ * superblock in a journal before writing them in place, so that each
+ * write-back reaches the disk all or none and the data blocks are written
+ * before the FAT points to them. The first time a file system is mounted with
+ * @journal_blocks set, a journal of that many blocks (or the smallest size
+ * that holds a write-back of the whole FAT) is allocated in the last run of
+ * free data blocks that is large enough, and recorded in the superblock. File
+ * systems with a journal replay it when mounted, always journal their
+ * changes, and are never used in place with %BLOCK_BACKEND_MMAP. They must be
+ * unmounted with fs_umount() before being modified by other implementations.
+ */
+struct fs_mount_opts {
+	enum block_backend backend;
+	size_t cache_blocks;
+	enum cache_policy cache_policy;
+	int sparse;
+	int checksums;
+	int compress;
+	int dedup;
+	const struct block_sim *sim;
+	const struct block_ops *ops;
+	enum fs_fat_load fat_load;
+	struct fs_writeback writeback;
+	size_t journal_blocks;
+};
+
+/**
+ * fs_mount_with - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Same as fs_mount(), but the virtual disk file is accessed as described by
+ * @opts.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_mount_with(const char *diskname, const struct fs_mount_opts *opts);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -36,6 +297,53 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_flush - Write back cached changes
+ *
+ * Write the root directory, the FAT and all the data blocks modified since
+ * they were last written back to the virtual disk file.
+ *
+ * Return: -1 if no FS is currently mounted, or if any block cannot be written.
+ * 0 otherwise.
+ */
+int fs_flush(void);
+
+/**
+ * fs_sync - Make changes durable
+ *
+ * Write back the mounted file system like fs_flush(), then flush the virtual
+ * disk file to stable storage. Concurrent calls on the same volume (see
+ * fs_sync_ex()) are batched, so that they share write-backs and disk flushes.
+ *
+ * Return: -1 if no FS is currently mounted, or if any block cannot be written
+ * or the disk cannot be flushed. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_fsync - Make the changes of a file durable
+ * @fd: File descriptor
+ *
+ * Same as fs_sync(). Files share the FAT and the root directory, so the whole
+ * file system is synchronized.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the synchronization
+ * fails. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * fs_cache_stats - Get block cache counters
+ * @stats: Counters to fill in
+ *
+ * Get the counters of the block cache of the currently mounted file system, or
+ * of the last mounted one. Counters are reset when a file system is mounted.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_cache_stats(struct cache_stats *stats);
+
 /**
  * fs_info - Display information about file system
  *
@@ -45,6 +353,38 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * struct fs_statfs - Space usage of a file system
+ * @block_size: Size of the blocks in bytes
+ * @total_blocks: Number of blocks of the virtual disk
+ * @data_blocks: Number of data blocks
+ * @free_blocks: Number of free data blocks
+ * @files: Number of entries of the root directory
+ * @free_files: Number of free entries of the root directory
+ */
+struct fs_statfs {
+	size_t block_size;
+	size_t total_blocks;
+	size_t data_blocks;
+	size_t free_blocks;
+	size_t files;
+	size_t free_files;
+};
+
+/**
+ * fs_statfs - Get space usage of file system
+ * @st: Space usage to fill in
+ *
+ * Get the space usage of the currently mounted file system, without printing
+ * it. The free counts are kept in the superblock, so that they are known as
+ * soon as the file system is mounted. Only file systems that do not have them
+ * yet (created by other tools) have their FAT read to count the free blocks,
+ * once.
+ *
+ * Return: -1 if no FS is currently mounted, or if @st is NULL. 0 otherwise.
+ */
+int fs_statfs(struct fs_statfs *st);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -67,9 +407,12 @@ int fs_create(const char *filename);
  * Delete the file named @filename from the root directory of the mounted file
  * system.
  *
- * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * On file systems mounted with the sparse option, the storage of the file's
+ * data blocks is released in the virtual disk file.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, if
+ * there is no file named @filename to delete, or if file @filename is currently
+ * open. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
@@ -182,4 +525,167 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/*
+ * The functions above operate on the single file system mounted with
+ * fs_mount(), called the default volume. The fs_*_ex() functions below do the
+ * same on any number of file systems mounted simultaneously with fs_mount_ex(),
+ * each identified by its volume handle. The default volume is not visible to
+ * them.
+ */
+
+/** Opaque handle of a mounted file system */
+typedef struct fs_volume fs_volume_t;
+
+/**
+ * fs_mount_ex - Mount a file system as a new volume
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Open the virtual disk file @diskname as described by @opts and mount the
+ * file system that it contains as a volume of its own, with its own FAT, root
+ * directory, file descriptors and block cache.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. The handle of the volume otherwise.
+ */
+fs_volume_t *fs_mount_ex(const char *diskname, const struct fs_mount_opts *opts);
+
+/**
+ * fs_umount_ex - Unmount a volume
+ * @vol: Volume
+ *
+ * Write back volume @vol, close its virtual disk file and release it. @vol
+ * cannot be used anymore afterwards.
+ *
+ * Return: -1 if @vol is NULL, or if there are still open file descriptors on
+ * @vol, or if @vol cannot be written back or the virtual disk cannot be closed,
+ * in which case @vol is released all the same. 0 otherwise.
+ */
+int fs_umount_ex(fs_volume_t *vol);
+
+/**
+ * fs_flush_ex - Same as fs_flush() on volume @vol
+ * @vol: Volume
+ */
+int fs_flush_ex(fs_volume_t *vol);
+
+/**
+ * fs_sync_ex - Same as fs_sync() on volume @vol
+ * @vol: Volume
+ *
+ * The operations on a volume can be called from several threads. Callers of
+ * fs_sync_ex() and fs_fsync_ex() that arrive while the volume is being
+ * synchronized wait together, then are all served by a single write-back and
+ * disk flush (group commit). The other operations go on during the disk flush,
+ * except on disks in memory (whose backend has &block_ops.map), which are
+ * flushed from the memory that they change.
+ */
+int fs_sync_ex(fs_volume_t *vol);
+
+/** fs_fsync_ex - Same as fs_fsync() on volume @vol */
+int fs_fsync_ex(fs_volume_t *vol, int fd);
+
+/**
+ * struct fs_sync_stats - Group commit counters of a volume
+ * @requests: Calls to fs_sync_ex() and fs_fsync_ex()
+ * @commits: Write-backs followed by a disk flush that served them
+ */
+struct fs_sync_stats {
+	size_t requests;
+	size_t commits;
+};
+
+/**
+ * fs_sync_stats_ex - Get group commit counters of volume @vol
+ * @vol: Volume
+ * @stats: Counters to fill in
+ *
+ * Return: -1 if @vol or @stats is NULL. 0 otherwise.
+ */
+int fs_sync_stats_ex(fs_volume_t *vol, struct fs_sync_stats *stats);
+
+/**
+ * struct fs_writeback_stats - Background writeback counters of a volume
+ * @wakeups: Times the writeback thread woke up
+ * @expired: Write-backs of the blocks dirty for longer than the expiry delay
+ * @background: Write-backs of every dirty block, because too much of the cache
+ * was dirty
+ * @blocks: Cached blocks written back by the thread
+ * @throttled: Calls to fs_write() that waited for the thread
+ * @throttle_ns: Time spent waiting by these calls, in nanoseconds
+ */
+struct fs_writeback_stats {
+	size_t wakeups;
+	size_t expired;
+	size_t background;
+	size_t blocks;
+	size_t throttled;
+	unsigned long long throttle_ns;
+};
+
+/**
+ * fs_writeback_stats_ex - Get background writeback counters of volume @vol
+ * @vol: Volume
+ * @stats: Counters to fill in, all zero without background writeback
+ *
+ * Return: -1 if @vol or @stats is NULL. 0 otherwise.
+ */
+int fs_writeback_stats_ex(fs_volume_t *vol, struct fs_writeback_stats *stats);
+
+/**
+ * fs_journal_stats_ex - Get journal counters of volume @vol
+ * @vol: Volume
+ * @stats: Counters to fill in, all zero without a journal
+ *
+ * Return: -1 if @vol or @stats is NULL. 0 otherwise.
+ */
+int fs_journal_stats_ex(fs_volume_t *vol, struct journal_stats *stats);
+
+/**
+ * fs_cache_stats_ex - Get block cache counters of volume @vol
+ * @vol: Volume
+ * @stats: Counters to fill in
+ *
+ * Return: -1 if @vol or @stats is NULL. 0 otherwise.
+ */
+int fs_cache_stats_ex(fs_volume_t *vol, struct cache_stats *stats);
+
+/** fs_info_ex - Same as fs_info() on volume @vol */
+int fs_info_ex(fs_volume_t *vol);
+
+/** fs_statfs_ex - Same as fs_statfs() on volume @vol */
+int fs_statfs_ex(fs_volume_t *vol, struct fs_statfs *st);
+
+/** fs_create_ex - Same as fs_create() on volume @vol */
+int fs_create_ex(fs_volume_t *vol, const char *filename);
+
+/** fs_delete_ex - Same as fs_delete() on volume @vol */
+int fs_delete_ex(fs_volume_t *vol, const char *filename);
+
+/** fs_ls_ex - Same as fs_ls() on volume @vol */
+int fs_ls_ex(fs_volume_t *vol);
+
+/**
+ * fs_open_ex - Same as fs_open() on volume @vol
+ *
+ * File descriptors are local to @vol and can only be used with the fs_*_ex()
+ * functions of the same volume.
+ */
+int fs_open_ex(fs_volume_t *vol, const char *filename);
+
+/** fs_close_ex - Same as fs_close() on volume @vol */
+int fs_close_ex(fs_volume_t *vol, int fd);
+
+/** fs_stat_ex - Same as fs_stat() on volume @vol */
+int fs_stat_ex(fs_volume_t *vol, int fd);
+
+/** fs_lseek_ex - Same as fs_lseek() on volume @vol */
+int fs_lseek_ex(fs_volume_t *vol, int fd, size_t offset);
+
+/** fs_write_ex - Same as fs_write() on volume @vol */
+int fs_write_ex(fs_volume_t *vol, int fd, void *buf, size_t count);
+
+/** fs_read_ex - Same as fs_read() on volume @vol */
+int fs_read_ex(fs_volume_t *vol, int fd, void *buf, size_t count);
+
 #endif /* _FS_H */
@@ -0,0 +1,395 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32c.h"
+#include "disk.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC "ECS150JL"
+
+/* Types of the journal blocks */
+enum {
+	JOURNAL_SUPER = 1,
+	JOURNAL_DESCRIPTOR,
+	JOURNAL_COMMIT,
+};
+
+/* Header of every journal block but the copies of the blocks logged */
+struct __attribute__((__packed__)) journal_header {
+	char magic[8];
+	uint32_t type;
+	uint32_t sequence;
+	/*
+	 * Superblock: position of the oldest transaction in the region.
+	 * Descriptor and commit: number of blocks logged.
+	 */
+	uint32_t count;
+	/*
+	 * Superblock: CRC32C of the block with this field at 0. Commit: CRC32C of
+	 * the descriptor and the copies. Descriptor: unused.
+	 */
+	uint32_t checksum;
+};
+
+/* Blocks listed by a descriptor, as absolute block indices */
+#define JOURNAL_TAGS ((BLOCK_SIZE - sizeof(struct journal_header)) / sizeof(uint32_t))
+
+/* Journal instance */
+struct journal {
+	struct disk *disk;
+	/* Region, the superblock at @start */
+	size_t start;
+	size_t count;
+	/* Position and sequence number of the next transaction */
+	size_t head;
+	uint32_t sequence;
+	/* Transactions were committed since the journal was last emptied */
+	int dirty;
+	/* Descriptor and commit blocks being written or read */
+	struct journal_header *desc;
+	struct journal_header *commit;
+	struct journal_stats stats;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t *journal_tags(struct journal_header *hdr)
+{
+	return (uint32_t *)(hdr + 1);
+}
+
+/* Fill in the header of block @buf, clearing the rest of it */
+static void journal_header_init(void *buf, uint32_t type, uint32_t sequence,
+				uint32_t count)
+{
+	struct journal_header *hdr = buf;
+
+	memset(buf, 0, BLOCK_SIZE);
+	memcpy(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic));
+	hdr->type = type;
+	hdr->sequence = sequence;
+	hdr->count = count;
+}
+
+static int journal_header_valid(const struct journal_header *hdr,
+				uint32_t type, uint32_t sequence)
+{
+	return !memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) &&
+		hdr->type == type && hdr->sequence == sequence;
+}
+
+/*
+ * Write the superblock of the journal at @start, telling that replay starts
+ * at position @head with transaction @sequence, and make it durable
+ */
+static int write_super(struct disk *d, size_t start, size_t head,
+		       uint32_t sequence)
+{
+	struct journal_header *hdr;
+	int ret = -1;
+
+	hdr = block_buf_alloc(1);
+	if (!hdr)
+		return -1;
+
+	journal_header_init(hdr, JOURNAL_SUPER, sequence, head);
+	hdr->checksum = crc32c(0, hdr, BLOCK_SIZE);
+	if (!disk_write(d, start, hdr) && !disk_csum_sync(d))
+		ret = disk_sync_range(d, start, 1);
+
+	block_buf_free(hdr);
+	return ret;
+}
+
+size_t journal_min_blocks(size_t max)
+{
+	/* Superblock, descriptor, copies and commit */
+	return 1 + 1 + max + 1;
+}
+
+int journal_format(struct disk *d, size_t start, size_t count)
+{
+	if (count < journal_min_blocks(1))
+		return -1;
+
+	return write_super(d, start, 1, 1);
+}
+
+/*
+ * Check the transaction at the head of @j, whose blocks are at the same
+ * position in @region as in the region of the journal. Unless @loaded, the
+ * descriptor only is there, and the copies and the commit block are read.
+ * Returns the number of blocks
+ * it logs, or -1 if there is no valid transaction there.
+ */
+static long read_transaction(struct journal *j, char *region, int loaded)
+{
+	size_t room = j->count - j->head, n, i;
+	struct journal_header *desc, *commit;
+	uint32_t *tags, crc;
+
+	desc = (struct journal_header *)(region + j->head * BLOCK_SIZE);
+	if (room < 2 ||
+	    !journal_header_valid(desc, JOURNAL_DESCRIPTOR, j->sequence))
+		return -1;
+
+	n = desc->count;
+	if (n > room - 2 || n > JOURNAL_TAGS)
+		return -1;
+
+	/* Blocks in place, outside of the journal */
+	tags = journal_tags(desc);
+	for (i = 0; i < n; i++)
+		if (tags[i] >= (size_t)disk_count(j->disk) ||
+		    (tags[i] >= j->start && tags[i] < j->start + j->count))
+			return -1;
+
+	if (!loaded && disk_read_range(j->disk, j->start + j->head + 1, n + 1,
+				       (char *)desc + BLOCK_SIZE))
+		return -1;
+
+	commit = (struct journal_header *)((char *)desc + (n + 1) * BLOCK_SIZE);
+	crc = crc32c(0, desc, (n + 1) * BLOCK_SIZE);
+	if (!journal_header_valid(commit, JOURNAL_COMMIT, j->sequence) ||
+	    commit->count != n || commit->checksum != crc)
+		return -1;
+
+	return n;
+}
+
+/*
+ * Write the transactions found from the head of @j on in place. Only the last
+ * copy of each block is written, all at once.
+ */
+static int replay(struct journal *j)
+{
+	unsigned long long start = now_ns();
+	struct block_iovec *bvec = NULL;
+	size_t nvec = 0, i, k;
+	char *region, *copy;
+	uint32_t *tags;
+	int loaded = 0, ret = -1;
+	long n;
+
+	region = block_buf_alloc(j->count);
+	if (!region)
+		goto out;
+
+	/*
+	 * Nothing to replay after a clean unmount, as found in the first block.
+	 * Otherwise the rest of the region is read at once, or a transaction at a
+	 * time if some of it cannot be read, such as blocks of a checksummed disk
+	 * written but not committed.
+	 */
+	if (disk_read(j->disk, j->start + j->head, region + j->head * BLOCK_SIZE) ||
+	    !journal_header_valid((struct journal_header *)(region + j->head * BLOCK_SIZE),
+				  JOURNAL_DESCRIPTOR, j->sequence)) {
+		ret = 0;
+		goto out;
+	}
+	loaded = j->head + 1 == j->count ||
+		!disk_read_range(j->disk, j->start + j->head + 1,
+				 j->count - j->head - 1,
+				 region + (j->head + 1) * BLOCK_SIZE);
+
+	bvec = malloc(j->count * sizeof(*bvec));
+	if (!bvec) {
+		perror("malloc");
+		goto out;
+	}
+
+	while ((n = read_transaction(j, region, loaded)) >= 0) {
+		tags = journal_tags((struct journal_header *)(region + j->head * BLOCK_SIZE));
+		for (i = 0; i < (size_t)n; i++) {
+			copy = region + (j->head + 1 + i) * BLOCK_SIZE;
+			for (k = 0; k < nvec && bvec[k].block != tags[i]; k++)
+				;
+			if (k == nvec)
+				bvec[nvec++].block = tags[i];
+			bvec[k].buf = copy;
+		}
+		j->head += n + 2;
+		j->sequence++;
+		j->stats.replayed++;
+		j->stats.replayed_blocks += n;
+		if (!loaded && j->head < j->count &&
+		    disk_read(j->disk, j->start + j->head,
+			      region + j->head * BLOCK_SIZE))
+			break;
+	}
+
+	/* Start over once everything is durable in place */
+	block_iovec_sort(bvec, nvec);
+	if ((nvec && disk_writev(j->disk, bvec, nvec)) ||
+	    disk_csum_sync(j->disk) ||
+	    disk_sync_range(j->disk, 0, disk_count(j->disk)) ||
+	    write_super(j->disk, j->start, 1, j->sequence))
+		goto out;
+	j->head = 1;
+	ret = 0;
+
+out:
+	j->stats.replay_ns = now_ns() - start;
+	free(bvec);
+	block_buf_free(region);
+	return ret;
+}
+
+struct journal *journal_open(struct disk *d, size_t start, size_t count)
+{
+	struct journal *j;
+	uint32_t crc;
+
+	if (count < journal_min_blocks(1))
+		return NULL;
+
+	j = calloc(1, sizeof(*j));
+	if (!j) {
+		perror("calloc");
+		return NULL;
+	}
+	j->disk = d;
+	j->start = start;
+	j->count = count;
+	j->desc = block_buf_alloc(1);
+	j->commit = block_buf_alloc(1);
+	/*
+	 * The journal checks its blocks itself, and must stay readable after a
+	 * crash between the write of its superblock and that of its checksum
+	 */
+	if (!j->desc || !j->commit || disk_csum_exclude(d, start, count) ||
+	    disk_read(d, start, j->desc))
+		goto fail;
+
+	crc = j->desc->checksum;
+	j->desc->checksum = 0;
+	if (!journal_header_valid(j->desc, JOURNAL_SUPER, j->desc->sequence) ||
+	    crc32c(0, j->desc, BLOCK_SIZE) != crc ||
+	    j->desc->count < 1 || j->desc->count > count)
+		goto fail;
+	/* Left at the end of the region by earlier checkpoints, nothing follows */
+	j->head = j->desc->count == count ? 1 : j->desc->count;
+	j->sequence = j->desc->sequence;
+
+	if (replay(j))
+		goto fail;
+
+	return j;
+
+fail:
+	journal_close(j);
+	return NULL;
+}
+
+void journal_close(struct journal *j)
+{
+	if (!j)
+		return;
+
+	block_buf_free(j->desc);
+	block_buf_free(j->commit);
+	free(j);
+}
+
+int journal_commit(struct journal *j, const struct block_iovec *bvec,
+		   size_t count)
+{
+	struct block_iovec *wvec;
+	uint32_t *tags, crc;
+	size_t i;
+	int ret = -1;
+
+	if (journal_min_blocks(count) > j->count || count > JOURNAL_TAGS)
+		return -1;
+
+	/*
+	 * Out of room, or at the very end of the region: the transactions at the
+	 * start of the region were written in place, make them durable before
+	 * they are overwritten
+	 */
+	if (j->head == j->count || j->head + count + 2 > j->count) {
+		if (disk_csum_sync(j->disk) ||
+		    disk_sync_range(j->disk, 0, disk_count(j->disk)) ||
+		    write_super(j->disk, j->start, 1, j->sequence))
+			return -1;
+		j->head = 1;
+		j->stats.wraps++;
+	}
+
+	wvec = malloc((count + 2) * sizeof(*wvec));
+	if (!wvec) {
+		perror("malloc");
+		return -1;
+	}
+
+	journal_header_init(j->desc, JOURNAL_DESCRIPTOR, j->sequence, count);
+	tags = journal_tags(j->desc);
+	for (i = 0; i < count; i++)
+		tags[i] = bvec[i].block;
+	crc = crc32c(0, j->desc, BLOCK_SIZE);
+	for (i = 0; i < count; i++)
+		crc = crc32c(crc, bvec[i].buf, BLOCK_SIZE);
+	journal_header_init(j->commit, JOURNAL_COMMIT, j->sequence, count);
+	j->commit->checksum = crc;
+
+	wvec[0].block = j->start + j->head;
+	wvec[0].buf = j->desc;
+	for (i = 0; i < count; i++) {
+		wvec[1 + i].block = j->start + j->head + 1 + i;
+		wvec[1 + i].buf = bvec[i].buf;
+	}
+	wvec[count + 1].block = j->start + j->head + 1 + count;
+	wvec[count + 1].buf = j->commit;
+
+	/*
+	 * The commit block is written along with the rest, as its checksum tells
+	 * whether it all made it. The data written before the transaction is made
+	 * durable with it.
+	 */
+	if (disk_writev(j->disk, wvec, count + 2) || disk_csum_sync(j->disk) ||
+	    disk_sync_range(j->disk, 0, disk_count(j->disk)))
+		goto out;
+
+	j->head += count + 2;
+	j->sequence++;
+	j->dirty = 1;
+	j->stats.commits++;
+	j->stats.blocks += count;
+	ret = 0;
+
+out:
+	free(wvec);
+	return ret;
+}
+
+int journal_checkpoint(struct journal *j)
+{
+	if (!j->dirty)
+		return 0;
+
+	/* A transaction may have filled the region up to its last block */
+	if (j->head == j->count)
+		j->head = 1;
+	if (disk_csum_sync(j->disk) ||
+	    disk_sync_range(j->disk, 0, disk_count(j->disk)) ||
+	    write_super(j->disk, j->start, j->head, j->sequence))
+		return -1;
+
+	j->dirty = 0;
+	return 0;
+}
+
+void journal_stats_get(struct journal *j, struct journal_stats *stats)
+{
+	*stats = j->stats;
+}
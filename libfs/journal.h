@@ -0,0 +1,131 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "disk.h"
+
+/**
+ * DOC: Metadata journal
+ *
+ * The journal is a circular region of the disk where sets of blocks are
+ * logged before they are written in place, so that they reach the disk all
+ * or none: if the writes in place are interrupted, replaying the journal
+ * redoes them. The first block of the region is a journal superblock telling
+ * where the oldest transaction to replay starts, and with which sequence
+ * number. Each transaction follows with a descriptor block listing the blocks
+ * logged, a copy of each of them, and a commit block holding a CRC32C of the
+ * descriptor and the copies. Transactions are numbered in sequence, so that
+ * replay stops at the first one that is torn, or that was written during an
+ * earlier pass over the region. Replaying thus reads the journal only,
+ * whatever the size of the disk.
+ *
+ * All the blocks of the journal are blocks of the disk (BLOCK_SIZE).
+ */
+
+/** Opaque handle of a journal */
+struct journal;
+
+/**
+ * struct journal_stats - Journal counters
+ * @commits: Transactions committed
+ * @blocks: Blocks logged by these transactions, descriptors and commits
+ * excluded
+ * @wraps: Times the journal went back to the start of its region, after
+ * making sure that every transaction was written in place
+ * @replayed: Transactions replayed when the journal was opened
+ * @replayed_blocks: Blocks written in place by these transactions
+ * @replay_ns: Time taken to replay the journal, in nanoseconds
+ */
+struct journal_stats {
+	size_t commits;
+	size_t blocks;
+	size_t wraps;
+	size_t replayed;
+	size_t replayed_blocks;
+	unsigned long long replay_ns;
+};
+
+/**
+ * journal_min_blocks - Get the smallest size of a journal
+ * @max: Largest number of blocks logged by a single transaction
+ *
+ * Return: Number of blocks the region of a journal needs to hold its
+ * superblock and one transaction of @max blocks.
+ */
+size_t journal_min_blocks(size_t max);
+
+/**
+ * journal_format - Set up an empty journal
+ * @d: Disk
+ * @start: First block of the region of the journal
+ * @count: Number of blocks of the region
+ *
+ * Return: -1 if the journal superblock cannot be written. 0 otherwise.
+ */
+int journal_format(struct disk *d, size_t start, size_t count);
+
+/**
+ * journal_open - Open a journal and replay it
+ * @d: Disk
+ * @start: First block of the region of the journal
+ * @count: Number of blocks of the region
+ *
+ * The transactions found in the journal are written in place, in order, and
+ * flushed to stable storage along with the checksums of the disk, if any.
+ * The journal is then emptied. Its region is left out of the checksums of the
+ * disk (see disk_csum_exclude()), as the journal checks its blocks itself.
+ *
+ * Return: NULL if the journal superblock is invalid, or if the journal cannot
+ * be replayed. The journal otherwise.
+ */
+struct journal *journal_open(struct disk *d, size_t start, size_t count);
+
+/**
+ * journal_close - Release a journal
+ * @j: Journal, or NULL
+ *
+ * The transactions logged are left in the journal, see journal_checkpoint().
+ */
+void journal_close(struct journal *j);
+
+/**
+ * journal_commit - Log a set of blocks
+ * @j: Journal
+ * @bvec: Blocks, at most the @max given to journal_min_blocks() for the size
+ * of the journal
+ * @count: Number of blocks of @bvec
+ *
+ * Once the transaction is durable, that is once its blocks, their checksums if
+ * any, and the commit block are flushed to stable storage, the blocks can be
+ * written in place. They must be before the next call, which may reuse the
+ * space of the transaction if the journal is full.
+ *
+ * Return: -1 if @bvec is too large for the journal, or if the transaction
+ * cannot be made durable. 0 otherwise.
+ */
+int journal_commit(struct journal *j, const struct block_iovec *bvec,
+		   size_t count);
+
+/**
+ * journal_checkpoint - Empty a journal
+ * @j: Journal
+ *
+ * Flush the disk to stable storage, so that the blocks of every transaction
+ * are there in place, then mark the journal as empty. Nothing is replayed
+ * after a checkpoint, and the disk can be modified by programs that do not
+ * know about the journal.
+ *
+ * Return: -1 if the disk or the journal superblock cannot be written. 0
+ * otherwise.
+ */
+int journal_checkpoint(struct journal *j);
+
+/**
+ * journal_stats_get - Get the counters of a journal
+ * @j: Journal
+ * @stats: Counters to fill in
+ */
+void journal_stats_get(struct journal *j, struct journal_stats *stats);
+
+#endif /* _JOURNAL_H */
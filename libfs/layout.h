@@ -0,0 +1,74 @@
+#ifndef _LAYOUT_H
+#define _LAYOUT_H
+
+#include <stdint.h>
+
+#include "disk.h"
+#include "fs.h"
+
+/*
+ * On-disk layout of ECS150FS, shared by the file system (fs.c) and the
+ * checker (check.c)
+ */
+
+#define FAT_EOC 0xFFFF
+
+// optional features, recorded in the superblock
+#define FS_FEATURE_CSUM 0x01
+// data blocks may be shared between files
+#define FS_FEATURE_DEDUP 0x02
+// the free counts of the superblock are maintained
+#define FS_FEATURE_COUNTS 0x04
+// the FAT, the root directory and the superblock are journaled
+#define FS_FEATURE_JOURNAL 0x08
+
+struct __attribute__((__packed__)) superblock {
+    char signature[8];
+    uint16_t virtual_disk_blocks_count;
+    uint16_t root_directory_block_index;
+    uint16_t data_block_start_index;
+    uint16_t data_blocks_count;
+    uint8_t fat_blocks_count;
+    // extensions, stored in what used to be padding
+    uint8_t features;
+    // checksum region (FS_FEATURE_CSUM), as absolute block indices
+    uint16_t csum_block_start;
+    uint16_t csum_blocks_count;
+    // log2 of the block size, 0 for 4 KiB blocks. all the block counts and
+    // indices of the superblock and the FAT are in blocks of that size, each
+    // spanning one or more blocks of the disk (BLOCK_SIZE)
+    uint8_t block_shift;
+    // free data blocks and root directory entries (FS_FEATURE_COUNTS), written
+    // together with the FAT and the root directory they describe
+    uint16_t free_blocks_count;
+    uint8_t free_entries_count;
+    // journal region (FS_FEATURE_JOURNAL), as absolute block indices
+    uint16_t journal_block_start;
+    uint16_t journal_blocks_count;
+    char padding[BLOCK_SIZE - 30];
+};
+
+// root directory entry flags
+#define RD_COMPRESSED 0x01
+
+// compressed files are stored as groups of GROUP_SIZE bytes, each compressed
+// on its own. the first block of their chain is an index holding the stored
+// size of each group in bytes, with GROUP_RAW set for groups that did not
+// compress and are stored as is. the groups follow in order, each in as few
+// blocks as its stored size needs
+#define GROUP_SIZE 65536
+#define GROUP_RAW 0x80000000u
+// most blocks of a group, with the smallest block size
+#define GROUP_BLOCKS_MAX (GROUP_SIZE / FS_BLOCK_SIZE_MIN)
+
+struct __attribute__((__packed__)) root_dir {
+    char filename[16];
+    uint32_t file_size;
+    uint16_t first_data_block_index;
+    uint8_t flags;
+    char padding[9];
+};
+
+typedef struct superblock super_block;
+
+#endif /* _LAYOUT_H */
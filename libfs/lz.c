@@ -0,0 +1,221 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Shortest back-reference */
+#define MIN_MATCH 4
+
+/* Trailing bytes always emitted as literals, so matches can read ahead */
+#define LAST_LITERALS 8
+
+/* Hash table of recent positions */
+#define HASH_BITS 13
+
+/* Entropy, in 1/256 bits per byte, above which data is deemed incompressible */
+#define ENTROPY_MAX (7 * 256 + 128)
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* Emit the extension bytes of a length whose 4-bit field saturated */
+static unsigned char *put_length(unsigned char *op, unsigned char *end,
+				 size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= end)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= end)
+		return NULL;
+	*op++ = len;
+
+	return op;
+}
+
+/*
+ * Each sequence is a token (literal run length in the high nibble, match
+ * length minus %MIN_MATCH in the low one, 15 meaning that extension bytes
+ * follow), the literals, then the 16-bit little endian offset of the match.
+ * The last sequence only has literals.
+ */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *end,
+				   const unsigned char *lit, size_t nlit,
+				   size_t offset, size_t mlen)
+{
+	unsigned char *token;
+
+	if (op >= end)
+		return NULL;
+	token = op++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15 && !(op = put_length(op, end, nlit - 15)))
+		return NULL;
+
+	if ((size_t)(end - op) < nlit)
+		return NULL;
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	/* Last sequence */
+	if (!mlen)
+		return op;
+
+	if (end - op < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	mlen -= MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15 && !(op = put_length(op, end, mlen - 15)))
+		return NULL;
+
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const unsigned char *in = src, *ip = in, *anchor = in, *ref;
+	const unsigned char *limit = in + len - LAST_LITERALS;
+	unsigned char *op = dst, *end = op + cap;
+	int32_t table[1 << HASH_BITS];
+	size_t mlen;
+	unsigned h;
+
+	if (len > LZ_MAX_INPUT)
+		return 0;
+
+	memset(table, 0xff, sizeof(table));
+
+	while (len > LAST_LITERALS + MIN_MATCH &&
+	       ip + MIN_MATCH <= limit) {
+		h = hash(read32(ip));
+		ref = table[h] < 0 ? NULL : in + table[h];
+		table[h] = ip - in;
+
+		if (!ref || read32(ref) != read32(ip)) {
+			/* Skip faster through data that does not match */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		mlen = MIN_MATCH;
+		while (ip + mlen < limit && ref[mlen] == ip[mlen])
+			mlen++;
+
+		op = put_sequence(op, end, anchor, ip - anchor, ip - ref, mlen);
+		if (!op)
+			return 0;
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = put_sequence(op, end, anchor, in + len - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (unsigned char *)dst;
+}
+
+/* Read the extension bytes of a saturated length */
+static int get_length(const unsigned char **ip, const unsigned char *end,
+		      size_t *len)
+{
+	unsigned char b;
+
+	do {
+		if (*ip >= end)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+long lz_decompress(const void *src, size_t clen, void *dst, size_t cap)
+{
+	const unsigned char *ip = src, *iend = ip + clen;
+	unsigned char *op = dst, *oend = op + cap;
+	size_t nlit, mlen, offset;
+	unsigned char token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		nlit = token >> 4;
+		if (nlit == 15 && get_length(&ip, iend, &nlit))
+			return -1;
+		if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+			return -1;
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		/* Last sequence */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!offset || offset > (size_t)(op - (unsigned char *)dst))
+			return -1;
+
+		mlen = token & 15;
+		if (mlen == 15 && get_length(&ip, iend, &mlen))
+			return -1;
+		mlen += MIN_MATCH;
+		if ((size_t)(oend - op) < mlen)
+			return -1;
+
+		/* Byte by byte, as the match may overlap its own output */
+		for (; mlen; mlen--, op++)
+			*op = op[-offset];
+	}
+
+	return op - (unsigned char *)dst;
+}
+
+/* log2(@x) in 1/256 units, interpolated linearly between powers of two */
+static unsigned log2_q8(unsigned x)
+{
+	unsigned msb = 31 - __builtin_clz(x);
+
+	return msb * 256 + (((uint64_t)x << 8 >> msb) & 0xff);
+}
+
+int lz_compressible(const void *src, size_t len)
+{
+	const unsigned char *p = src;
+	size_t count[256] = { 0 };
+	uint64_t sum = 0;
+	size_t i;
+
+	if (!len)
+		return 0;
+
+	for (i = 0; i < len; i++)
+		count[p[i]]++;
+
+	/* H = log2(len) - sum(c * log2(c)) / len */
+	for (i = 0; i < 256; i++)
+		if (count[i])
+			sum += (uint64_t)count[i] * log2_q8(count[i]);
+
+	return log2_q8(len) - sum / len <= ENTROPY_MAX;
+}
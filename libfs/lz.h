@@ -0,0 +1,49 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Largest input accepted by lz_compress(), bounded by 16-bit match offsets */
+#define LZ_MAX_INPUT 65536
+
+/**
+ * lz_compress - Compress a buffer with the built-in LZ codec
+ * @src: Data to compress
+ * @len: Number of bytes of @src, at most %LZ_MAX_INPUT
+ * @dst: Buffer receiving the compressed data
+ * @cap: Size of @dst
+ *
+ * The codec is a byte-oriented LZ77 variant (literal runs and back-references
+ * of at least 4 bytes within the input), favoring speed over ratio.
+ *
+ * Return: 0 if @len is too large or if the compressed data does not fit in
+ * @cap bytes. The size of the compressed data otherwise.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress data produced by lz_compress()
+ * @src: Compressed data
+ * @clen: Number of bytes of @src
+ * @dst: Buffer receiving the original data
+ * @cap: Size of @dst
+ *
+ * Return: -1 if @src is malformed or does not fit in @cap bytes. The size of
+ * the original data otherwise.
+ */
+long lz_decompress(const void *src, size_t clen, void *dst, size_t cap);
+
+/**
+ * lz_compressible - Quickly estimate whether data is worth compressing
+ * @src: Data to examine
+ * @len: Number of bytes of @src
+ *
+ * Estimate the Shannon entropy of the bytes of @src. Data close to 8 bits of
+ * entropy per byte (already compressed or encrypted data) is not worth
+ * running through lz_compress().
+ *
+ * Return: 1 if @src looks compressible, 0 otherwise.
+ */
+int lz_compressible(const void *src, size_t len);
+
+#endif /* _LZ_H */